@@ -0,0 +1,155 @@
+/* Twine: Per-job memory arena
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libtwine.h"
+
+/* The arena is a stack of blocks, newest first; each block records the
+ * arena offset at which it begins, so that a mark (an offset) can be
+ * released by discarding the blocks which begin after it.
+ */
+struct twine_arena_block_struct
+{
+	struct twine_arena_block_struct *next;
+	size_t base;
+	size_t used;
+	size_t size;
+	char data[1];
+};
+
+#define ARENA_BLOCK_SIZE                16384
+#define ARENA_ALIGN                     16
+
+/* Public: allocate zero-filled memory which will be released when the
+ * current job finishes
+ */
+void *
+twine_job_alloc(TWINE *context, size_t size)
+{
+	TWINEARENABLOCK *block;
+	size_t bsize, pad;
+	char *p;
+
+	if(!size)
+	{
+		size = 1;
+	}
+	pthread_mutex_lock(&(context->arena_lock));
+	block = context->arena;
+	pad = 0;
+	if(block)
+	{
+		pad = (ARENA_ALIGN - ((uintptr_t) &(block->data[block->used]) & (ARENA_ALIGN - 1))) & (ARENA_ALIGN - 1);
+	}
+	if(!block || block->size - block->used < pad + size)
+	{
+		bsize = (size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE) + ARENA_ALIGN;
+		block = (TWINEARENABLOCK *) malloc(sizeof(TWINEARENABLOCK) + bsize);
+		if(!block)
+		{
+			pthread_mutex_unlock(&(context->arena_lock));
+			twine_logf(LOG_CRIT, "failed to allocate %lu bytes for job memory\n", (unsigned long) bsize);
+			return NULL;
+		}
+		block->next = context->arena;
+		block->base = (context->arena ? context->arena->base + context->arena->used : 0);
+		block->used = 0;
+		block->size = bsize;
+		context->arena = block;
+		pad = (ARENA_ALIGN - ((uintptr_t) block->data & (ARENA_ALIGN - 1))) & (ARENA_ALIGN - 1);
+	}
+	p = &(block->data[block->used + pad]);
+	block->used += pad + size;
+	pthread_mutex_unlock(&(context->arena_lock));
+	memset(p, 0, size);
+	return p;
+}
+
+/* Public: duplicate a string into memory which will be released when the
+ * current job finishes
+ */
+char *
+twine_job_strdup(TWINE *context, const char *str)
+{
+	size_t len;
+	char *p;
+
+	len = strlen(str);
+	p = (char *) twine_job_alloc(context, len + 1);
+	if(!p)
+	{
+		return NULL;
+	}
+	memcpy(p, str, len);
+	return p;
+}
+
+/* Public: obtain a mark which can be passed to twine_job_release() in order
+ * to release everything allocated after this point
+ */
+size_t
+twine_job_mark(TWINE *context)
+{
+	size_t mark;
+
+	pthread_mutex_lock(&(context->arena_lock));
+	mark = (context->arena ? context->arena->base + context->arena->used : 0);
+	pthread_mutex_unlock(&(context->arena_lock));
+	return mark;
+}
+
+/* Public: release the job memory allocated since a mark was obtained */
+int
+twine_job_release(TWINE *context, size_t mark)
+{
+	TWINEARENABLOCK *block;
+
+	pthread_mutex_lock(&(context->arena_lock));
+	/* The oldest block (whose base is always zero) is retained for re-use */
+	while(context->arena && context->arena->base > mark)
+	{
+		block = context->arena;
+		context->arena = block->next;
+		free(block);
+	}
+	if(context->arena && mark - context->arena->base < context->arena->used)
+	{
+		context->arena->used = mark - context->arena->base;
+	}
+	pthread_mutex_unlock(&(context->arena_lock));
+	return 0;
+}
+
+/* Private: free all of the blocks belonging to a context's arena */
+int
+twine_arena_cleanup_(TWINE *context)
+{
+	TWINEARENABLOCK *block;
+
+	while(context->arena)
+	{
+		block = context->arena;
+		context->arena = block->next;
+		free(block);
+	}
+	return 0;
+}
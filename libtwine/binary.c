@@ -0,0 +1,657 @@
+/* Twine: Binary quad interchange format
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libtwine.h"
+
+/* The binary quad format is intended for passing data between Twine
+ * instances, where it avoids the cost of serialising and re-parsing text.
+ *
+ * A stream begins with the four-byte signature "TWQ\1", and is followed by
+ * a sequence of blocks, each consisting of a type byte, the length of the
+ * block's payload and the payload itself. All integers are unsigned LEB128
+ * varints. Streams may be concatenated.
+ *
+ *   'T' Term definitions: each term is assigned the next identifier in
+ *       sequence, starting from 1, and is encoded as a kind byte followed
+ *       by the length of its string and the string itself; language-tagged
+ *       literals are followed by the length and string of the language tag,
+ *       and typed literals by the identifier of their datatype URI (which
+ *       may be defined later in the same block).
+ *   'G' Graph boundary: the identifier of the graph which the following
+ *       quads belong to, or zero for the default graph.
+ *   'Q' Quads: subject, predicate and object identifiers for each quad.
+ *   'E' End of stream (no payload).
+ *
+ * Nodes are only created for terms when they are first used by a quad.
+ */
+
+#define BINARY_SIGNATURE                "TWQ\1"
+#define BINARY_SIGNATURE_LEN            4
+
+#define BINARY_BLOCK_TERMS              'T'
+#define BINARY_BLOCK_GRAPH              'G'
+#define BINARY_BLOCK_QUADS              'Q'
+#define BINARY_BLOCK_END                'E'
+
+#define BINARY_TERM_URI                 1
+#define BINARY_TERM_BLANK               2
+#define BINARY_TERM_LITERAL             3
+#define BINARY_TERM_LANG                4
+#define BINARY_TERM_TYPED               5
+
+/* The number of quads written in each quads block */
+#define BINARY_QUADS_PER_BLOCK          4096
+
+struct binary_buf_struct
+{
+	unsigned char *buf;
+	size_t len;
+	size_t size;
+};
+
+struct binary_term_struct
+{
+	int kind;
+	const char *str;
+	size_t len;
+	const char *lang;
+	size_t langlen;
+	size_t datatype;
+	librdf_node *node;
+};
+
+struct binary_reader_struct
+{
+	librdf_world *world;
+	TWINESTATEMENTFN fn;
+	void *data;
+	struct binary_term_struct *terms;
+	size_t nterms;
+	size_t termsize;
+	librdf_node *graph;
+};
+
+static int binary_write_terms_(struct binary_buf_struct *out, struct binary_buf_struct *block, TWINEQUADS *quads);
+static int binary_write_quads_(struct binary_buf_struct *out, struct binary_buf_struct *block, TWINEQUADS *quads);
+static int binary_block_(struct binary_buf_struct *out, int type, struct binary_buf_struct *block);
+static int binary_put_(struct binary_buf_struct *buf, const void *p, size_t len);
+static int binary_varint_(struct binary_buf_struct *buf, size_t value);
+static int binary_string_(struct binary_buf_struct *buf, const char *str, size_t len);
+static const unsigned char *binary_get_varint_(const unsigned char *p, const unsigned char *end, size_t *value);
+static const unsigned char *binary_get_string_(const unsigned char *p, const unsigned char *end, const char **str, size_t *len);
+static int binary_read_terms_(struct binary_reader_struct *reader, const unsigned char *p, const unsigned char *end);
+static int binary_read_quads_(struct binary_reader_struct *reader, const unsigned char *p, const unsigned char *end);
+static librdf_node *binary_node_(struct binary_reader_struct *reader, size_t id);
+static void binary_reset_(struct binary_reader_struct *reader);
+
+/* Public: serialise a model in the binary quad format; the returned buffer
+ * must be freed with free()
+ */
+unsigned char *
+twine_rdf_model_binary(librdf_model *model, size_t *buflen)
+{
+	TWINEQUADS *quads;
+	struct binary_buf_struct out, block;
+
+	memset(&out, 0, sizeof(out));
+	memset(&block, 0, sizeof(block));
+	quads = twine_quads_create(model);
+	if(!quads)
+	{
+		return NULL;
+	}
+	if(binary_put_(&out, BINARY_SIGNATURE, BINARY_SIGNATURE_LEN) ||
+	   binary_write_terms_(&out, &block, quads) ||
+	   binary_write_quads_(&out, &block, quads) ||
+	   binary_block_(&out, BINARY_BLOCK_END, NULL))
+	{
+		twine_logf(LOG_ERR, "failed to serialise model as binary quads\n");
+		free(out.buf);
+		free(block.buf);
+		twine_quads_destroy(quads);
+		return NULL;
+	}
+	free(block.buf);
+	twine_quads_destroy(quads);
+	*buflen = out.len;
+	return out.buf;
+}
+
+/* Private: parse a buffer in the binary quad format, invoking fn for each
+ * statement
+ */
+int
+twine_binary_parse_(const char *buf, size_t buflen, TWINESTATEMENTFN fn, void *data)
+{
+	struct binary_reader_struct reader;
+	const unsigned char *p, *end;
+	size_t len, id;
+	int type, r;
+
+	memset(&reader, 0, sizeof(reader));
+	reader.world = twine_->world;
+	reader.fn = fn;
+	reader.data = data;
+	p = (const unsigned char *) buf;
+	end = p + buflen;
+	r = 0;
+	while(!r && p < end)
+	{
+		if((size_t) (end - p) < BINARY_SIGNATURE_LEN || memcmp(p, BINARY_SIGNATURE, BINARY_SIGNATURE_LEN))
+		{
+			twine_logf(LOG_ERR, "binary quads: missing stream signature\n");
+			r = -1;
+			break;
+		}
+		p += BINARY_SIGNATURE_LEN;
+		binary_reset_(&reader);
+		for(;;)
+		{
+			if(p >= end)
+			{
+				twine_logf(LOG_ERR, "binary quads: unexpected end of stream\n");
+				r = -1;
+				break;
+			}
+			type = *p;
+			p = binary_get_varint_(p + 1, end, &len);
+			if(!p || len > (size_t) (end - p))
+			{
+				twine_logf(LOG_ERR, "binary quads: truncated block\n");
+				r = -1;
+				break;
+			}
+			if(type == BINARY_BLOCK_END)
+			{
+				p += len;
+				break;
+			}
+			switch(type)
+			{
+			case BINARY_BLOCK_TERMS:
+				r = binary_read_terms_(&reader, p, p + len);
+				break;
+			case BINARY_BLOCK_GRAPH:
+				reader.graph = NULL;
+				if(!binary_get_varint_(p, p + len, &id))
+				{
+					twine_logf(LOG_ERR, "binary quads: truncated graph boundary\n");
+					r = -1;
+				}
+				else if(id && !(reader.graph = binary_node_(&reader, id)))
+				{
+					r = -1;
+				}
+				break;
+			case BINARY_BLOCK_QUADS:
+				r = binary_read_quads_(&reader, p, p + len);
+				break;
+			default:
+				/* Unknown blocks are skipped */
+				break;
+			}
+			if(r)
+			{
+				break;
+			}
+			p += len;
+		}
+	}
+	binary_reset_(&reader);
+	free(reader.terms);
+	return r;
+}
+
+/* Write the terms of a quad array, followed by any datatype URIs which
+ * aren't themselves terms in the array
+ */
+static int
+binary_write_terms_(struct binary_buf_struct *out, struct binary_buf_struct *block, TWINEQUADS *quads)
+{
+	TWINETERM id, nterms;
+	librdf_node *node, *dtnode;
+	librdf_uri *dt;
+	const char *str, *lang, **extra, **p;
+	size_t len, nextra, c;
+	size_t *extralen, *q;
+	int r;
+
+	extra = NULL;
+	extralen = NULL;
+	nextra = 0;
+	r = 0;
+	block->len = 0;
+	nterms = twine_quads_terms(quads);
+	for(id = 1; id < nterms && !r; id++)
+	{
+		if(!(node = twine_quads_node(quads, id)))
+		{
+			r = -1;
+			break;
+		}
+		if(librdf_node_is_resource(node))
+		{
+			str = (const char *) librdf_uri_as_counted_string(librdf_node_get_uri(node), &len);
+			r = binary_varint_(block, BINARY_TERM_URI) || binary_string_(block, str, len);
+			continue;
+		}
+		if(librdf_node_is_blank(node))
+		{
+			str = (const char *) librdf_node_get_counted_blank_identifier(node, &len);
+			r = binary_varint_(block, BINARY_TERM_BLANK) || binary_string_(block, str, len);
+			continue;
+		}
+		str = (const char *) librdf_node_get_literal_value_as_counted_string(node, &len);
+		if((dt = librdf_node_get_literal_value_datatype_uri(node)))
+		{
+			r = binary_varint_(block, BINARY_TERM_TYPED) || binary_string_(block, str, len);
+			if(r)
+			{
+				break;
+			}
+			str = (const char *) librdf_uri_as_counted_string(dt, &len);
+			dtnode = twine_rdf_node_intern_(str, len);
+			c = (dtnode ? twine_quads_term(quads, dtnode) : TWINE_TERM_NONE);
+			if(dtnode)
+			{
+				librdf_free_node(dtnode);
+			}
+			if(c == TWINE_TERM_NONE)
+			{
+				/* The datatype will be written after the other terms */
+				for(c = 0; c < nextra; c++)
+				{
+					if(extralen[c] == len && !memcmp(extra[c], str, len))
+					{
+						break;
+					}
+				}
+				if(c == nextra)
+				{
+					p = (const char **) realloc(extra, sizeof(const char *) * (nextra + 1));
+					if(p)
+					{
+						extra = p;
+					}
+					q = (size_t *) realloc(extralen, sizeof(size_t) * (nextra + 1));
+					if(q)
+					{
+						extralen = q;
+					}
+					if(!p || !q)
+					{
+						r = -1;
+						break;
+					}
+					extra[nextra] = str;
+					extralen[nextra] = len;
+					nextra++;
+				}
+				c += nterms;
+			}
+			r = binary_varint_(block, c);
+			continue;
+		}
+		if((lang = librdf_node_get_literal_value_language(node)) && *lang)
+		{
+			r = binary_varint_(block, BINARY_TERM_LANG) || binary_string_(block, str, len) ||
+				binary_string_(block, lang, strlen(lang));
+			continue;
+		}
+		r = binary_varint_(block, BINARY_TERM_LITERAL) || binary_string_(block, str, len);
+	}
+	for(c = 0; c < nextra && !r; c++)
+	{
+		r = binary_varint_(block, BINARY_TERM_URI) || binary_string_(block, extra[c], extralen[c]);
+	}
+	free(extra);
+	free(extralen);
+	if(r)
+	{
+		return -1;
+	}
+	return binary_block_(out, BINARY_BLOCK_TERMS, block);
+}
+
+/* Write the quads of a quad array, preceded by a graph boundary whenever
+ * the context changes
+ */
+static int
+binary_write_quads_(struct binary_buf_struct *out, struct binary_buf_struct *block, TWINEQUADS *quads)
+{
+	const TWINETERM *s, *p, *o, *g;
+	TWINETERM graph;
+	size_t count, c, n;
+
+	s = twine_quads_subjects(quads);
+	p = twine_quads_predicates(quads);
+	o = twine_quads_objects(quads);
+	g = twine_quads_contexts(quads);
+	count = twine_quads_count(quads);
+	graph = TWINE_TERM_NONE;
+	block->len = 0;
+	for(c = 0, n = 0; c < count; c++)
+	{
+		if(g && g[c] != graph)
+		{
+			if(n && binary_block_(out, BINARY_BLOCK_QUADS, block))
+			{
+				return -1;
+			}
+			n = 0;
+			graph = g[c];
+			block->len = 0;
+			if(binary_varint_(block, graph) || binary_block_(out, BINARY_BLOCK_GRAPH, block))
+			{
+				return -1;
+			}
+			block->len = 0;
+		}
+		if(binary_varint_(block, s[c]) || binary_varint_(block, p[c]) || binary_varint_(block, o[c]))
+		{
+			return -1;
+		}
+		n++;
+		if(n == BINARY_QUADS_PER_BLOCK)
+		{
+			if(binary_block_(out, BINARY_BLOCK_QUADS, block))
+			{
+				return -1;
+			}
+			n = 0;
+			block->len = 0;
+		}
+	}
+	if(n && binary_block_(out, BINARY_BLOCK_QUADS, block))
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/* Append a block with the given payload (which may be NULL) */
+static int
+binary_block_(struct binary_buf_struct *out, int type, struct binary_buf_struct *block)
+{
+	unsigned char t;
+
+	t = (unsigned char) type;
+	if(binary_put_(out, &t, 1) || binary_varint_(out, block ? block->len : 0))
+	{
+		return -1;
+	}
+	if(block && block->len)
+	{
+		return binary_put_(out, block->buf, block->len);
+	}
+	return 0;
+}
+
+static int
+binary_put_(struct binary_buf_struct *buf, const void *p, size_t len)
+{
+	unsigned char *q;
+	size_t size;
+
+	if(buf->len + len > buf->size)
+	{
+		for(size = (buf->size ? buf->size : 4096); size < buf->len + len; size *= 2) { }
+		q = (unsigned char *) realloc(buf->buf, size);
+		if(!q)
+		{
+			twine_logf(LOG_CRIT, "failed to expand binary quads buffer to %lu bytes\n", (unsigned long) size);
+			return -1;
+		}
+		buf->buf = q;
+		buf->size = size;
+	}
+	memcpy(&(buf->buf[buf->len]), p, len);
+	buf->len += len;
+	return 0;
+}
+
+static int
+binary_varint_(struct binary_buf_struct *buf, size_t value)
+{
+	unsigned char v[10];
+	size_t n;
+
+	for(n = 0; value >= 0x80; n++)
+	{
+		v[n] = (unsigned char) ((value & 0x7f) | 0x80);
+		value >>= 7;
+	}
+	v[n] = (unsigned char) value;
+	return binary_put_(buf, v, n + 1);
+}
+
+static int
+binary_string_(struct binary_buf_struct *buf, const char *str, size_t len)
+{
+	if(binary_varint_(buf, len))
+	{
+		return -1;
+	}
+	return binary_put_(buf, str, len);
+}
+
+/* Decode a varint, returning a pointer to the following byte, or NULL if
+ * it's truncated or too large
+ */
+static const unsigned char *
+binary_get_varint_(const unsigned char *p, const unsigned char *end, size_t *value)
+{
+	size_t v;
+	unsigned shift;
+
+	v = 0;
+	for(shift = 0; p < end && shift < sizeof(size_t) * 8; shift += 7)
+	{
+		v |= ((size_t) (*p & 0x7f)) << shift;
+		if(!(*p & 0x80))
+		{
+			*value = v;
+			return p + 1;
+		}
+		p++;
+	}
+	return NULL;
+}
+
+static const unsigned char *
+binary_get_string_(const unsigned char *p, const unsigned char *end, const char **str, size_t *len)
+{
+	p = binary_get_varint_(p, end, len);
+	if(!p || *len > (size_t) (end - p))
+	{
+		return NULL;
+	}
+	*str = (const char *) p;
+	return p + *len;
+}
+
+/* Record the term definitions in a block; nodes are created on demand */
+static int
+binary_read_terms_(struct binary_reader_struct *reader, const unsigned char *p, const unsigned char *end)
+{
+	struct binary_term_struct *t;
+	size_t kind, size;
+
+	while(p < end)
+	{
+		if(reader->nterms + 1 >= reader->termsize)
+		{
+			size = (reader->termsize ? reader->termsize * 2 : 256);
+			t = (struct binary_term_struct *) realloc(reader->terms, sizeof(struct binary_term_struct) * size);
+			if(!t)
+			{
+				twine_logf(LOG_CRIT, "failed to expand binary quads term table\n");
+				return -1;
+			}
+			reader->terms = t;
+			reader->termsize = size;
+		}
+		/* Identifiers begin at 1 */
+		t = &(reader->terms[reader->nterms + 1]);
+		memset(t, 0, sizeof(struct binary_term_struct));
+		if(!(p = binary_get_varint_(p, end, &kind)) ||
+		   !(p = binary_get_string_(p, end, &(t->str), &(t->len))))
+		{
+			twine_logf(LOG_ERR, "binary quads: truncated term definition\n");
+			return -1;
+		}
+		t->kind = (int) kind;
+		switch(t->kind)
+		{
+		case BINARY_TERM_URI:
+		case BINARY_TERM_BLANK:
+		case BINARY_TERM_LITERAL:
+			break;
+		case BINARY_TERM_LANG:
+			p = binary_get_string_(p, end, &(t->lang), &(t->langlen));
+			break;
+		case BINARY_TERM_TYPED:
+			p = binary_get_varint_(p, end, &(t->datatype));
+			break;
+		default:
+			twine_logf(LOG_ERR, "binary quads: unsupported term kind %lu\n", (unsigned long) kind);
+			return -1;
+		}
+		if(!p)
+		{
+			twine_logf(LOG_ERR, "binary quads: truncated term definition\n");
+			return -1;
+		}
+		reader->nterms++;
+	}
+	return 0;
+}
+
+/* Invoke the statement callback for each quad in a block */
+static int
+binary_read_quads_(struct binary_reader_struct *reader, const unsigned char *p, const unsigned char *end)
+{
+	size_t ids[3];
+	librdf_node *nodes[3];
+	librdf_statement *st;
+	int c, r;
+
+	while(p < end)
+	{
+		for(c = 0; c < 3; c++)
+		{
+			if(!(p = binary_get_varint_(p, end, &(ids[c]))))
+			{
+				twine_logf(LOG_ERR, "binary quads: truncated quad\n");
+				return -1;
+			}
+			if(!(nodes[c] = binary_node_(reader, ids[c])))
+			{
+				return -1;
+			}
+		}
+		/* The statement takes ownership of the nodes passed to it */
+		st = librdf_new_statement_from_nodes(reader->world,
+			librdf_new_node_from_node(nodes[0]),
+			librdf_new_node_from_node(nodes[1]),
+			librdf_new_node_from_node(nodes[2]));
+		if(!st)
+		{
+			twine_logf(LOG_CRIT, "failed to create new statement\n");
+			return -1;
+		}
+		r = reader->fn(st, reader->graph, reader->data);
+		librdf_free_statement(st);
+		if(r)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Obtain the node for a term, creating it if needed */
+static librdf_node *
+binary_node_(struct binary_reader_struct *reader, size_t id)
+{
+	struct binary_term_struct *t;
+	librdf_node *dt;
+
+	if(!id || id > reader->nterms)
+	{
+		twine_logf(LOG_ERR, "binary quads: reference to undefined term %lu\n", (unsigned long) id);
+		return NULL;
+	}
+	t = &(reader->terms[id]);
+	if(t->node)
+	{
+		return t->node;
+	}
+	switch(t->kind)
+	{
+	case BINARY_TERM_URI:
+		t->node = twine_rdf_node_intern_(t->str, t->len);
+		break;
+	case BINARY_TERM_BLANK:
+		t->node = librdf_new_node_from_counted_blank_identifier(reader->world, (const unsigned char *) t->str, t->len);
+		break;
+	case BINARY_TERM_LITERAL:
+	case BINARY_TERM_LANG:
+		t->node = librdf_new_node_from_typed_counted_literal(reader->world, (const unsigned char *) t->str, t->len, t->lang, t->langlen, NULL);
+		break;
+	case BINARY_TERM_TYPED:
+		if(t->datatype == id || t->datatype > reader->nterms || reader->terms[t->datatype].kind != BINARY_TERM_URI)
+		{
+			twine_logf(LOG_ERR, "binary quads: invalid datatype for term %lu\n", (unsigned long) id);
+			return NULL;
+		}
+		if(!(dt = binary_node_(reader, t->datatype)))
+		{
+			return NULL;
+		}
+		t->node = librdf_new_node_from_typed_counted_literal(reader->world, (const unsigned char *) t->str, t->len, NULL, 0, librdf_node_get_uri(dt));
+		break;
+	}
+	if(!t->node)
+	{
+		twine_logf(LOG_ERR, "binary quads: failed to create node for term %lu\n", (unsigned long) id);
+	}
+	return t->node;
+}
+
+/* Discard the terms defined by the current stream */
+static void
+binary_reset_(struct binary_reader_struct *reader)
+{
+	size_t c;
+
+	for(c = 1; c <= reader->nterms; c++)
+	{
+		if(reader->terms[c].node)
+		{
+			librdf_free_node(reader->terms[c].node);
+		}
+	}
+	reader->nterms = 0;
+	reader->graph = NULL;
+}
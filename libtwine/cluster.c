@@ -42,6 +42,11 @@ int
 twine_set_job(TWINE *context, CLUSTERJOB *job)
 {
 	context->job = job;
+	/* Release any memory allocated for the previous job */
+	twine_job_release(context, 0);
+	context->job_graphs = 0;
+	context->job_triples = 0;
+	context->job_bytes = 0;
 	return 0;
 }
 
@@ -53,6 +53,8 @@ twine_create(void)
 	log_set_stderr(1);
 	log_set_syslog(0);
 	log_set_level(LOG_NOTICE);
+	pthread_mutex_init(&(p->graph_pool_lock), NULL);
+	pthread_mutex_init(&(p->arena_lock), NULL);
 	twine_rdf_init_(p);
 	twine_config_setup_(p);
 	return p;
@@ -65,6 +67,21 @@ twine_destroy(TWINE *context)
 
 	/* Un-load plug-ins before removing the context */
 	twine_plugin_unload_all_(context);
+	if(context->workers)
+	{
+		twine_workers_destroy_(context->workers);
+		context->workers = NULL;
+	}
+	if(context->memo)
+	{
+		twine_memo_destroy_(context->memo);
+		context->memo = NULL;
+	}
+	/* Pooled graphs hold models which belong to the context's world */
+	twine_graph_pool_cleanup_(context);
+	pthread_mutex_destroy(&(context->graph_pool_lock));
+	twine_arena_cleanup_(context);
+	pthread_mutex_destroy(&(context->arena_lock));
 	twine_rdf_cleanup_(context);
 	twine_cluster_done_(context);
 	/* Remove this context from the chain */
@@ -160,6 +177,10 @@ twine_ready(TWINE *context)
 	{
 		return -1;
 	}
+	if(twine_rdf_ready_(context))
+	{
+		return -1;
+	}
 	if(twine_sparql_init_(context))
 	{
 		return -1;
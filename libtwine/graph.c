@@ -23,28 +23,79 @@
 
 #include "p_libtwine.h"
 
+/* Graph objects are allocated along with some additional state, so that
+ * once they have been released they can be retained by their context and
+ * re-used rather than being rebuilt from scratch.
+ */
+struct twine_graph_pooled_struct
+{
+	/* Must be first */
+	TWINEGRAPH graph;
+	TWINE *context;
+	TWINEPOOLEDGRAPH *next;
+	/* The size of the buffer allocated for graph.uri */
+	size_t urisize;
+	/* Whether graph.store was created by twine_graph_create() */
+	int owned;
+	/* A cleared model available for re-use by twine_graph_create() */
+	librdf_model *spare;
+};
+
+/* Models whose storage has grown beyond this size are destroyed rather than
+ * being cleared for re-use
+ */
+#define GRAPH_POOL_MAX_BYTES            (16 * 1024 * 1024)
+
+static TWINEPOOLEDGRAPH *twine_graph_acquire_(TWINE *context, const char *uri);
+static int twine_graph_recycle_(librdf_model *model);
+static void twine_graph_free_(TWINEPOOLEDGRAPH *p);
+
 /* Public: create a new empty graph object with the supplied URI */
 TWINEGRAPH *
 twine_graph_create(TWINE *restrict context, const char *restrict uri)
 {
-	TWINEGRAPH *p;
-
-	(void) context;
+	TWINEPOOLEDGRAPH *p;
 
-	p = (TWINEGRAPH *) calloc(1, sizeof(TWINEGRAPH));
+	p = twine_graph_acquire_(context, uri);
 	if(!p)
 	{
 		return NULL;
 	}
-	p->uri = strdup(uri);
-	p->store = twine_rdf_model_create();
-	p->job = context->job;
-	if(!p->uri || !p->store)
+	if(p->spare)
+	{
+		p->graph.store = p->spare;
+		p->spare = NULL;
+	}
+	else
+	{
+		p->graph.store = twine_rdf_model_create();
+		if(!p->graph.store)
+		{
+			twine_graph_destroy(&(p->graph));
+			return NULL;
+		}
+	}
+	p->owned = 1;
+	return &(p->graph);
+}
+
+/* Public: create a new graph object with the supplied URI which takes
+ * ownership of an existing model rather than copying its statements; if
+ * successful, the model will be destroyed along with the graph
+ */
+TWINEGRAPH *
+twine_graph_create_from_model(TWINE *restrict context, const char *restrict uri, librdf_model *restrict model)
+{
+	TWINEPOOLEDGRAPH *p;
+
+	p = twine_graph_acquire_(context, uri);
+	if(!p)
 	{
-		twine_graph_destroy(p);
 		return NULL;
 	}
-	return p;
+	p->graph.store = model;
+	p->owned = 0;
+	return &(p->graph);
 }
 
 /* Public: create a new graph object with the supplied URI by parsing a
@@ -83,15 +134,46 @@ twine_graph_create_rdf(TWINE *restrict context, const char *restrict uri, const
 int
 twine_graph_destroy(TWINEGRAPH *graph)
 {
+	TWINEPOOLEDGRAPH *p;
+	TWINE *context;
+
+	p = (TWINEPOOLEDGRAPH *) graph;
+	context = p->context;
 	if(graph->old)
 	{
 		twine_rdf_model_destroy(graph->old);
+		graph->old = NULL;
 	}
 	if(graph->store)
 	{
-		twine_rdf_model_destroy(graph->store);
+		/* Keep a model which was created for the graph, provided it can be
+		 * cleared, for the next graph created from the pool
+		 */
+		if(p->owned && !p->spare && !twine_graph_recycle_(graph->store))
+		{
+			p->spare = graph->store;
+		}
+		else
+		{
+			twine_rdf_model_destroy(graph->store);
+		}
+		graph->store = NULL;
+	}
+	p->owned = 0;
+	graph->job = NULL;
+	pthread_mutex_lock(&(context->graph_pool_lock));
+	if(context->graph_pool_count < context->graph_pool_size)
+	{
+		p->next = context->graph_pool;
+		context->graph_pool = p;
+		context->graph_pool_count++;
+		p = NULL;
+	}
+	pthread_mutex_unlock(&(context->graph_pool_lock));
+	if(p)
+	{
+		twine_graph_free_(p);
 	}
-	free(graph->uri);
 	return 0;
 }
 
@@ -118,9 +200,144 @@ twine_graph_orig_model(TWINEGRAPH *graph)
 	return graph->old;
 }
 
+/* Public: return a quad array for the graph's model, which must be
+ * destroyed with twine_quads_destroy()
+ */
+TWINEQUADS *
+twine_graph_quads(TWINEGRAPH *graph)
+{
+	return twine_quads_create(graph->store);
+}
+
+/* Public: obtain the number of statements in a graph and the approximate
+ * memory used by it; the memory figure includes any previous version of
+ * the graph which has been fetched
+ */
+int
+twine_graph_usage(TWINEGRAPH *graph, size_t *triples, size_t *bytes)
+{
+	size_t t, b, ob;
+
+	t = b = ob = 0;
+	if(graph->store && twine_rdf_model_usage(graph->store, &t, bytes ? &b : NULL))
+	{
+		return -1;
+	}
+	if(graph->old && bytes && twine_rdf_model_usage(graph->old, NULL, &ob))
+	{
+		return -1;
+	}
+	if(triples)
+	{
+		*triples = t;
+	}
+	if(bytes)
+	{
+		*bytes = b + ob;
+	}
+	return 0;
+}
+
 /* Public: return the job associated with the graph */
 CLUSTERJOB *
 twine_graph_job(TWINEGRAPH *graph)
 {
 	return graph->job;
 }
+
+/* Private: free the graph objects retained by a context */
+int
+twine_graph_pool_cleanup_(TWINE *context)
+{
+	TWINEPOOLEDGRAPH *p, *next;
+
+	pthread_mutex_lock(&(context->graph_pool_lock));
+	p = context->graph_pool;
+	context->graph_pool = NULL;
+	context->graph_pool_count = 0;
+	pthread_mutex_unlock(&(context->graph_pool_lock));
+	for(; p; p = next)
+	{
+		next = p->next;
+		twine_graph_free_(p);
+	}
+	return 0;
+}
+
+/* Obtain a graph object from the pool, or allocate a new one, and set its
+ * URI
+ */
+static TWINEPOOLEDGRAPH *
+twine_graph_acquire_(TWINE *context, const char *uri)
+{
+	TWINEPOOLEDGRAPH *p;
+	size_t len;
+
+	len = strlen(uri) + 1;
+	pthread_mutex_lock(&(context->graph_pool_lock));
+	p = context->graph_pool;
+	if(p)
+	{
+		context->graph_pool = p->next;
+		context->graph_pool_count--;
+	}
+	pthread_mutex_unlock(&(context->graph_pool_lock));
+	if(!p)
+	{
+		p = (TWINEPOOLEDGRAPH *) calloc(1, sizeof(TWINEPOOLEDGRAPH));
+		if(!p)
+		{
+			return NULL;
+		}
+		p->context = context;
+	}
+	p->next = NULL;
+	if(len > p->urisize)
+	{
+		free(p->graph.uri);
+		p->urisize = 0;
+		p->graph.uri = (char *) malloc(len);
+		if(!p->graph.uri)
+		{
+			twine_graph_destroy(&(p->graph));
+			return NULL;
+		}
+		p->urisize = len;
+	}
+	memcpy(p->graph.uri, uri, len);
+	p->graph.job = context->job;
+	return p;
+}
+
+/* Clear a model so that it can be re-used, if its storage supports it;
+ * returns nonzero if the model should be destroyed instead
+ */
+static int
+twine_graph_recycle_(librdf_model *model)
+{
+	librdf_storage *storage;
+	size_t bytes;
+
+	storage = librdf_model_get_storage(model);
+	if(!storage || !twine_storage_is_compact_(storage))
+	{
+		return -1;
+	}
+	if(twine_storage_usage_(storage, NULL, &bytes) || bytes > GRAPH_POOL_MAX_BYTES)
+	{
+		return -1;
+	}
+	return twine_storage_reset_(storage);
+}
+
+/* Free a graph object which isn't being returned to the pool */
+static void
+twine_graph_free_(TWINEPOOLEDGRAPH *p)
+{
+	if(p->spare)
+	{
+		twine_rdf_model_destroy(p->spare);
+	}
+	free(p->graph.uri);
+	free(p);
+}
@@ -321,7 +321,7 @@ twine_sparql_put_stream(const char *uri, librdf_stream *stream)
 	size_t buflen;
 	int r;
 
-	model = twine_rdf_model_create();
+	model = twine_rdf_model_create_profile(TWINE_STORAGE_SINGLE);
 	if(!model)
 	{
 		return -1;
@@ -21,6 +21,8 @@
 # define LIBTWINE_H_                    1
 
 # include <stdarg.h>
+# include <stdint.h>
+# include <time.h>
 # include <librdf.h>
 # include <syslog.h>
 # include <libsparqlclient.h>
@@ -61,6 +63,7 @@ BEGIN_DECLS_
 
 typedef struct twine_context_struct TWINE;
 typedef struct twine_graph_struct TWINEGRAPH;
+typedef struct twine_quads_struct TWINEQUADS;
 
 /* Plug-in callbacks
  *
@@ -103,6 +106,57 @@ typedef const unsigned char *(*TWINEBULKFN)(TWINE *restrict context, const char
  */
 typedef int (*TWINEPROCESSORFN)(TWINE *restrict context, TWINEGRAPH *restrict graph, void *userdata);
 
+/* Processors can describe what they do to a graph when they're registered,
+ * which allows the workflow to schedule them more efficiently. A processor
+ * which specifies neither TWINE_PROC_READONLY nor TWINE_PROC_MUTATES is
+ * assumed to do anything, and to need anything, which is also the case for
+ * processors registered with twine_plugin_add_processor().
+ */
+typedef enum
+{
+	/* Doesn't modify the graph's models */
+	TWINE_PROC_READONLY = (1<<0),
+	/* Modifies the graph's model */
+	TWINE_PROC_MUTATES = (1<<1),
+	/* Reads the original model (twine_graph_orig_model()) */
+	TWINE_PROC_NEEDS_ORIG = (1<<2),
+	/* Populates the original model; skipped if no later processor needs it */
+	TWINE_PROC_PROVIDES_ORIG = (1<<3),
+	/* May be invoked concurrently with other thread-safe processors (which
+	 * must not use twine_job_mark() and twine_job_release())
+	 */
+	TWINE_PROC_THREADSAFE = (1<<4),
+	/* Invoking it again, without the graph having been modified since,
+	 * has no further effect
+	 */
+	TWINE_PROC_IDEMPOTENT = (1<<5),
+	/* Its changes to the graph depend only upon the graph's URI and model,
+	 * so that they can be cached and replayed for identical graphs
+	 */
+	TWINE_PROC_DETERMINISTIC = (1<<6),
+	/* Treats each subject independently, reading and modifying only
+	 * statements whose subject is among those in the graph it's given, so
+	 * that a large graph can be divided by subject between concurrent
+	 * invocations (which also requires TWINE_PROC_THREADSAFE)
+	 */
+	TWINE_PROC_PARTITIONED = (1<<7)
+} TWINEPROCFLAGS;
+
+/* Streaming processors are an alternative to processing callbacks for
+ * stages which only need to see each statement once, such as filters and
+ * exporters. Rather than a complete model, they receive the statements of
+ * a graph in batches, bracketed by optional begin and end callbacks; the
+ * graph's model may not have been populated while they run. A batch
+ * callback can remove statements from the graph by setting their entries
+ * in the array to NULL (they must not be freed); statements are only valid
+ * for the duration of the callback. The end callback is invoked with a
+ * status of zero once every statement has been delivered, or nonzero if
+ * processing was aborted.
+ */
+typedef int (*TWINESTREAMBEGINFN)(TWINE *restrict context, TWINEGRAPH *restrict graph, void *userdata);
+typedef int (*TWINESTREAMBATCHFN)(TWINE *restrict context, TWINEGRAPH *restrict graph, librdf_statement **statements, size_t count, void *userdata);
+typedef int (*TWINESTREAMENDFN)(TWINE *restrict context, TWINEGRAPH *restrict graph, int status, void *userdata);
+
 /* Update callbacks are registered with a name (typically the module name),
  * and are called with an identifier when invoked by the Twine command-line
  * processing utility. For workflows which involve deriving data or generating
@@ -128,18 +182,26 @@ int twine_plugin_input_exists(TWINE *restrict context, const char *mimetype);
 int twine_plugin_add_bulk(TWINE *restrict context, const char *restrict mimetype, const char *restrict description, TWINEBULKFN fn, void *userdata);
 int twine_plugin_bulk_exists(TWINE *restrict context, const char *mimetype);
 int twine_plugin_add_processor(TWINE *restrict context, const char *restrict name, TWINEPROCESSORFN fn, void *userdata);
+int twine_plugin_add_processor_flags(TWINE *restrict context, const char *restrict name, TWINEPROCESSORFN fn, void *userdata, unsigned int flags);
 int twine_plugin_processor_exists(TWINE *restrict context, const char *restrict name);
+int twine_plugin_add_stream_processor(TWINE *restrict context, const char *restrict name, TWINESTREAMBEGINFN begin, TWINESTREAMBATCHFN batch, TWINESTREAMENDFN end, void *userdata);
 int twine_plugin_add_update(TWINE *restrict context, const char *restrict name, TWINEUPDATEFN fn, void *userdata);
 int twine_plugin_update_exists(TWINE *restrict context, const char *restrict name);
 
 /* Graph objects */
 TWINEGRAPH *twine_graph_create(TWINE *restrict context, const char *restrict uri);
+/* Create a graph which takes ownership of a populated model, rather than
+ * copying it; the model is destroyed along with the graph
+ */
+TWINEGRAPH *twine_graph_create_from_model(TWINE *restrict context, const char *restrict uri, librdf_model *restrict model);
 TWINEGRAPH *twine_graph_create_rdf(TWINE *restrict context, const char *restrict uri, const unsigned char *restrict buf, size_t buflen, const char *restrict type);
 int twine_graph_destroy(TWINEGRAPH *graph);
 const char *twine_graph_uri(TWINEGRAPH *graph);
 librdf_model *twine_graph_model(TWINEGRAPH *graph);
 librdf_model *twine_graph_orig_model(TWINEGRAPH *graph);
 CLUSTERJOB *twine_graph_job(TWINEGRAPH *graph);
+TWINEQUADS *twine_graph_quads(TWINEGRAPH *graph);
+int twine_graph_usage(TWINEGRAPH *graph, size_t *triples, size_t *bytes);
 
 /* Workflow processing */
 int twine_workflow_process_message(TWINE *restrict context, const char *restrict mimetype, const unsigned char *restrict message, size_t messagelen, const char *restrict subject);
@@ -148,14 +210,70 @@ int twine_workflow_process_graph(TWINE *restrict context, TWINEGRAPH *restrict g
 int twine_workflow_process_update(TWINE *restrict context, const char *restrict type, const char *restrict id);
 int twine_workflow_process_rdf(TWINE *restrict context, const char *restrict uri, const unsigned char *restrict buf, size_t buflen, const char *restrict type);
 int twine_workflow_process_stream(TWINE *restrict context, const char *restrict uri, librdf_stream *stream);
+/* Process a graph from a populated model, which is consumed (and
+ * destroyed) rather than copied
+ */
+int twine_workflow_process_model(TWINE *restrict context, const char *restrict uri, librdf_model *restrict model);
+
+/* Determine whether the current workflow stage, or the message being
+ * processed, has exceeded its time limit; processors which may take a long
+ * time should check this periodically, and fail if it returns nonzero
+ */
+int twine_cancelled(TWINE *context);
 
 /* RDF utility wrappers */
 
 /* Obtain the shared librdf world */
 librdf_world *twine_rdf_world(void);
 
+/* Storage profiles for new models: the storage used for each can be
+ * selected in the configuration by setting storage-default, storage-single,
+ * storage-append or storage-indexed to 'hashes' (the default) or 'compact'
+ */
+typedef enum
+{
+	/* General-purpose storage, as configured by rdf-storage */
+	TWINE_STORAGE_DEFAULT,
+	/* A model holding a single graph, which doesn't need to record the
+	 * contexts of its statements
+	 */
+	TWINE_STORAGE_SINGLE,
+	/* A model which is populated once and then read sequentially, such as
+	 * a parse buffer
+	 */
+	TWINE_STORAGE_APPEND,
+	/* A model which will be queried heavily, with every index maintained
+	 */
+	TWINE_STORAGE_INDEXED
+} TWINESTORAGEPROFILE;
+
+# define TWINE_STORAGE_PROFILES         4
+
+/* Classifications of literal datatypes, as returned by
+ * twine_rdf_node_datatype()
+ */
+typedef enum
+{
+	/* Not a literal */
+	TWINE_DT_NONE,
+	/* A plain literal, or xsd:string and its derived types */
+	TWINE_DT_STRING,
+	/* xsd:integer and its derived types */
+	TWINE_DT_INTEGER,
+	TWINE_DT_DECIMAL,
+	TWINE_DT_DOUBLE,
+	TWINE_DT_FLOAT,
+	TWINE_DT_BOOLEAN,
+	TWINE_DT_DATETIME,
+	TWINE_DT_DATE,
+	/* Any other datatype */
+	TWINE_DT_OTHER
+} TWINEDATATYPE;
+
 /* Convenience API for creating a new librdf model */
 librdf_model *twine_rdf_model_create(void);
+/* Create a new librdf model using the storage appropriate for a profile */
+librdf_model *twine_rdf_model_create_profile(TWINESTORAGEPROFILE profile);
 
 /* Convenience API for cloning librdf model */
 librdf_model *twine_rdf_model_clone(librdf_model *model);
@@ -163,16 +281,80 @@ librdf_model *twine_rdf_model_clone(librdf_model *model);
 /* Destroy a model */
 int twine_rdf_model_destroy(librdf_model *model);
 
+/* Obtain the number of statements in a model and the approximate amount of
+ * memory it's using
+ */
+int twine_rdf_model_usage(librdf_model *model, size_t *triples, size_t *bytes);
+
 /* Parse a buffer into a librdf model */
 int twine_rdf_model_parse(librdf_model *model, const char *mime, const char *buf, size_t buflen);
 int twine_rdf_model_parse_graph(librdf_model *model, const char *mime, const char *buf, size_t buflen, librdf_node *graph);
 int twine_rdf_model_parse_base(librdf_model *model, const char *mime, const char *buf, size_t buflen, librdf_uri *uri);
 int twine_rdf_model_parse_base_graph(librdf_model *model, const char *mime, const char *buf, size_t buflen, librdf_uri *base, librdf_node *graph);
 
+/* Statement callbacks are invoked by twine_rdf_parse() for each statement
+ * parsed, along with the graph it belongs to (or NULL if the source didn't
+ * specify one); both are only valid for the duration of the callback. A
+ * nonzero return value aborts the parse.
+ */
+typedef int (*TWINESTATEMENTFN)(librdf_statement *statement, librdf_node *graph, void *userdata);
+
+/* Parse a buffer, invoking a callback for each statement */
+int twine_rdf_parse(const char *mime, const char *buf, size_t buflen, librdf_uri *base, TWINESTATEMENTFN fn, void *userdata);
+
+/* The MIME type of Twine's binary quad format, which can be parsed in the
+ * same way as any other supported serialisation
+ */
+# define TWINE_MIME_BINARY              "application/x-twine-quads"
+
+/* Serialise a model in the binary quad format; the buffer must be freed
+ * with free()
+ */
+unsigned char *twine_rdf_model_binary(librdf_model *model, size_t *buflen);
+
+/* Quad arrays expose the statements of a model as parallel arrays of term
+ * identifiers (one per column), so that processors can scan and filter
+ * them in tight loops without constructing nodes. Each distinct term in
+ * the model has a single identifier, so terms can be compared by
+ * identifier; the corresponding nodes and strings are only resolved when
+ * asked for. A quad array is only valid while its model is unmodified.
+ */
+typedef uint32_t TWINETERM;
+
+/* The identifier used for an absent context, or for a term which is not
+ * present in the model
+ */
+# define TWINE_TERM_NONE                0
+
+TWINEQUADS *twine_quads_create(librdf_model *model);
+int twine_quads_destroy(TWINEQUADS *quads);
+/* Obtain the number of quads, and the columns (the contexts column may be
+ * NULL if no quad has a context)
+ */
+size_t twine_quads_count(TWINEQUADS *quads);
+/* Obtain the upper bound of the term identifiers in the quad array */
+TWINETERM twine_quads_terms(TWINEQUADS *quads);
+const TWINETERM *twine_quads_subjects(TWINEQUADS *quads);
+const TWINETERM *twine_quads_predicates(TWINEQUADS *quads);
+const TWINETERM *twine_quads_objects(TWINEQUADS *quads);
+const TWINETERM *twine_quads_contexts(TWINEQUADS *quads);
+/* Look up the identifier of a term */
+TWINETERM twine_quads_term(TWINEQUADS *quads, librdf_node *node);
+TWINETERM twine_quads_term_uri(TWINEQUADS *quads, const char *uri);
+/* Resolve an identifier to a node (owned by the quad array), or to the
+ * URI, literal value or blank node identifier of the term
+ */
+librdf_node *twine_quads_node(TWINEQUADS *quads, TWINETERM term);
+const char *twine_quads_string(TWINEQUADS *quads, TWINETERM term, size_t *len);
+
 /* Add a statement to a model if it doesn't exist */
 int twine_rdf_model_add_st(librdf_model *model, librdf_statement *statement, librdf_node *ctx);
 /* Add a stream to a model, provided the statements don't already exist */
 int twine_rdf_model_add_stream(librdf_model *model, librdf_stream *stream, librdf_node *ctx);
+/* Add a stream to a model, skipping statements which already exist in the
+ * model or which are repeated within the stream
+ */
+int twine_rdf_model_add_unique(librdf_model *model, librdf_stream *stream, librdf_node *ctx);
 /* Create a new statement */
 librdf_statement *twine_rdf_st_create(void);
 
@@ -190,6 +372,8 @@ librdf_node *twine_rdf_node_clone(librdf_node *node);
 
 /* Create a new URI node */
 librdf_node *twine_rdf_node_createuri(const char *uri);
+/* Create a new URI */
+librdf_uri *twine_rdf_uri_create(const char *uri);
 
 /* Destroy a node */
 int twine_rdf_node_destroy(librdf_node *node);
@@ -200,6 +384,16 @@ int twine_rdf_node_isint(librdf_node *node);
 /* Obtain the integer value of a node */
 int twine_rdf_node_intval(librdf_node *node, long *value);
 
+/* Classify the datatype of a literal node */
+TWINEDATATYPE twine_rdf_node_datatype(librdf_node *node);
+
+/* Obtain the typed value of a literal node; each returns 1 on success, or
+ * 0 if the node is not of a compatible type or is malformed
+ */
+int twine_rdf_node_doubleval(librdf_node *node, double *value);
+int twine_rdf_node_boolval(librdf_node *node, int *value);
+int twine_rdf_node_datetimeval(librdf_node *node, time_t *value);
+
 /* Serialise a model to a string */
 char *twine_rdf_model_ntriples(librdf_model *model, size_t *buflen);
 char *twine_rdf_model_nquads(librdf_model *model, size_t *buflen);
@@ -207,6 +401,12 @@ char *twine_rdf_model_nquads(librdf_model *model, size_t *buflen);
 /* Serialise a stream to a string */
 char *twine_rdf_stream_ntriples(librdf_stream *model, size_t *buflen);
 
+/* Serialise a model or stream to a string as Turtle, with prefixes derived
+ * from the namespaces present
+ */
+char *twine_rdf_model_turtle(librdf_model *model, size_t *buflen);
+char *twine_rdf_stream_turtle(librdf_stream *stream, size_t *buflen);
+
 /* SPARQL handling */
 
 /* Create a SPARQL connection */
@@ -217,6 +417,16 @@ CLUSTER *twine_cluster(TWINE *context);
 int twine_cluster_enable(TWINE *context, int enabled);
 CLUSTERJOB *twine_job(TWINE *context);
 
+/* Per-job memory: allocations are zero-filled and are all released at once
+ * when the current job changes, rather than being freed individually. A
+ * mark can be used to release allocations made after it sooner, such as
+ * when a bulk import processes many records in a single job.
+ */
+void *twine_job_alloc(TWINE *context, size_t size);
+char *twine_job_strdup(TWINE *context, const char *str);
+size_t twine_job_mark(TWINE *context);
+int twine_job_release(TWINE *context, size_t mark);
+
 /* The interface defined below is now considered legacy. It will continue to
  * be provided for binary compatibility, but plug-ins built from source must
  * define TWINE_USE_DEPRECATED_API in order for the definitions to be visible.
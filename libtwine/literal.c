@@ -0,0 +1,437 @@
+/* Twine: Typed literal helpers
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libtwine.h"
+
+#define NS_XSD                          "http://www.w3.org/2001/XMLSchema#"
+#define NS_XSD_LEN                      33
+
+/* XSD datatypes, by local name; this table must be kept sorted */
+static const struct
+{
+	const char *name;
+	TWINEDATATYPE type;
+} twine_xsd_types_[] = {
+	{ "boolean", TWINE_DT_BOOLEAN },
+	{ "byte", TWINE_DT_INTEGER },
+	{ "date", TWINE_DT_DATE },
+	{ "dateTime", TWINE_DT_DATETIME },
+	{ "dateTimeStamp", TWINE_DT_DATETIME },
+	{ "decimal", TWINE_DT_DECIMAL },
+	{ "double", TWINE_DT_DOUBLE },
+	{ "float", TWINE_DT_FLOAT },
+	{ "int", TWINE_DT_INTEGER },
+	{ "integer", TWINE_DT_INTEGER },
+	{ "long", TWINE_DT_INTEGER },
+	{ "negativeInteger", TWINE_DT_INTEGER },
+	{ "nonNegativeInteger", TWINE_DT_INTEGER },
+	{ "nonPositiveInteger", TWINE_DT_INTEGER },
+	{ "normalizedString", TWINE_DT_STRING },
+	{ "positiveInteger", TWINE_DT_INTEGER },
+	{ "short", TWINE_DT_INTEGER },
+	{ "string", TWINE_DT_STRING },
+	{ "token", TWINE_DT_STRING },
+	{ "unsignedByte", TWINE_DT_INTEGER },
+	{ "unsignedInt", TWINE_DT_INTEGER },
+	{ "unsignedLong", TWINE_DT_INTEGER },
+	{ "unsignedShort", TWINE_DT_INTEGER }
+};
+
+#define XSD_TYPES                       (sizeof(twine_xsd_types_) / sizeof(twine_xsd_types_[0]))
+
+static TWINEDATATYPE twine_literal_classify_(const char *str, size_t len);
+static const char *twine_literal_value_(librdf_node *node, size_t *len);
+static int twine_literal_digits_(const char **p, const char *end, int ndigits, long *value);
+static long twine_days_from_civil_(long y, unsigned m, unsigned d);
+static long twine_days_in_month_(long y, long m);
+
+/* Public: Classify the datatype of a literal node
+ *
+ * Each thread caches the classifications of the datatype URIs it has seen,
+ * so that a datatype is only classified the first time it's encountered
+ * (or after being displaced from the cache), and subsequent literals with
+ * the same datatype cost a single lookup. Plain literals (with or without
+ * a language) are classified as TWINE_DT_STRING; nodes which aren't
+ * literals are TWINE_DT_NONE.
+ */
+TWINEDATATYPE
+twine_rdf_node_datatype(librdf_node *node)
+{
+	librdf_uri *uri;
+	const char *str;
+	TWINEDATATYPE type;
+	size_t len;
+	int r;
+
+	if(!node || !librdf_node_is_literal(node))
+	{
+		return TWINE_DT_NONE;
+	}
+	uri = librdf_node_get_literal_value_datatype_uri(node);
+	if(!uri)
+	{
+		return TWINE_DT_STRING;
+	}
+	str = (const char *) librdf_uri_as_counted_string(uri, &len);
+	r = twine_rdf_datatype_get_(str, len);
+	if(r >= 0)
+	{
+		return (TWINEDATATYPE) r;
+	}
+	type = twine_literal_classify_(str, len);
+	twine_rdf_datatype_set_(str, len, type);
+	return type;
+}
+
+/* Classify a datatype URI: rather than comparing it against each XSD type
+ * in turn, the XSD namespace is matched once and the local name looked up
+ * in a sorted table
+ */
+static TWINEDATATYPE
+twine_literal_classify_(const char *str, size_t len)
+{
+	size_t lo, hi, mid;
+	int r;
+
+	if(len <= NS_XSD_LEN || memcmp(str, NS_XSD, NS_XSD_LEN))
+	{
+		return TWINE_DT_OTHER;
+	}
+	str += NS_XSD_LEN;
+	lo = 0;
+	hi = XSD_TYPES;
+	while(lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		r = strcmp(str, twine_xsd_types_[mid].name);
+		if(!r)
+		{
+			return twine_xsd_types_[mid].type;
+		}
+		if(r < 0)
+		{
+			hi = mid;
+		}
+		else
+		{
+			lo = mid + 1;
+		}
+	}
+	return TWINE_DT_OTHER;
+}
+
+/* Public: Check if a node's datatype is one of the XSD integer types */
+int
+twine_rdf_node_isint(librdf_node *node)
+{
+	return twine_rdf_node_datatype(node) == TWINE_DT_INTEGER;
+}
+
+/* Public: Get the integer value of a node */
+int
+twine_rdf_node_intval(librdf_node *node, long *value)
+{
+	const char *str;
+	char *endp;
+
+	if(twine_rdf_node_datatype(node) != TWINE_DT_INTEGER)
+	{
+		return 0;
+	}
+	str = (const char *) librdf_node_get_literal_value(node);
+	if(!str || !*str)
+	{
+		return 0;
+	}
+	endp = NULL;
+	*value = strtol(str, &endp, 10);
+	if(!endp || !*endp)
+	{
+		return 1;
+	}
+	return 0;
+}
+
+/* Public: Get the value of a numeric node (integer, decimal, float or
+ * double) as a double
+ */
+int
+twine_rdf_node_doubleval(librdf_node *node, double *value)
+{
+	const char *str;
+	char *endp;
+	size_t len;
+
+	switch(twine_rdf_node_datatype(node))
+	{
+	case TWINE_DT_INTEGER:
+	case TWINE_DT_DECIMAL:
+	case TWINE_DT_FLOAT:
+	case TWINE_DT_DOUBLE:
+		break;
+	default:
+		return 0;
+	}
+	if(!(str = twine_literal_value_(node, &len)))
+	{
+		return 0;
+	}
+	endp = NULL;
+	*value = strtod(str, &endp);
+	if(!endp || endp == str)
+	{
+		return 0;
+	}
+	while(*endp == ' ' || *endp == '\t' || *endp == '\r' || *endp == '\n')
+	{
+		endp++;
+	}
+	return *endp ? 0 : 1;
+}
+
+/* Public: Get the value of an xsd:boolean node */
+int
+twine_rdf_node_boolval(librdf_node *node, int *value)
+{
+	const char *str;
+	size_t len;
+
+	if(twine_rdf_node_datatype(node) != TWINE_DT_BOOLEAN ||
+	   !(str = twine_literal_value_(node, &len)))
+	{
+		return 0;
+	}
+	if((len == 4 && !memcmp(str, "true", 4)) || (len == 1 && *str == '1'))
+	{
+		*value = 1;
+		return 1;
+	}
+	if((len == 5 && !memcmp(str, "false", 5)) || (len == 1 && *str == '0'))
+	{
+		*value = 0;
+		return 1;
+	}
+	return 0;
+}
+
+/* Public: Get the value of an xsd:dateTime or xsd:date node as a UTC
+ * timestamp
+ *
+ * Values with a timezone are converted to UTC; values without one are
+ * treated as being in UTC. Fractional seconds are discarded, and an
+ * xsd:date is taken to refer to midnight at the start of the day.
+ */
+int
+twine_rdf_node_datetimeval(librdf_node *node, time_t *value)
+{
+	TWINEDATATYPE type;
+	const char *p, *end;
+	size_t len;
+	long year, month, day, hour, min, sec, tzh, tzm, days;
+	int neg, frac;
+
+	type = twine_rdf_node_datatype(node);
+	if(type != TWINE_DT_DATETIME && type != TWINE_DT_DATE)
+	{
+		return 0;
+	}
+	if(!(p = twine_literal_value_(node, &len)))
+	{
+		return 0;
+	}
+	end = p + len;
+	neg = 0;
+	if(p < end && *p == '-')
+	{
+		neg = 1;
+		p++;
+	}
+	/* Years may have more than four digits */
+	for(year = 0; p < end && *p >= '0' && *p <= '9'; p++)
+	{
+		year = (year * 10) + (*p - '0');
+	}
+	if(neg)
+	{
+		year = -year;
+	}
+	if(p >= end || *p != '-')
+	{
+		return 0;
+	}
+	p++;
+	if(twine_literal_digits_(&p, end, 2, &month) || p >= end || *p != '-')
+	{
+		return 0;
+	}
+	p++;
+	if(twine_literal_digits_(&p, end, 2, &day) ||
+	   month < 1 || month > 12 || day < 1 || day > twine_days_in_month_(year, month))
+	{
+		return 0;
+	}
+	hour = min = sec = 0;
+	if(type == TWINE_DT_DATETIME)
+	{
+		if(p >= end || *p != 'T')
+		{
+			return 0;
+		}
+		p++;
+		if(twine_literal_digits_(&p, end, 2, &hour) || p >= end || *p != ':')
+		{
+			return 0;
+		}
+		p++;
+		if(twine_literal_digits_(&p, end, 2, &min) || p >= end || *p != ':')
+		{
+			return 0;
+		}
+		p++;
+		if(twine_literal_digits_(&p, end, 2, &sec) ||
+		   hour > 24 || min > 59 || sec > 60)
+		{
+			return 0;
+		}
+		frac = 0;
+		if(p < end && *p == '.')
+		{
+			for(p++; p < end && *p >= '0' && *p <= '9'; p++)
+			{
+				frac |= (*p != '0');
+			}
+		}
+		/* 24:00:00 denotes the end of the day, and is the only time with
+		 * an hour of 24
+		 */
+		if(hour == 24 && (min || sec || frac))
+		{
+			return 0;
+		}
+	}
+	tzh = tzm = 0;
+	if(p < end && *p == 'Z')
+	{
+		p++;
+	}
+	else if(p < end && (*p == '+' || *p == '-'))
+	{
+		neg = (*p == '-');
+		p++;
+		if(twine_literal_digits_(&p, end, 2, &tzh) || p >= end || *p != ':')
+		{
+			return 0;
+		}
+		p++;
+		if(twine_literal_digits_(&p, end, 2, &tzm))
+		{
+			return 0;
+		}
+		if(neg)
+		{
+			tzh = -tzh;
+			tzm = -tzm;
+		}
+	}
+	if(p != end)
+	{
+		return 0;
+	}
+	days = twine_days_from_civil_(year, (unsigned) month, (unsigned) day);
+	*value = (time_t) (days * 86400L + hour * 3600L + min * 60L + sec - (tzh * 3600L + tzm * 60L));
+	return 1;
+}
+
+/* Obtain a literal's value with surrounding whitespace removed, as
+ * permitted by the lexical space of the non-string XSD types
+ */
+static const char *
+twine_literal_value_(librdf_node *node, size_t *len)
+{
+	const char *str;
+
+	str = (const char *) librdf_node_get_literal_value_as_counted_string(node, len);
+	if(!str)
+	{
+		return NULL;
+	}
+	while(*len && (*str == ' ' || *str == '\t' || *str == '\r' || *str == '\n'))
+	{
+		str++;
+		(*len)--;
+	}
+	while(*len && (str[*len - 1] == ' ' || str[*len - 1] == '\t' || str[*len - 1] == '\r' || str[*len - 1] == '\n'))
+	{
+		(*len)--;
+	}
+	return *len ? str : NULL;
+}
+
+/* Parse exactly ndigits decimal digits */
+static int
+twine_literal_digits_(const char **p, const char *end, int ndigits, long *value)
+{
+	int c;
+
+	*value = 0;
+	for(c = 0; c < ndigits; c++)
+	{
+		if(*p >= end || **p < '0' || **p > '9')
+		{
+			return -1;
+		}
+		*value = (*value * 10) + (**p - '0');
+		(*p)++;
+	}
+	return 0;
+}
+
+/* Return the number of days between 1970-01-01 and the given date in the
+ * proleptic Gregorian calendar
+ */
+static long
+twine_days_from_civil_(long y, unsigned m, unsigned d)
+{
+	long era;
+	unsigned yoe, doy, doe;
+
+	y -= (m <= 2);
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = (unsigned) (y - era * 400);
+	doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + (long) doe - 719468;
+}
+
+/* Return the number of days in a month of the proleptic Gregorian calendar */
+static long
+twine_days_in_month_(long y, long m)
+{
+	static const long mdays[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+	if(m == 2 && (y % 4 == 0 && (y % 100 != 0 || y % 400 == 0)))
+	{
+		return 29;
+	}
+	return mdays[m - 1];
+}
@@ -0,0 +1,887 @@
+/* Twine: Memoisation of deterministic processors
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <dirent.h>
+#include <utime.h>
+
+#include "p_libtwine.h"
+
+#define MEMO_BUCKETS                    256
+
+/* The memo cache maps a processor name and a digest of the graph it was
+ * invoked on to the resulting graph, serialised in the binary quad format.
+ * Recently-used entries are held in memory, up to a limit on their total
+ * size, and are optionally written to a directory so that they survive
+ * restarts and can be shared between processes. The files in the directory
+ * are also limited in total size: when a result written by this process
+ * takes them over the limit, the least recently used files (by modification
+ * time, which is updated whenever a file is read) are removed until they
+ * occupy three quarters of it.
+ */
+struct twine_memo_entry_struct
+{
+	struct twine_memo_entry_struct *prev, *next;
+	struct twine_memo_entry_struct *chain;
+	TWINEMEMOKEY key;
+	char *name;
+	unsigned char *buf;
+	size_t len;
+};
+
+struct twine_memo_struct
+{
+	pthread_mutex_t lock;
+	/* Most recently used first */
+	struct twine_memo_entry_struct *first, *last;
+	struct twine_memo_entry_struct *buckets[MEMO_BUCKETS];
+	size_t size;
+	size_t used;
+	char *dir;
+	/* The limit on the size of the files in dir (0 = no limit), and the
+	 * approximate amount they occupy
+	 */
+	size_t dirsize;
+	size_t dirused;
+};
+
+/* A file in the memo cache directory, considered for removal */
+struct twine_memo_file_struct
+{
+	char *name;
+	size_t len;
+	time_t mtime;
+};
+
+static uint64_t twine_memo_mix_(uint64_t h);
+static uint64_t twine_memo_hash_(const unsigned char *str, size_t len, uint64_t hash);
+static uint64_t twine_memo_node_(librdf_node *node);
+static char *twine_memo_path_(TWINEMEMO *memo, const char *name, const TWINEMEMOKEY *key);
+static struct twine_memo_entry_struct *twine_memo_find_(TWINEMEMO *memo, const char *name, const TWINEMEMOKEY *key);
+static int twine_memo_add_(TWINEMEMO *memo, const char *name, const TWINEMEMOKEY *key, const unsigned char *buf, size_t len);
+static void twine_memo_unlink_(TWINEMEMO *memo, struct twine_memo_entry_struct *entry);
+static void twine_memo_evict_(TWINEMEMO *memo, struct twine_memo_entry_struct *entry);
+static unsigned char *twine_memo_read_(const char *path, size_t *len);
+static int twine_memo_write_(const char *path, const unsigned char *buf, size_t len);
+static int twine_memo_load_(TWINEGRAPH *graph, const unsigned char *buf, size_t len);
+static void twine_memo_prune_(TWINEMEMO *memo, size_t target);
+static int twine_memo_file_cmp_(const void *a, const void *b);
+static int twine_memo_blanks_(TWINEQUADS *quads, uint64_t *hashes, const unsigned char *blank);
+static size_t twine_memo_distinct_(uint64_t *values, size_t count);
+static int twine_memo_value_cmp_(const void *a, const void *b);
+
+/* Private: create a memo cache holding up to size bytes of results in
+ * memory, and optionally storing up to dirsize bytes of them in dir
+ */
+TWINEMEMO *
+twine_memo_create_(size_t size, const char *dir, size_t dirsize)
+{
+	TWINEMEMO *p;
+
+	p = (TWINEMEMO *) calloc(1, sizeof(TWINEMEMO));
+	if(!p)
+	{
+		twine_logf(LOG_CRIT, "failed to allocate memory for memo cache\n");
+		return NULL;
+	}
+	if(dir && *dir)
+	{
+		p->dir = strdup(dir);
+		if(!p->dir)
+		{
+			twine_logf(LOG_CRIT, "failed to duplicate memo cache directory path\n");
+			free(p);
+			return NULL;
+		}
+	}
+	p->size = size;
+	p->dirsize = dirsize;
+	pthread_mutex_init(&(p->lock), NULL);
+	if(p->dir && p->dirsize)
+	{
+		/* Determine how much the directory already holds, pruning it if the
+		 * limit has been reduced since it was last used
+		 */
+		twine_memo_prune_(p, dirsize);
+	}
+	return p;
+}
+
+/* Private: free a memo cache and the results held in memory */
+int
+twine_memo_destroy_(TWINEMEMO *memo)
+{
+	struct twine_memo_entry_struct *entry;
+
+	while(memo->first)
+	{
+		entry = memo->first;
+		memo->first = entry->next;
+		free(entry->name);
+		free(entry->buf);
+		free(entry);
+	}
+	pthread_mutex_destroy(&(memo->lock));
+	free(memo->dir);
+	free(memo);
+	return 0;
+}
+
+/* Private: compute the digest identifying the invocation of a processor on
+ * a graph; the digest covers the processor name, the graph URI and the
+ * statements of the graph's model, and doesn't depend upon the order in
+ * which the statements happen to be stored or upon the identifiers which
+ * the parser assigned to blank nodes
+ */
+int
+twine_memo_digest_(const char *name, TWINEGRAPH *graph, TWINEMEMOKEY *key)
+{
+	TWINEQUADS *quads;
+	const TWINETERM *s, *p, *o, *g;
+	uint64_t *hashes, h, base;
+	unsigned char *blank;
+	TWINETERM nterms, t;
+	size_t c, count;
+	int blanks;
+
+	quads = twine_quads_create(graph->store);
+	if(!quads)
+	{
+		return -1;
+	}
+	count = twine_quads_count(quads);
+	nterms = twine_quads_terms(quads);
+	hashes = (uint64_t *) calloc(nterms + 1, sizeof(uint64_t));
+	blank = (unsigned char *) calloc(nterms + 1, 1);
+	if(!hashes || !blank)
+	{
+		twine_logf(LOG_CRIT, "failed to allocate memory for graph digest\n");
+		free(hashes);
+		free(blank);
+		twine_quads_destroy(quads);
+		return -1;
+	}
+	/* Each distinct term is hashed once; blank nodes all start out with the
+	 * same hash, which is then refined according to their statements
+	 */
+	blanks = 0;
+	for(t = 1; t < nterms; t++)
+	{
+		hashes[t] = twine_memo_node_(twine_quads_node(quads, t));
+		if(librdf_node_is_blank(twine_quads_node(quads, t)))
+		{
+			blank[t] = 1;
+			blanks = 1;
+		}
+	}
+	if(blanks && twine_memo_blanks_(quads, hashes, blank))
+	{
+		free(hashes);
+		free(blank);
+		twine_quads_destroy(quads);
+		return -1;
+	}
+	s = twine_quads_subjects(quads);
+	p = twine_quads_predicates(quads);
+	o = twine_quads_objects(quads);
+	g = twine_quads_contexts(quads);
+	/* The hashes of the quads are combined with two commutative operations,
+	 * giving 128 bits which don't depend on the order of the quads; a model
+	 * never contains duplicate quads
+	 */
+	key->a = 0;
+	key->b = 0;
+	for(c = 0; c < count; c++)
+	{
+		h = twine_memo_mix_(hashes[s[c]]);
+		h = twine_memo_mix_(h ^ hashes[p[c]]);
+		h = twine_memo_mix_(h ^ hashes[o[c]]);
+		h = twine_memo_mix_(h ^ (g ? hashes[g[c]] : 0));
+		key->a += h;
+		key->b ^= twine_memo_mix_(h + 0x9e3779b97f4a7c15ULL);
+	}
+	free(hashes);
+	free(blank);
+	twine_quads_destroy(quads);
+	base = twine_memo_hash_((const unsigned char *) name, strlen(name) + 1, 0);
+	base = twine_memo_hash_((const unsigned char *) graph->uri, strlen(graph->uri), base);
+	base ^= (uint64_t) count;
+	key->a = twine_memo_mix_(key->a ^ base);
+	key->b = twine_memo_mix_(key->b ^ twine_memo_mix_(base));
+	return 0;
+}
+
+/* Private: if the results of invoking a processor on a graph with the given
+ * digest have been cached, replace the graph's model with them; returns 1
+ * if the results were replayed, 0 if they weren't cached, or -1 on error
+ */
+int
+twine_memo_replay_(TWINEMEMO *memo, const char *name, const TWINEMEMOKEY *key, TWINEGRAPH *graph)
+{
+	struct twine_memo_entry_struct *entry;
+	unsigned char *buf;
+	char *path;
+	size_t len;
+	int r;
+
+	buf = NULL;
+	len = 0;
+	pthread_mutex_lock(&(memo->lock));
+	entry = twine_memo_find_(memo, name, key);
+	if(entry)
+	{
+		/* Move the entry to the front of the list, and take a copy so that
+		 * the lock needn't be held while the graph is rebuilt
+		 */
+		twine_memo_unlink_(memo, entry);
+		entry->next = memo->first;
+		if(memo->first)
+		{
+			memo->first->prev = entry;
+		}
+		memo->first = entry;
+		if(!memo->last)
+		{
+			memo->last = entry;
+		}
+		buf = (unsigned char *) malloc(entry->len);
+		if(buf)
+		{
+			memcpy(buf, entry->buf, entry->len);
+			len = entry->len;
+		}
+	}
+	pthread_mutex_unlock(&(memo->lock));
+	if(!buf && memo->dir)
+	{
+		path = twine_memo_path_(memo, name, key);
+		if(path)
+		{
+			buf = twine_memo_read_(path, &len);
+			free(path);
+		}
+		if(buf)
+		{
+			/* Mark the file as recently used */
+			utime(path, NULL);
+			pthread_mutex_lock(&(memo->lock));
+			if(!twine_memo_find_(memo, name, key))
+			{
+				twine_memo_add_(memo, name, key, buf, len);
+			}
+			pthread_mutex_unlock(&(memo->lock));
+		}
+	}
+	if(!buf)
+	{
+		return 0;
+	}
+	r = twine_memo_load_(graph, buf, len);
+	free(buf);
+	return (r ? -1 : 1);
+}
+
+/* Private: cache the model of a graph as the results of invoking a
+ * processor on a graph with the given digest
+ */
+int
+twine_memo_store_(TWINEMEMO *memo, const char *name, const TWINEMEMOKEY *key, TWINEGRAPH *graph)
+{
+	unsigned char *buf;
+	char *path;
+	size_t len;
+	int r;
+
+	buf = twine_rdf_model_binary(graph->store, &len);
+	if(!buf)
+	{
+		return -1;
+	}
+	r = 0;
+	pthread_mutex_lock(&(memo->lock));
+	if(!twine_memo_find_(memo, name, key) && twine_memo_add_(memo, name, key, buf, len))
+	{
+		r = -1;
+	}
+	pthread_mutex_unlock(&(memo->lock));
+	if(memo->dir)
+	{
+		path = twine_memo_path_(memo, name, key);
+		if(!path || twine_memo_write_(path, buf, len))
+		{
+			r = -1;
+		}
+		else if(memo->dirsize)
+		{
+			pthread_mutex_lock(&(memo->lock));
+			memo->dirused += len;
+			if(memo->dirused > memo->dirsize)
+			{
+				twine_memo_prune_(memo, memo->dirsize / 4 * 3);
+			}
+			pthread_mutex_unlock(&(memo->lock));
+		}
+		free(path);
+	}
+	free(buf);
+	return r;
+}
+
+/* Locate an entry in memory; the lock must be held */
+static struct twine_memo_entry_struct *
+twine_memo_find_(TWINEMEMO *memo, const char *name, const TWINEMEMOKEY *key)
+{
+	struct twine_memo_entry_struct *entry;
+
+	for(entry = memo->buckets[key->a % MEMO_BUCKETS]; entry; entry = entry->chain)
+	{
+		if(entry->key.a == key->a && entry->key.b == key->b && !strcmp(entry->name, name))
+		{
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/* Add a copy of a result to the front of the list, evicting the least
+ * recently used entries to make room for it; the lock must be held
+ */
+static int
+twine_memo_add_(TWINEMEMO *memo, const char *name, const TWINEMEMOKEY *key, const unsigned char *buf, size_t len)
+{
+	struct twine_memo_entry_struct *entry;
+
+	if(len > memo->size)
+	{
+		return 0;
+	}
+	while(memo->last && memo->used + len > memo->size)
+	{
+		twine_memo_evict_(memo, memo->last);
+	}
+	entry = (struct twine_memo_entry_struct *) calloc(1, sizeof(struct twine_memo_entry_struct));
+	if(!entry)
+	{
+		twine_logf(LOG_CRIT, "failed to allocate memory for memo cache entry\n");
+		return -1;
+	}
+	entry->name = strdup(name);
+	entry->buf = (unsigned char *) malloc(len);
+	if(!entry->name || !entry->buf)
+	{
+		twine_logf(LOG_CRIT, "failed to allocate memory for memo cache entry\n");
+		free(entry->name);
+		free(entry->buf);
+		free(entry);
+		return -1;
+	}
+	memcpy(entry->buf, buf, len);
+	entry->len = len;
+	entry->key = *key;
+	entry->chain = memo->buckets[key->a % MEMO_BUCKETS];
+	memo->buckets[key->a % MEMO_BUCKETS] = entry;
+	entry->next = memo->first;
+	if(memo->first)
+	{
+		memo->first->prev = entry;
+	}
+	memo->first = entry;
+	if(!memo->last)
+	{
+		memo->last = entry;
+	}
+	memo->used += len;
+	return 0;
+}
+
+/* Remove and free an entry; the lock must be held */
+static void
+twine_memo_evict_(TWINEMEMO *memo, struct twine_memo_entry_struct *entry)
+{
+	struct twine_memo_entry_struct **p;
+
+	for(p = &(memo->buckets[entry->key.a % MEMO_BUCKETS]); *p; p = &((*p)->chain))
+	{
+		if(*p == entry)
+		{
+			*p = entry->chain;
+			break;
+		}
+	}
+	twine_memo_unlink_(memo, entry);
+	memo->used -= entry->len;
+	free(entry->name);
+	free(entry->buf);
+	free(entry);
+}
+
+/* Remove an entry from the list, leaving it in its bucket; the lock must
+ * be held
+ */
+static void
+twine_memo_unlink_(TWINEMEMO *memo, struct twine_memo_entry_struct *entry)
+{
+	if(entry->prev)
+	{
+		entry->prev->next = entry->next;
+	}
+	else
+	{
+		memo->first = entry->next;
+	}
+	if(entry->next)
+	{
+		entry->next->prev = entry->prev;
+	}
+	else
+	{
+		memo->last = entry->prev;
+	}
+	entry->prev = NULL;
+	entry->next = NULL;
+}
+
+/* Replace the model of a graph with cached results; compact storage is
+ * cleared and re-used, while anything else is replaced with a new model
+ */
+static int
+twine_memo_load_(TWINEGRAPH *graph, const unsigned char *buf, size_t len)
+{
+	librdf_storage *storage;
+	librdf_model *model;
+
+	storage = librdf_model_get_storage(graph->store);
+	if(storage && twine_storage_is_compact_(storage) && !twine_storage_reset_(storage))
+	{
+		return twine_rdf_model_parse(graph->store, TWINE_MIME_BINARY, (const char *) buf, len);
+	}
+	model = twine_rdf_model_create();
+	if(!model)
+	{
+		return -1;
+	}
+	if(twine_rdf_model_parse(model, TWINE_MIME_BINARY, (const char *) buf, len))
+	{
+		twine_rdf_model_destroy(model);
+		return -1;
+	}
+	twine_rdf_model_destroy(graph->store);
+	graph->store = model;
+	return 0;
+}
+
+/* Generate the path of the file holding a cached result; any characters
+ * in the processor name which aren't safe in a filename are replaced
+ */
+static char *
+twine_memo_path_(TWINEMEMO *memo, const char *name, const TWINEMEMOKEY *key)
+{
+	char *path, *t;
+	size_t len;
+
+	len = strlen(memo->dir) + strlen(name) + 48;
+	path = (char *) malloc(len);
+	if(!path)
+	{
+		twine_logf(LOG_CRIT, "failed to allocate memory for memo cache path\n");
+		return NULL;
+	}
+	snprintf(path, len, "%s/%s-%016llx%016llx.twq", memo->dir, name, (unsigned long long) key->a, (unsigned long long) key->b);
+	for(t = path + strlen(memo->dir) + 1; *t; t++)
+	{
+		if(!isalnum(*t) && *t != '-' && *t != '.' && *t != '_')
+		{
+			*t = '_';
+		}
+	}
+	return path;
+}
+
+/* Read a cached result from a file, if it exists */
+static unsigned char *
+twine_memo_read_(const char *path, size_t *len)
+{
+	unsigned char *buf;
+	struct stat sbuf;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if(!f)
+	{
+		return NULL;
+	}
+	if(fstat(fileno(f), &sbuf) || sbuf.st_size <= 0)
+	{
+		fclose(f);
+		return NULL;
+	}
+	buf = (unsigned char *) malloc(sbuf.st_size);
+	if(!buf)
+	{
+		twine_logf(LOG_CRIT, "failed to allocate %lu bytes for cached result\n", (unsigned long) sbuf.st_size);
+		fclose(f);
+		return NULL;
+	}
+	if(fread(buf, sbuf.st_size, 1, f) != 1)
+	{
+		twine_logf(LOG_ERR, "failed to read cached result from %s: %s\n", path, strerror(errno));
+		free(buf);
+		fclose(f);
+		return NULL;
+	}
+	fclose(f);
+	*len = sbuf.st_size;
+	return buf;
+}
+
+/* Write a cached result to a file; the result is written to a temporary
+ * file first, so that other processes never see a partial result
+ */
+static int
+twine_memo_write_(const char *path, const unsigned char *buf, size_t len)
+{
+	char *tmp;
+	size_t l;
+	FILE *f;
+	int r;
+
+	l = strlen(path) + 32;
+	tmp = (char *) malloc(l);
+	if(!tmp)
+	{
+		twine_logf(LOG_CRIT, "failed to allocate memory for memo cache path\n");
+		return -1;
+	}
+	snprintf(tmp, l, "%s.%lu.tmp", path, (unsigned long) getpid());
+	f = fopen(tmp, "wb");
+	if(!f)
+	{
+		twine_logf(LOG_ERR, "failed to open %s for writing: %s\n", tmp, strerror(errno));
+		free(tmp);
+		return -1;
+	}
+	r = (fwrite(buf, len, 1, f) == 1 ? 0 : -1);
+	if(fclose(f))
+	{
+		r = -1;
+	}
+	if(!r && rename(tmp, path))
+	{
+		r = -1;
+	}
+	if(r)
+	{
+		twine_logf(LOG_ERR, "failed to write cached result to %s: %s\n", path, strerror(errno));
+		unlink(tmp);
+	}
+	free(tmp);
+	return r;
+}
+
+/* Remove the least recently used files from the cache directory until
+ * they occupy no more than target bytes (if there's a limit), and record
+ * how much they occupy afterwards; because the directory may be shared
+ * with other processes, its actual contents are examined each time
+ */
+static void
+twine_memo_prune_(TWINEMEMO *memo, size_t target)
+{
+	struct twine_memo_file_struct *files, *p;
+	struct dirent *de;
+	struct stat sbuf;
+	size_t nfiles, size, total, c, l;
+	char *path;
+	DIR *dir;
+
+	dir = opendir(memo->dir);
+	if(!dir)
+	{
+		twine_logf(LOG_WARNING, "failed to open memo cache directory %s: %s\n", memo->dir, strerror(errno));
+		return;
+	}
+	files = NULL;
+	nfiles = 0;
+	size = 0;
+	total = 0;
+	while((de = readdir(dir)))
+	{
+		l = strlen(de->d_name);
+		if(l < 5 || strcmp(de->d_name + l - 4, ".twq"))
+		{
+			continue;
+		}
+		path = (char *) malloc(strlen(memo->dir) + l + 2);
+		if(!path)
+		{
+			break;
+		}
+		sprintf(path, "%s/%s", memo->dir, de->d_name);
+		if(stat(path, &sbuf) || !S_ISREG(sbuf.st_mode))
+		{
+			free(path);
+			continue;
+		}
+		if(nfiles >= size)
+		{
+			p = (struct twine_memo_file_struct *) realloc(files, (size + 64) * sizeof(struct twine_memo_file_struct));
+			if(!p)
+			{
+				free(path);
+				break;
+			}
+			files = p;
+			size += 64;
+		}
+		files[nfiles].name = path;
+		files[nfiles].len = (size_t) sbuf.st_size;
+		files[nfiles].mtime = sbuf.st_mtime;
+		nfiles++;
+		total += (size_t) sbuf.st_size;
+	}
+	closedir(dir);
+	if(memo->dirsize && total > target)
+	{
+		qsort(files, nfiles, sizeof(struct twine_memo_file_struct), twine_memo_file_cmp_);
+		for(c = 0; c < nfiles && total > target; c++)
+		{
+			if(!unlink(files[c].name) || errno == ENOENT)
+			{
+				total -= files[c].len;
+			}
+		}
+		twine_logf(LOG_DEBUG, "pruned memo cache directory %s to %lu bytes\n", memo->dir, (unsigned long) total);
+	}
+	for(c = 0; c < nfiles; c++)
+	{
+		free(files[c].name);
+	}
+	free(files);
+	memo->dirused = total;
+}
+
+/* Order files in the cache directory from least to most recently used */
+static int
+twine_memo_file_cmp_(const void *a, const void *b)
+{
+	const struct twine_memo_file_struct *fa, *fb;
+
+	fa = (const struct twine_memo_file_struct *) a;
+	fb = (const struct twine_memo_file_struct *) b;
+	if(fa->mtime < fb->mtime)
+	{
+		return -1;
+	}
+	return (fa->mtime > fb->mtime ? 1 : 0);
+}
+
+/* Refine the hashes of the blank nodes in a set of quads so that they
+ * reflect the statements each takes part in, rather than its identifier:
+ * in each round, a blank node's hash is combined with an order-independent
+ * sum of the hashes of its statements, until a round fails to tell any more
+ * of the blank nodes apart. Graphs which differ only in the identifiers
+ * given to their blank nodes therefore produce the same hashes.
+ */
+static int
+twine_memo_blanks_(TWINEQUADS *quads, uint64_t *hashes, const unsigned char *blank)
+{
+	const TWINETERM *s, *p, *o, *g;
+	uint64_t *acc, *values, h, gh;
+	TWINETERM nterms, t;
+	size_t c, count, nblanks, distinct, prev, round;
+
+	count = twine_quads_count(quads);
+	nterms = twine_quads_terms(quads);
+	s = twine_quads_subjects(quads);
+	p = twine_quads_predicates(quads);
+	o = twine_quads_objects(quads);
+	g = twine_quads_contexts(quads);
+	acc = (uint64_t *) calloc(nterms + 1, sizeof(uint64_t));
+	values = (uint64_t *) calloc(nterms + 1, sizeof(uint64_t));
+	if(!acc || !values)
+	{
+		twine_logf(LOG_CRIT, "failed to allocate memory for graph digest\n");
+		free(acc);
+		free(values);
+		return -1;
+	}
+	nblanks = 0;
+	for(t = 1; t < nterms; t++)
+	{
+		nblanks += blank[t];
+	}
+	prev = 1;
+	for(round = 0; round < nblanks; round++)
+	{
+		memset(acc, 0, (nterms + 1) * sizeof(uint64_t));
+		for(c = 0; c < count; c++)
+		{
+			gh = (g ? hashes[g[c]] : 0);
+			if(blank[s[c]])
+			{
+				h = twine_memo_mix_(hashes[p[c]] ^ 1);
+				h = twine_memo_mix_(h ^ hashes[o[c]]);
+				acc[s[c]] += twine_memo_mix_(h ^ gh);
+			}
+			if(blank[o[c]])
+			{
+				h = twine_memo_mix_(hashes[p[c]] ^ 2);
+				h = twine_memo_mix_(h ^ hashes[s[c]]);
+				acc[o[c]] += twine_memo_mix_(h ^ gh);
+			}
+			if(g && blank[g[c]])
+			{
+				h = twine_memo_mix_(hashes[s[c]] ^ 3);
+				h = twine_memo_mix_(h ^ hashes[p[c]]);
+				acc[g[c]] += twine_memo_mix_(h ^ hashes[o[c]]);
+			}
+		}
+		/* The hashes are only updated once every statement has been seen,
+		 * so that each round depends only on the previous one
+		 */
+		for(t = 1, c = 0; t < nterms; t++)
+		{
+			if(blank[t])
+			{
+				hashes[t] = twine_memo_mix_(hashes[t] + twine_memo_mix_(acc[t]));
+				values[c] = hashes[t];
+				c++;
+			}
+		}
+		distinct = twine_memo_distinct_(values, c);
+		if(distinct == prev || distinct == nblanks)
+		{
+			break;
+		}
+		prev = distinct;
+	}
+	free(acc);
+	free(values);
+	return 0;
+}
+
+/* Count the distinct values in an array, which is sorted in the process */
+static size_t
+twine_memo_distinct_(uint64_t *values, size_t count)
+{
+	size_t c, distinct;
+
+	if(!count)
+	{
+		return 0;
+	}
+	qsort(values, count, sizeof(uint64_t), twine_memo_value_cmp_);
+	distinct = 1;
+	for(c = 1; c < count; c++)
+	{
+		if(values[c] != values[c - 1])
+		{
+			distinct++;
+		}
+	}
+	return distinct;
+}
+
+static int
+twine_memo_value_cmp_(const void *a, const void *b)
+{
+	uint64_t va, vb;
+
+	va = *((const uint64_t *) a);
+	vb = *((const uint64_t *) b);
+	if(va < vb)
+	{
+		return -1;
+	}
+	return (va > vb ? 1 : 0);
+}
+
+/* Hash a node, distinguishing between the kinds of node and including the
+ * language and datatype of literals
+ */
+static uint64_t
+twine_memo_node_(librdf_node *node)
+{
+	const unsigned char *str;
+	librdf_uri *dt;
+	size_t len;
+	uint64_t h;
+
+	if(!node)
+	{
+		return 0;
+	}
+	if(librdf_node_is_resource(node))
+	{
+		str = librdf_uri_as_counted_string(librdf_node_get_uri(node), &len);
+		return twine_memo_hash_(str, len, 1);
+	}
+	if(librdf_node_is_blank(node))
+	{
+		/* The identifier is arbitrary, and so isn't hashed */
+		return twine_memo_hash_(NULL, 0, 2);
+	}
+	str = librdf_node_get_literal_value_as_counted_string(node, &len);
+	h = twine_memo_hash_(str, len, 3);
+	str = (const unsigned char *) librdf_node_get_literal_value_language(node);
+	if(str)
+	{
+		h = twine_memo_hash_((const unsigned char *) "@", 1, h);
+		h = twine_memo_hash_(str, strlen((const char *) str), h);
+	}
+	dt = librdf_node_get_literal_value_datatype_uri(node);
+	if(dt)
+	{
+		str = librdf_uri_as_counted_string(dt, &len);
+		h = twine_memo_hash_((const unsigned char *) "^", 1, h);
+		h = twine_memo_hash_(str, len, h);
+	}
+	return h;
+}
+
+/* Hash a counted string (64-bit FNV-1a), mixing in either a previous hash
+ * value or a small seed
+ */
+static uint64_t
+twine_memo_hash_(const unsigned char *str, size_t len, uint64_t hash)
+{
+	size_t c;
+
+	hash ^= 14695981039346656037ULL;
+	for(c = 0; c < len; c++)
+	{
+		hash ^= str[c];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/* Scramble the bits of a hash value (the MurmurHash3 finaliser) */
+static uint64_t
+twine_memo_mix_(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
@@ -0,0 +1,511 @@
+/* Twine: N-Triples and N-Quads parser
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libtwine.h"
+
+/* This is a line-oriented parser for N-Triples and N-Quads, which are by far
+ * the most common formats Twine ingests. Line, term and escape boundaries
+ * are located with memchr(), which the C library implements with vector
+ * instructions on most platforms, and terms without escapes are never
+ * copied before the node is created. URI nodes are obtained from the
+ * per-thread node cache, so repeated predicates and classes don't result in
+ * repeated allocations.
+ */
+
+#define NT_IRI                          (1<<0)
+#define NT_BLANK                        (1<<1)
+#define NT_LITERAL                      (1<<2)
+
+struct ntriples_struct
+{
+	librdf_world *world;
+	librdf_uri *base;
+	int quads;
+	unsigned long line;
+	const char *error;
+	TWINESTATEMENTFN fn;
+	void *data;
+	/* Scratch buffer for unescaping terms */
+	char *buf;
+	size_t bufsize;
+};
+
+static int ntriples_line_(struct ntriples_struct *nt, const char *p, const char *end);
+static const char *ntriples_term_(struct ntriples_struct *nt, const char *p, const char *end, librdf_node **node, int allowed);
+static const char *ntriples_literal_(struct ntriples_struct *nt, const char *p, const char *end, librdf_node **node);
+static librdf_node *ntriples_iri_(struct ntriples_struct *nt, const char *str, size_t len);
+static const char *ntriples_unescape_(struct ntriples_struct *nt, const char *str, size_t *len, int iri);
+static int ntriples_hex_(const char *p, int digits, unsigned long *cp);
+static size_t ntriples_utf8_(unsigned long cp, char *out);
+static const char *ntriples_ws_(const char *p, const char *end);
+
+/* Private: parse a buffer containing N-Triples (or N-Quads, if quads is
+ * nonzero), invoking fn for each statement
+ */
+int
+twine_ntriples_parse_(const char *buf, size_t buflen, librdf_uri *base, int quads, TWINESTATEMENTFN fn, void *data)
+{
+	struct ntriples_struct nt;
+	const char *p, *end, *eol;
+	int r;
+
+	memset(&nt, 0, sizeof(nt));
+	nt.world = twine_->world;
+	nt.base = base;
+	nt.quads = quads;
+	nt.fn = fn;
+	nt.data = data;
+	nt.line = 1;
+	r = 0;
+	end = buf + buflen;
+	for(p = buf; p < end; nt.line++)
+	{
+		eol = (const char *) memchr(p, '\n', end - p);
+		if(!eol)
+		{
+			eol = end;
+		}
+		if((r = ntriples_line_(&nt, p, eol)))
+		{
+			break;
+		}
+		p = (eol < end ? eol + 1 : end);
+	}
+	free(nt.buf);
+	return r;
+}
+
+/* Parse a single line */
+static int
+ntriples_line_(struct ntriples_struct *nt, const char *p, const char *end)
+{
+	librdf_node *subject, *predicate, *object, *graph;
+	librdf_statement *st;
+	int r;
+
+	subject = predicate = object = graph = NULL;
+	p = ntriples_ws_(p, end);
+	if(p == end || *p == '#')
+	{
+		/* Blank line or comment */
+		return 0;
+	}
+	if(!(p = ntriples_term_(nt, p, end, &subject, NT_IRI|NT_BLANK)) ||
+	   !(p = ntriples_term_(nt, ntriples_ws_(p, end), end, &predicate, NT_IRI)) ||
+	   !(p = ntriples_term_(nt, ntriples_ws_(p, end), end, &object, NT_IRI|NT_BLANK|NT_LITERAL)))
+	{
+		goto error;
+	}
+	p = ntriples_ws_(p, end);
+	if(p < end && *p != '.')
+	{
+		if(!nt->quads)
+		{
+			nt->error = "graph names are not permitted in N-Triples";
+			goto error;
+		}
+		if(!(p = ntriples_term_(nt, p, end, &graph, NT_IRI|NT_BLANK)))
+		{
+			goto error;
+		}
+		p = ntriples_ws_(p, end);
+	}
+	if(p >= end || *p != '.')
+	{
+		nt->error = "expected '.' at end of statement";
+		goto error;
+	}
+	p = ntriples_ws_(p + 1, end);
+	if(p < end && *p != '#')
+	{
+		nt->error = "unexpected characters following statement";
+		goto error;
+	}
+	/* The statement takes ownership of the nodes */
+	st = librdf_new_statement_from_nodes(nt->world, subject, predicate, object);
+	if(!st)
+	{
+		if(graph)
+		{
+			librdf_free_node(graph);
+		}
+		twine_logf(LOG_CRIT, "failed to create new statement\n");
+		return -1;
+	}
+	r = nt->fn(st, graph, nt->data);
+	librdf_free_statement(st);
+	if(graph)
+	{
+		librdf_free_node(graph);
+	}
+	return r ? -1 : 0;
+error:
+	if(subject)
+	{
+		librdf_free_node(subject);
+	}
+	if(predicate)
+	{
+		librdf_free_node(predicate);
+	}
+	if(object)
+	{
+		librdf_free_node(object);
+	}
+	if(graph)
+	{
+		librdf_free_node(graph);
+	}
+	twine_logf(LOG_ERR, "%s: %s at line %lu\n", (nt->quads ? "N-Quads" : "N-Triples"), nt->error ? nt->error : "failed to create node", nt->line);
+	return -1;
+}
+
+/* Parse a term, returning a pointer to the character following it, or NULL
+ * on error
+ */
+static const char *
+ntriples_term_(struct ntriples_struct *nt, const char *p, const char *end, librdf_node **node, int allowed)
+{
+	const char *q, *str;
+	size_t len;
+
+	nt->error = NULL;
+	if(p >= end)
+	{
+		nt->error = "unexpected end of line";
+		return NULL;
+	}
+	if(*p == '<' && (allowed & NT_IRI))
+	{
+		q = (const char *) memchr(p + 1, '>', end - p - 1);
+		if(!q)
+		{
+			nt->error = "unterminated IRI";
+			return NULL;
+		}
+		len = q - p - 1;
+		if(!(str = ntriples_unescape_(nt, p + 1, &len, 1)) ||
+		   !(*node = ntriples_iri_(nt, str, len)))
+		{
+			return NULL;
+		}
+		return q + 1;
+	}
+	if(*p == '_' && (allowed & NT_BLANK))
+	{
+		if(end - p < 3 || p[1] != ':')
+		{
+			nt->error = "invalid blank node label";
+			return NULL;
+		}
+		for(q = p + 2; q < end && *q != ' ' && *q != '\t' && *q != '\r' && *q != '<'; q++);
+		/* A label may contain but not end with a '.' */
+		while(q > p + 2 && q[-1] == '.')
+		{
+			q--;
+		}
+		if(q == p + 2)
+		{
+			nt->error = "invalid blank node label";
+			return NULL;
+		}
+		*node = librdf_new_node_from_counted_blank_identifier(nt->world, (const unsigned char *) p + 2, q - p - 2);
+		return *node ? q : NULL;
+	}
+	if(*p == '"' && (allowed & NT_LITERAL))
+	{
+		return ntriples_literal_(nt, p, end, node);
+	}
+	nt->error = "unexpected character";
+	return NULL;
+}
+
+/* Parse a literal, along with its language tag or datatype */
+static const char *
+ntriples_literal_(struct ntriples_struct *nt, const char *p, const char *end, librdf_node **node)
+{
+	const char *q, *t, *lang, *str;
+	librdf_node *dtnode;
+	librdf_uri *dturi;
+	size_t langlen, len;
+
+	/* Find the closing quote, which is not preceded by an odd number of
+	 * backslashes
+	 */
+	for(q = p + 1; ; q++)
+	{
+		q = (const char *) memchr(q, '"', end - q);
+		if(!q)
+		{
+			nt->error = "unterminated string";
+			return NULL;
+		}
+		for(t = q; t > p + 1 && t[-1] == '\\'; t--);
+		if(!((q - t) & 1))
+		{
+			break;
+		}
+	}
+	t = q + 1;
+	lang = NULL;
+	langlen = 0;
+	dtnode = NULL;
+	dturi = NULL;
+	if(t < end && *t == '@')
+	{
+		lang = t + 1;
+		for(t = lang; t < end && (isalnum((unsigned char) *t) || *t == '-'); t++);
+		langlen = t - lang;
+		if(!langlen)
+		{
+			nt->error = "empty language tag";
+			return NULL;
+		}
+	}
+	else if(end - t > 2 && t[0] == '^' && t[1] == '^')
+	{
+		/* The datatype must be processed before the value, as both may
+		 * need the scratch buffer
+		 */
+		if(!(t = ntriples_term_(nt, t + 2, end, &dtnode, NT_IRI)))
+		{
+			return NULL;
+		}
+		dturi = librdf_new_uri_from_uri(librdf_node_get_uri(dtnode));
+		librdf_free_node(dtnode);
+		if(!dturi)
+		{
+			return NULL;
+		}
+	}
+	len = q - p - 1;
+	str = ntriples_unescape_(nt, p + 1, &len, 0);
+	if(str)
+	{
+		*node = librdf_new_node_from_typed_counted_literal(nt->world, (const unsigned char *) str, len, lang, langlen, dturi);
+	}
+	if(dturi)
+	{
+		librdf_free_uri(dturi);
+	}
+	return (str && *node) ? t : NULL;
+}
+
+/* Create a node for an IRI, resolving it against the base URI if it's
+ * relative
+ */
+static librdf_node *
+ntriples_iri_(struct ntriples_struct *nt, const char *str, size_t len)
+{
+	librdf_uri *uri;
+	librdf_node *node;
+	char *tmp;
+	size_t c;
+
+	for(c = 0; c < len; c++)
+	{
+		if(str[c] == ':' || str[c] == '/' || str[c] == '?' || str[c] == '#')
+		{
+			break;
+		}
+	}
+	if((c < len && str[c] == ':') || !nt->base)
+	{
+		return twine_rdf_node_intern_(str, len);
+	}
+	tmp = (char *) malloc(len + 1);
+	if(!tmp)
+	{
+		return NULL;
+	}
+	memcpy(tmp, str, len);
+	tmp[len] = 0;
+	uri = librdf_new_uri_relative_to_base(nt->base, (const unsigned char *) tmp);
+	free(tmp);
+	if(!uri)
+	{
+		return NULL;
+	}
+	node = librdf_new_node_from_uri(nt->world, uri);
+	librdf_free_uri(uri);
+	return node;
+}
+
+/* Process the escapes in a string or IRI; if there are none, the string is
+ * returned as-is, otherwise the result is written to the scratch buffer
+ */
+static const char *
+ntriples_unescape_(struct ntriples_struct *nt, const char *str, size_t *len, int iri)
+{
+	const char *p, *end, *bs;
+	char *out, *tmp;
+	unsigned long cp;
+
+	end = str + *len;
+	bs = (const char *) memchr(str, '\\', *len);
+	if(!bs)
+	{
+		return str;
+	}
+	/* Unescaping never makes a string longer */
+	if(nt->bufsize < *len + 1)
+	{
+		tmp = (char *) realloc(nt->buf, *len + 1);
+		if(!tmp)
+		{
+			nt->error = "failed to allocate memory";
+			return NULL;
+		}
+		nt->buf = tmp;
+		nt->bufsize = *len + 1;
+	}
+	out = nt->buf;
+	for(p = str; bs; bs = (const char *) memchr(p, '\\', end - p))
+	{
+		memcpy(out, p, bs - p);
+		out += bs - p;
+		if(bs + 1 >= end)
+		{
+			nt->error = "invalid escape sequence";
+			return NULL;
+		}
+		p = bs + 2;
+		switch(bs[1])
+		{
+		case 'u':
+		case 'U':
+			if(end - p < (bs[1] == 'u' ? 4 : 8) || ntriples_hex_(p, bs[1] == 'u' ? 4 : 8, &cp))
+			{
+				nt->error = "invalid Unicode escape sequence";
+				return NULL;
+			}
+			p += (bs[1] == 'u' ? 4 : 8);
+			out += ntriples_utf8_(cp, out);
+			continue;
+		}
+		if(iri)
+		{
+			nt->error = "invalid escape sequence in IRI";
+			return NULL;
+		}
+		switch(bs[1])
+		{
+		case 't':
+			*out = '\t';
+			break;
+		case 'b':
+			*out = '\b';
+			break;
+		case 'n':
+			*out = '\n';
+			break;
+		case 'r':
+			*out = '\r';
+			break;
+		case 'f':
+			*out = '\f';
+			break;
+		case '"':
+		case '\'':
+		case '\\':
+			*out = bs[1];
+			break;
+		default:
+			nt->error = "invalid escape sequence";
+			return NULL;
+		}
+		out++;
+	}
+	memcpy(out, p, end - p);
+	out += end - p;
+	*len = out - nt->buf;
+	return nt->buf;
+}
+
+static int
+ntriples_hex_(const char *p, int digits, unsigned long *cp)
+{
+	int c;
+
+	*cp = 0;
+	for(c = 0; c < digits; c++)
+	{
+		*cp <<= 4;
+		if(p[c] >= '0' && p[c] <= '9')
+		{
+			*cp |= p[c] - '0';
+		}
+		else if(p[c] >= 'a' && p[c] <= 'f')
+		{
+			*cp |= p[c] - 'a' + 10;
+		}
+		else if(p[c] >= 'A' && p[c] <= 'F')
+		{
+			*cp |= p[c] - 'A' + 10;
+		}
+		else
+		{
+			return -1;
+		}
+	}
+	return (*cp > 0x10FFFF) ? -1 : 0;
+}
+
+/* Encode a code point as UTF-8, returning the number of bytes written */
+static size_t
+ntriples_utf8_(unsigned long cp, char *out)
+{
+	if(cp < 0x80)
+	{
+		out[0] = (char) cp;
+		return 1;
+	}
+	if(cp < 0x800)
+	{
+		out[0] = (char) (0xC0 | (cp >> 6));
+		out[1] = (char) (0x80 | (cp & 0x3F));
+		return 2;
+	}
+	if(cp < 0x10000)
+	{
+		out[0] = (char) (0xE0 | (cp >> 12));
+		out[1] = (char) (0x80 | ((cp >> 6) & 0x3F));
+		out[2] = (char) (0x80 | (cp & 0x3F));
+		return 3;
+	}
+	out[0] = (char) (0xF0 | (cp >> 18));
+	out[1] = (char) (0x80 | ((cp >> 12) & 0x3F));
+	out[2] = (char) (0x80 | ((cp >> 6) & 0x3F));
+	out[3] = (char) (0x80 | (cp & 0x3F));
+	return 4;
+}
+
+static const char *
+ntriples_ws_(const char *p, const char *end)
+{
+	while(p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+	{
+		p++;
+	}
+	return p;
+}
@@ -26,12 +26,14 @@
 # include <dlfcn.h>
 # include <errno.h>
 # include <string.h>
+# include <time.h>
 # include <pthread.h>
 # include <unistd.h>
 # include <sys/types.h>
 # include <sys/param.h>
 # include <sys/stat.h>
 # include <fcntl.h>
+# include <fnmatch.h>
 # include <curl/curl.h>
 # include <libcluster.h>
 
@@ -48,6 +50,13 @@
 # define DEFAULT_CONFIG_SECTION         DEFAULT_CONFIG_SECTION_NAME ":"
 # define DEFAULT_CONFIG_SECTION_LEN     9
 
+# define DEFAULT_STREAM_BATCH_SIZE      256
+# define DEFAULT_GRAPH_POOL_SIZE        8
+# define DEFAULT_PROCESSOR_THREADS      4
+# define DEFAULT_MEMO_CACHE_SIZE        (16 * 1024 * 1024)
+# define DEFAULT_MEMO_CACHE_DIR_SIZE    (256 * 1024 * 1024)
+# define DEFAULT_PARTITION_THRESHOLD    100000
+
 # define MIME_TURTLE                    "text/turtle"
 # define MIME_NTRIPLES                  "application/n-triples"
 # define MIME_NQUADS                    "application/n-quads"
@@ -57,6 +66,50 @@
 # define MIME_PLAIN                     "text/plain"
 # define MIME_N3                        "text/n3"
 
+# define TWINE_STORAGE_COMPACT          "twine-compact"
+# define TWINE_STORAGE_FEATURE_COMPACT  "http://bbcarchdev.github.io/twine/storage/compact"
+# define TWINE_STORAGE_FEATURE_RESET    "http://bbcarchdev.github.io/twine/storage/reset"
+
+typedef enum
+{
+	TWINE_FORMAT_NTRIPLES,
+	TWINE_FORMAT_TURTLE
+} twine_format;
+
+/* How the failure of processors in a tee(...) workflow stage affects the
+ * stage as a whole
+ */
+typedef enum
+{
+	TWINE_TEE_FAIL_ANY,
+	TWINE_TEE_FAIL_ALL,
+	TWINE_TEE_FAIL_NEVER
+} twine_tee_failure;
+
+typedef struct twine_stset_struct TWINESTSET;
+typedef struct twine_stream_struct TWINESTREAM;
+typedef struct twine_graph_pooled_struct TWINEPOOLEDGRAPH;
+typedef struct twine_arena_block_struct TWINEARENABLOCK;
+typedef struct twine_workers_struct TWINEWORKERS;
+typedef struct twine_worker_task_struct TWINEWORKERTASK;
+typedef struct twine_memo_struct TWINEMEMO;
+typedef struct twine_memo_key_struct TWINEMEMOKEY;
+typedef struct twine_workflow_struct TWINEWORKFLOW;
+
+struct twine_worker_task_struct
+{
+	int (*fn)(void *data);
+	void *data;
+	int result;
+};
+
+/* A digest of a graph and the processor invoked on it */
+struct twine_memo_key_struct
+{
+	uint64_t a;
+	uint64_t b;
+};
+
 typedef int (*twine_plugin_init_fn)(void);
 typedef int (*twine_plugin_cleanup_fn)(void);
 
@@ -67,6 +120,7 @@ typedef enum
 	TCB_BULK,
 	TCB_UPDATE,
 	TCB_PROCESSOR,
+	TCB_STREAM,
 	/* Legacy callback types */
 	TCB_LEGACY_MIME,
 	TCB_LEGACY_BULK,
@@ -104,6 +158,8 @@ struct twine_callback_struct
 {
 	twine_callback_type type;
 	void *module;
+	/* The name of the plug-in which registered the callback, if any */
+	char *plugin;
 	void *data;
 	union
 	{
@@ -125,8 +181,17 @@ struct twine_callback_struct
 		{
 			char *name;
 			TWINEPROCESSORFN fn;
+			unsigned int flags;
 		} processor;
 
+		struct
+		{
+			char *name;
+			TWINESTREAMBEGINFN begin;
+			TWINESTREAMBATCHFN batch;
+			TWINESTREAMENDFN end;
+		} stream;
+
 		struct
 		{
 			char *name;
@@ -145,6 +210,8 @@ struct twine_context_struct
 	TWINE *prev;
 	TWINELOGFN logger;
 	librdf_world *world;
+	/* The raptor world used by world, which Twine creates itself */
+	raptor_world *raptor;
 	TWINECONFIGFNS config;
 	char *appname;
 	size_t appnamelen;
@@ -155,6 +222,62 @@ struct twine_context_struct
 	char *sparql_query_uri;
 	char *sparql_update_uri;
 	char *sparql_data_uri;
+	twine_format sparql_put_format;
+	/* Graphs larger than these thresholds are written in chunks (0 = no limit) */
+	size_t sparql_put_max_triples;
+	size_t sparql_put_max_bytes;
+	/* The librdf storage module and options used for new models, for each
+	 * storage profile
+	 */
+	const char *rdf_storage[TWINE_STORAGE_PROFILES];
+	const char *rdf_storage_options[TWINE_STORAGE_PROFILES];
+	/* Whether to use Twine's own N-Triples and N-Quads parser */
+	int rdf_native_ntriples;
+	/* Whether graphs may be read by several threads at once, in which case
+	 * URI interning is disabled
+	 */
+	int rdf_concurrent;
+	/* Threads used to run thread-safe, read-only processors concurrently */
+	size_t processor_threads;
+	TWINEWORKERS *workers;
+	/* Graphs with at least this many triples are divided by subject
+	 * between the threads for partitionable processors (0 = never)
+	 */
+	size_t partition_threshold;
+	/* When a tee(...) stage is considered to have failed */
+	twine_tee_failure tee_failure;
+	/* Cached results of deterministic processors, if enabled */
+	TWINEMEMO *memo;
+	/* The named workflow selected for the message being processed, if any */
+	TWINEWORKFLOW *route;
+	/* Time limits for each workflow stage and for each message, in
+	 * milliseconds (0 = no limit), and the times at which the current
+	 * ones expire (0 = none)
+	 */
+	uint64_t stage_timeout;
+	uint64_t message_timeout;
+	uint64_t stage_deadline;
+	uint64_t message_deadline;
+	/* Set whenever a stage runs out of time */
+	int timed_out;
+	/* The number of statements passed to streaming processors at a time */
+	size_t stream_batch_size;
+	/* Limits on the size of messages and of graphs (0 = no limit) */
+	size_t max_message_size;
+	size_t max_graph_triples;
+	size_t max_graph_bytes;
+	/* Released graph objects retained for re-use, up to graph_pool_size */
+	TWINEPOOLEDGRAPH *graph_pool;
+	size_t graph_pool_count;
+	size_t graph_pool_size;
+	pthread_mutex_t graph_pool_lock;
+	/* Memory allocated for the current job, released when it changes */
+	TWINEARENABLOCK *arena;
+	pthread_mutex_t arena_lock;
+	/* The totals for the graphs processed so far for the current job */
+	size_t job_graphs;
+	size_t job_triples;
+	size_t job_bytes;
 	int allow_internal;
 	int is_daemon;
 	int plugins_enabled;
@@ -162,6 +285,8 @@ struct twine_context_struct
 	int cluster_enabled;
 	CLUSTERJOB *job;
 	void *plugin_current;
+	/* The name of the plug-in being loaded */
+	const char *plugin_name;
 	struct twine_callback_struct *callbacks;
 	size_t cbcount;
 	size_t cbsize;
@@ -171,8 +296,57 @@ extern TWINE *twine_;
 
 int twine_rdf_init_(TWINE *context);
 int twine_rdf_cleanup_(TWINE *context);
+int twine_rdf_ready_(TWINE *context);
+unsigned long twine_rdf_hash_(const char *str, size_t len, unsigned long hash);
+unsigned long twine_rdf_st_hash_(librdf_statement *statement);
+unsigned long twine_rdf_node_hash_(librdf_node *node, unsigned long hash);
+size_t twine_rdf_st_usage_(librdf_statement *statement);
+librdf_node *twine_rdf_node_intern_(const char *uri, size_t len);
+int twine_rdf_datatype_get_(const char *uri, size_t len);
+void twine_rdf_datatype_set_(const char *uri, size_t len, TWINEDATATYPE type);
+librdf_model *twine_rdf_model_create_like_(librdf_model *model);
+
+int twine_binary_parse_(const char *buf, size_t buflen, TWINESTATEMENTFN fn, void *data);
+int twine_ntriples_parse_(const char *buf, size_t buflen, librdf_uri *base, int quads, TWINESTATEMENTFN fn, void *data);
+
+TWINESTSET *twine_stset_create_(size_t hint);
+void twine_stset_destroy_(TWINESTSET *set);
+int twine_stset_add_(TWINESTSET *set, librdf_statement *statement);
+
+int twine_storage_register_(librdf_world *world);
+int twine_storage_is_compact_(librdf_storage *storage);
+int twine_storage_reset_(librdf_storage *storage);
+int twine_storage_usage_(librdf_storage *storage, size_t *triples, size_t *bytes);
+int twine_storage_columns_(librdf_storage *storage, const uint32_t **s, const uint32_t **p, const uint32_t **o, const uint32_t **g, size_t *nquads, size_t *live, uint32_t *nterms);
+uint32_t twine_storage_term_(librdf_storage *storage, librdf_node *node);
+librdf_node *twine_storage_node_(librdf_storage *storage, uint32_t id);
+int twine_storage_copy_(librdf_storage *dest, librdf_storage *src);
+int twine_storage_prepare_(librdf_storage *storage);
+
+TWINESTREAM *twine_stream_create_(TWINE *context, TWINEGRAPH *graph, struct twine_callback_struct **stages, CLUSTERJOB **jobs, size_t nstages);
+int twine_stream_destroy_(TWINESTREAM *stream);
+int twine_stream_materialise_(TWINESTREAM *stream, librdf_model *model, librdf_node *ctx);
+int twine_stream_begin_(TWINESTREAM *stream);
+int twine_stream_add_(TWINESTREAM *stream, librdf_statement *statement, librdf_node *ctx);
+int twine_stream_model_(TWINESTREAM *stream, librdf_model *model);
+int twine_stream_end_(TWINESTREAM *stream, int status);
+int twine_stream_usage_(TWINESTREAM *stream, size_t *triples, size_t *bytes);
+ssize_t twine_stream_failed_(TWINESTREAM *stream);
 
 int twine_graph_cleanup_(twine_graph *graph);
+int twine_graph_pool_cleanup_(TWINE *context);
+
+int twine_arena_cleanup_(TWINE *context);
+
+TWINEWORKERS *twine_workers_create_(size_t nthreads);
+int twine_workers_destroy_(TWINEWORKERS *workers);
+int twine_workers_run_(TWINEWORKERS *workers, TWINEWORKERTASK *tasks, size_t ntasks);
+
+TWINEMEMO *twine_memo_create_(size_t size, const char *dir, size_t dirsize);
+int twine_memo_destroy_(TWINEMEMO *memo);
+int twine_memo_digest_(const char *name, TWINEGRAPH *graph, TWINEMEMOKEY *key);
+int twine_memo_replay_(TWINEMEMO *memo, const char *name, const TWINEMEMOKEY *key, TWINEGRAPH *graph);
+int twine_memo_store_(TWINEMEMO *memo, const char *name, const TWINEMEMOKEY *key, TWINEGRAPH *graph);
 int twine_graph_process_(const char *name, twine_graph *graph);
 
 int twine_plugin_init_(TWINE *context);
@@ -187,6 +361,8 @@ int twine_preproc_process_(twine_graph *graph);
 int twine_postproc_process_(twine_graph *graph);
 
 int twine_sparql_init_(TWINE *context);
+int twine_sparql_format_(const char *name);
+int twine_sparql_put_graph_(TWINE *context, SPARQL *conn, twine_graph *graph);
 
 int twine_cluster_init_(TWINE *context);
 int twine_cluster_ready_(TWINE *context);
@@ -137,6 +137,15 @@ twine_plugin_bulk_exists(TWINE *restrict context, const char *mimetype)
 /* Public: register a graph processor */
 int
 twine_plugin_add_processor(TWINE *context, const char *name, TWINEPROCESSORFN fn, void *userdata)
+{
+	return twine_plugin_add_processor_flags(context, name, fn, userdata, 0);
+}
+
+/* Public: register a graph processor, describing its behaviour so that
+ * the workflow can schedule it appropriately
+ */
+int
+twine_plugin_add_processor_flags(TWINE *restrict context, const char *restrict name, TWINEPROCESSORFN fn, void *userdata, unsigned int flags)
 {
 	struct twine_callback_struct *p;
 
@@ -152,11 +161,44 @@ twine_plugin_add_processor(TWINE *context, const char *name, TWINEPROCESSORFN fn
 		return -1;
 	}
 	p->m.processor.fn = fn;
+	p->m.processor.flags = flags;
 	p->type = TCB_PROCESSOR;
 	twine_logf(LOG_INFO, "registered graph processor: '%s'\n", name);
 	return 0;
 }
 
+/* Public: register a streaming graph processor, which receives the
+ * statements of each graph in batches rather than as a complete model
+ */
+int
+twine_plugin_add_stream_processor(TWINE *restrict context, const char *restrict name, TWINESTREAMBEGINFN begin, TWINESTREAMBATCHFN batch, TWINESTREAMENDFN end, void *userdata)
+{
+	struct twine_callback_struct *p;
+
+	if(!batch)
+	{
+		twine_logf(LOG_ERR, "cannot register streaming processor '%s' without a batch callback\n", name);
+		return -1;
+	}
+	p = twine_plugin_callback_add_(context, userdata);
+	if(!p)
+	{
+		return -1;
+	}
+	p->m.stream.name = strdup(name);
+	if(!p->m.stream.name)
+	{
+		twine_logf(LOG_CRIT, "failed to allocate memory to register streaming processor '%s'\n", name);
+		return -1;
+	}
+	p->m.stream.begin = begin;
+	p->m.stream.batch = batch;
+	p->m.stream.end = end;
+	p->type = TCB_STREAM;
+	twine_logf(LOG_INFO, "registered streaming graph processor: '%s'\n", name);
+	return 0;
+}
+
 /* Public: determine whether a particular named graph processor has been
  * registered
  */
@@ -172,6 +214,11 @@ twine_plugin_processor_exists(TWINE *restrict context, const char *restrict name
 		{
 			return 1;
 		}
+		if(context->callbacks[l].type == TCB_STREAM &&
+		   !strcasecmp(context->callbacks[l].m.stream.name, name))
+		{
+			return 1;
+		}
 		if(context->callbacks[l].type == TCB_LEGACY_GRAPH &&
 		   !strcasecmp(context->callbacks[l].m.legacy_graph.name, name))
 		{
@@ -229,7 +276,7 @@ twine_plugin_load(TWINE *restrict context, const char *restrict pathname)
 	void *handle;
 	TWINEENTRYFN entry;
 	twine_plugin_init_fn fn;
-	char *fnbuf;
+	char *fnbuf, *name, *t;
 	size_t len;
 	TWINE *prevtwine;
 	int r;
@@ -277,7 +324,21 @@ twine_plugin_load(TWINE *restrict context, const char *restrict pathname)
 			return NULL;
 		}
 	}
+	/* Callbacks record the name of the plug-in which registered them,
+	 * which is the base name of its module (e.g., 'rdf' for rdf.so)
+	 */
+	t = strrchr(pathname, '/');
+	name = strdup(t ? t + 1 : pathname);
+	if(name)
+	{
+		t = strchr(name, '.');
+		if(t)
+		{
+			*t = 0;
+		}
+	}
 	context->plugin_current = handle;
+	context->plugin_name = name;
 	if(entry)
 	{
 		r = entry(context, TWINE_ATTACHED, handle);
@@ -287,6 +348,8 @@ twine_plugin_load(TWINE *restrict context, const char *restrict pathname)
 		twine_logf(LOG_WARNING, "plug-in '%s' uses deprecated APIs\n", pathname);
 		r = fn();
 	}
+	context->plugin_name = NULL;
+	free(name);
 	if(r)
 	{
 		twine_logf(LOG_ERR, "initialisation of plug-in %s failed\n", pathname);
@@ -322,6 +385,7 @@ twine_plugin_unload(TWINE *restrict context, void *handle)
 			l++;
 			continue;
 		}
+		free(context->callbacks[l].plugin);
 		switch(context->callbacks[l].type)
 		{
 		case TCB_NONE:
@@ -339,6 +403,9 @@ twine_plugin_unload(TWINE *restrict context, void *handle)
 		case TCB_PROCESSOR:
 			free(context->callbacks[l].m.processor.name);
 			break;
+		case TCB_STREAM:
+			free(context->callbacks[l].m.stream.name);
+			break;
 		case TCB_LEGACY_MIME:
 			free(context->callbacks[l].m.legacy_mime.type);
 			free(context->callbacks[l].m.legacy_mime.desc);
@@ -451,6 +518,15 @@ twine_plugin_callback_add_(TWINE *restrict context, void *restrict data)
 	}
 	p = &(context->callbacks[context->cbcount]);
 	memset(p, 0, sizeof(struct twine_callback_struct));
+	if(context->plugin_name)
+	{
+		p->plugin = strdup(context->plugin_name);
+		if(!p->plugin)
+		{
+			twine_logf(LOG_CRIT, "failed to allocate memory to register callback\n");
+			return NULL;
+		}
+	}
 	p->module = context->plugin_current;
 	p->data = data;
 	context->cbcount++;
@@ -0,0 +1,481 @@
+/* Twine: Quad arrays
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libtwine.h"
+
+/* A quad array built from a model using twine-compact storage shares that
+ * storage's term dictionary, and its columns too if nothing has been
+ * removed from the model; otherwise, the model is streamed once and each
+ * distinct term is assigned an identifier in a dictionary of our own.
+ */
+
+#define QUADS_MIN_SIZE                  64
+
+struct twine_quads_struct
+{
+	/* The compact storage whose dictionary is used, if any */
+	librdf_storage *storage;
+	size_t count;
+	TWINETERM *s, *p, *o, *g;
+	/* Whether the columns were allocated by us */
+	int owned;
+	/* Nodes for each term, created on demand when sharing a storage
+	 * dictionary; nodes[0] is unused
+	 */
+	librdf_node **nodes;
+	TWINETERM nterms;
+	/* Our own dictionary: the hash of each term, and an open-addressed
+	 * table of identifiers
+	 */
+	unsigned long *hashes;
+	TWINETERM termsize;
+	TWINETERM *dict;
+	size_t dictsize;
+};
+
+static int twine_quads_compact_(TWINEQUADS *quads, librdf_storage *storage);
+static int twine_quads_stream_(TWINEQUADS *quads, librdf_model *model);
+static int twine_quads_grow_(TWINEQUADS *quads, size_t size);
+static TWINETERM twine_quads_intern_(TWINEQUADS *quads, librdf_node *node, int create);
+static int twine_quads_dict_grow_(TWINEQUADS *quads);
+
+/* Public: create a quad array from the statements in a model */
+TWINEQUADS *
+twine_quads_create(librdf_model *model)
+{
+	TWINEQUADS *p;
+	librdf_storage *storage;
+	int r;
+
+	p = (TWINEQUADS *) calloc(1, sizeof(TWINEQUADS));
+	if(!p)
+	{
+		twine_logf(LOG_CRIT, "failed to allocate memory for quad array\n");
+		return NULL;
+	}
+	storage = librdf_model_get_storage(model);
+	if(storage && twine_storage_is_compact_(storage))
+	{
+		r = twine_quads_compact_(p, storage);
+	}
+	else
+	{
+		r = twine_quads_stream_(p, model);
+	}
+	if(r)
+	{
+		twine_quads_destroy(p);
+		return NULL;
+	}
+	return p;
+}
+
+/* Public: destroy a quad array */
+int
+twine_quads_destroy(TWINEQUADS *quads)
+{
+	TWINETERM c;
+
+	if(quads->nodes)
+	{
+		for(c = 1; c < quads->nterms; c++)
+		{
+			if(quads->nodes[c])
+			{
+				librdf_free_node(quads->nodes[c]);
+			}
+		}
+		free(quads->nodes);
+	}
+	if(quads->owned)
+	{
+		free(quads->s);
+		free(quads->p);
+		free(quads->o);
+		free(quads->g);
+	}
+	free(quads->hashes);
+	free(quads->dict);
+	free(quads);
+	return 0;
+}
+
+/* Public: return the number of quads in a quad array */
+size_t
+twine_quads_count(TWINEQUADS *quads)
+{
+	return quads->count;
+}
+
+/* Public: return one more than the largest term identifier in a quad array */
+TWINETERM
+twine_quads_terms(TWINEQUADS *quads)
+{
+	return quads->nterms;
+}
+
+/* Public: return the subjects column of a quad array */
+const TWINETERM *
+twine_quads_subjects(TWINEQUADS *quads)
+{
+	return quads->s;
+}
+
+/* Public: return the predicates column of a quad array */
+const TWINETERM *
+twine_quads_predicates(TWINEQUADS *quads)
+{
+	return quads->p;
+}
+
+/* Public: return the objects column of a quad array */
+const TWINETERM *
+twine_quads_objects(TWINEQUADS *quads)
+{
+	return quads->o;
+}
+
+/* Public: return the contexts column of a quad array, if any */
+const TWINETERM *
+twine_quads_contexts(TWINEQUADS *quads)
+{
+	return quads->g;
+}
+
+/* Public: return the identifier of a term, or TWINE_TERM_NONE if it doesn't
+ * appear in the quad array
+ */
+TWINETERM
+twine_quads_term(TWINEQUADS *quads, librdf_node *node)
+{
+	if(!node)
+	{
+		return TWINE_TERM_NONE;
+	}
+	if(quads->storage)
+	{
+		return twine_storage_term_(quads->storage, node);
+	}
+	return twine_quads_intern_(quads, node, 0);
+}
+
+/* Public: return the identifier of a URI term */
+TWINETERM
+twine_quads_term_uri(TWINEQUADS *quads, const char *uri)
+{
+	librdf_node *node;
+	TWINETERM term;
+
+	node = twine_rdf_node_createuri(uri);
+	if(!node)
+	{
+		return TWINE_TERM_NONE;
+	}
+	term = twine_quads_term(quads, node);
+	librdf_free_node(node);
+	return term;
+}
+
+/* Public: return the node corresponding to a term identifier; the node is
+ * owned by the quad array
+ */
+librdf_node *
+twine_quads_node(TWINEQUADS *quads, TWINETERM term)
+{
+	if(term == TWINE_TERM_NONE || term >= quads->nterms)
+	{
+		return NULL;
+	}
+	if(!quads->nodes)
+	{
+		quads->nodes = (librdf_node **) calloc(quads->nterms, sizeof(librdf_node *));
+		if(!quads->nodes)
+		{
+			twine_logf(LOG_CRIT, "failed to allocate memory for quad array nodes\n");
+			return NULL;
+		}
+	}
+	if(!quads->nodes[term] && quads->storage)
+	{
+		quads->nodes[term] = twine_storage_node_(quads->storage, term);
+	}
+	return quads->nodes[term];
+}
+
+/* Public: return the URI, literal value or blank node identifier of a
+ * term
+ */
+const char *
+twine_quads_string(TWINEQUADS *quads, TWINETERM term, size_t *len)
+{
+	librdf_node *node;
+	const char *str;
+	size_t l;
+
+	node = twine_quads_node(quads, term);
+	if(!node)
+	{
+		return NULL;
+	}
+	if(librdf_node_is_resource(node))
+	{
+		str = (const char *) librdf_uri_as_counted_string(librdf_node_get_uri(node), &l);
+	}
+	else if(librdf_node_is_blank(node))
+	{
+		str = (const char *) librdf_node_get_blank_identifier(node);
+		l = strlen(str);
+	}
+	else
+	{
+		str = (const char *) librdf_node_get_literal_value_as_counted_string(node, &l);
+	}
+	if(len)
+	{
+		*len = l;
+	}
+	return str;
+}
+
+/* Private: build a quad array from a twine-compact storage instance */
+static int
+twine_quads_compact_(TWINEQUADS *quads, librdf_storage *storage)
+{
+	const uint32_t *s, *p, *o, *g;
+	size_t nquads, live, c, n;
+
+	twine_storage_columns_(storage, &s, &p, &o, &g, &nquads, &live, &(quads->nterms));
+	quads->storage = storage;
+	quads->count = live;
+	if(live == nquads)
+	{
+		/* There are no holes, so the storage's own columns can be used */
+		quads->s = (TWINETERM *) s;
+		quads->p = (TWINETERM *) p;
+		quads->o = (TWINETERM *) o;
+		quads->g = (TWINETERM *) g;
+		return 0;
+	}
+	if(twine_quads_grow_(quads, live ? live : 1))
+	{
+		return -1;
+	}
+	if(!g)
+	{
+		free(quads->g);
+		quads->g = NULL;
+	}
+	for(c = 0, n = 0; c < nquads; c++)
+	{
+		if(!s[c])
+		{
+			continue;
+		}
+		quads->s[n] = s[c];
+		quads->p[n] = p[c];
+		quads->o[n] = o[c];
+		if(g)
+		{
+			quads->g[n] = g[c];
+		}
+		n++;
+	}
+	return 0;
+}
+
+/* Private: build a quad array by streaming a model */
+static int
+twine_quads_stream_(TWINEQUADS *quads, librdf_model *model)
+{
+	librdf_stream *stream;
+	librdf_statement *st;
+	librdf_node *ctx;
+	size_t size;
+	int contexts, r;
+
+	r = librdf_model_size(model);
+	size = (r > QUADS_MIN_SIZE ? (size_t) r : QUADS_MIN_SIZE);
+	if(twine_quads_grow_(quads, size))
+	{
+		return -1;
+	}
+	quads->nterms = 1;
+	stream = librdf_model_as_stream(model);
+	if(!stream)
+	{
+		twine_logf(LOG_ERR, "failed to obtain stream from model for quad array\n");
+		return -1;
+	}
+	contexts = 0;
+	r = 0;
+	for(; !librdf_stream_end(stream); librdf_stream_next(stream))
+	{
+		if(quads->count == size)
+		{
+			size *= 2;
+			if(twine_quads_grow_(quads, size))
+			{
+				r = -1;
+				break;
+			}
+		}
+		st = librdf_stream_get_object(stream);
+		ctx = librdf_stream_get_context2(stream);
+		quads->s[quads->count] = twine_quads_intern_(quads, librdf_statement_get_subject(st), 1);
+		quads->p[quads->count] = twine_quads_intern_(quads, librdf_statement_get_predicate(st), 1);
+		quads->o[quads->count] = twine_quads_intern_(quads, librdf_statement_get_object(st), 1);
+		quads->g[quads->count] = (ctx ? twine_quads_intern_(quads, ctx, 1) : TWINE_TERM_NONE);
+		if(!quads->s[quads->count] || !quads->p[quads->count] || !quads->o[quads->count] ||
+		   (ctx && !quads->g[quads->count]))
+		{
+			r = -1;
+			break;
+		}
+		if(ctx)
+		{
+			contexts = 1;
+		}
+		quads->count++;
+	}
+	librdf_free_stream(stream);
+	if(!contexts)
+	{
+		free(quads->g);
+		quads->g = NULL;
+	}
+	return r;
+}
+
+/* Private: resize the columns of a quad array which we own */
+static int
+twine_quads_grow_(TWINEQUADS *quads, size_t size)
+{
+	TWINETERM **columns[4], *p;
+	size_t c;
+
+	columns[0] = &(quads->s);
+	columns[1] = &(quads->p);
+	columns[2] = &(quads->o);
+	columns[3] = &(quads->g);
+	quads->owned = 1;
+	for(c = 0; c < 4; c++)
+	{
+		p = (TWINETERM *) realloc(*(columns[c]), sizeof(TWINETERM) * size);
+		if(!p)
+		{
+			twine_logf(LOG_CRIT, "failed to expand quad array to %u quads\n", (unsigned) size);
+			return -1;
+		}
+		*(columns[c]) = p;
+	}
+	return 0;
+}
+
+/* Private: look up a term in our own dictionary, optionally adding it */
+static TWINETERM
+twine_quads_intern_(TWINEQUADS *quads, librdf_node *node, int create)
+{
+	unsigned long hash;
+	size_t c;
+	TWINETERM id;
+	librdf_node **nodes;
+	unsigned long *hashes;
+
+	hash = twine_rdf_node_hash_(node, 0);
+	if(quads->dictsize)
+	{
+		for(c = hash & (quads->dictsize - 1); (id = quads->dict[c]); c = (c + 1) & (quads->dictsize - 1))
+		{
+			if(quads->hashes[id] == hash && librdf_node_equals(quads->nodes[id], node))
+			{
+				return id;
+			}
+		}
+	}
+	if(!create)
+	{
+		return TWINE_TERM_NONE;
+	}
+	if(quads->nterms >= quads->termsize)
+	{
+		id = (quads->termsize ? quads->termsize * 2 : QUADS_MIN_SIZE);
+		nodes = (librdf_node **) realloc(quads->nodes, sizeof(librdf_node *) * id);
+		if(nodes)
+		{
+			quads->nodes = nodes;
+		}
+		hashes = (unsigned long *) realloc(quads->hashes, sizeof(unsigned long) * id);
+		if(hashes)
+		{
+			quads->hashes = hashes;
+		}
+		if(!nodes || !hashes)
+		{
+			twine_logf(LOG_CRIT, "failed to expand quad array dictionary\n");
+			return TWINE_TERM_NONE;
+		}
+		quads->nodes[0] = NULL;
+		quads->termsize = id;
+	}
+	if((quads->nterms + 1) * 2 > quads->dictsize && twine_quads_dict_grow_(quads))
+	{
+		return TWINE_TERM_NONE;
+	}
+	id = quads->nterms;
+	quads->nodes[id] = librdf_new_node_from_node(node);
+	if(!quads->nodes[id])
+	{
+		twine_logf(LOG_CRIT, "failed to duplicate node for quad array\n");
+		return TWINE_TERM_NONE;
+	}
+	quads->hashes[id] = hash;
+	for(c = hash & (quads->dictsize - 1); quads->dict[c]; c = (c + 1) & (quads->dictsize - 1));
+	quads->dict[c] = id;
+	quads->nterms++;
+	return id;
+}
+
+/* Private: double the size of our dictionary's table */
+static int
+twine_quads_dict_grow_(TWINEQUADS *quads)
+{
+	TWINETERM *dict, id;
+	size_t size, c;
+
+	size = (quads->dictsize ? quads->dictsize * 2 : QUADS_MIN_SIZE * 2);
+	dict = (TWINETERM *) calloc(size, sizeof(TWINETERM));
+	if(!dict)
+	{
+		twine_logf(LOG_CRIT, "failed to expand quad array dictionary\n");
+		return -1;
+	}
+	for(id = 1; id < quads->nterms; id++)
+	{
+		for(c = quads->hashes[id] & (size - 1); dict[c]; c = (c + 1) & (size - 1));
+		dict[c] = id;
+	}
+	free(quads->dict);
+	quads->dict = dict;
+	quads->dictsize = size;
+	return 0;
+}
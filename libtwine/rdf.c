@@ -27,30 +27,284 @@
 # error librdf library version is too old; please upgrade to a version which supports contexts
 #endif
 
+/* The maximum number of idle parsers and serialisers retained per thread */
+#define TWINE_RDF_POOL_MAX              16
+/* The number of URI nodes cached per thread (must be a power of two) */
+#define TWINE_RDF_NODE_CACHE            1024
+/* The number of literal datatype classifications cached per thread (must be
+ * a power of two), and the longest datatype URI which will be cached
+ */
+#define TWINE_RDF_DATATYPE_CACHE        32
+#define TWINE_RDF_DATATYPE_MAX          96
+
+/* Approximate per-node and per-statement overheads used when estimating the
+ * memory used by a model whose storage can't report it
+ */
+#define TWINE_RDF_NODE_OVERHEAD         48
+#define TWINE_RDF_ST_OVERHEAD           160
+
+typedef enum
+{
+	POOL_PARSER,
+	POOL_SERIALIZER
+} twine_rdf_pool_kind;
+
+/* A parser or serialiser instance which can be re-used by the thread that
+ * created it
+ */
+struct twine_rdf_pooled_struct
+{
+	twine_rdf_pool_kind kind;
+	librdf_world *world;
+	char *key;
+	void *obj;
+	int busy;
+};
+
+/* State passed to the statement handler while parsing */
+struct twine_rdf_parse_struct
+{
+	TWINESTATEMENTFN fn;
+	void *data;
+	raptor_parser *parser;
+	int failed;
+};
+
+/* State passed to the statement callback while parsing into a model */
+struct twine_rdf_model_parse_struct
+{
+	librdf_model *model;
+	librdf_node *graph;
+};
+
+/* A cached URI node */
+struct twine_rdf_cached_node_struct
+{
+	unsigned long hash;
+	librdf_world *world;
+	librdf_node *node;
+};
+
+/* A cached classification of a literal datatype URI */
+struct twine_rdf_cached_datatype_struct
+{
+	unsigned long hash;
+	size_t len;
+	char uri[TWINE_RDF_DATATYPE_MAX];
+	TWINEDATATYPE type;
+};
+
+/* The set of pooled instances and cached nodes belonging to a thread */
+struct twine_rdf_pool_struct
+{
+	struct twine_rdf_pool_struct *prev, *next;
+	struct twine_rdf_pooled_struct entries[TWINE_RDF_POOL_MAX];
+	size_t nentries;
+	struct twine_rdf_cached_node_struct nodes[TWINE_RDF_NODE_CACHE];
+	struct twine_rdf_cached_datatype_struct datatypes[TWINE_RDF_DATATYPE_CACHE];
+};
+
 static int twine_librdf_logger(void *data, librdf_log_message *message);
 static int nstrcasecmp(const char *a, const char *b, size_t alen);
+static int twine_rdf_storage_profile_(TWINE *context, TWINESTORAGEPROFILE profile, const char *name);
+static void twine_rdf_parse_statement_(void *user_data, raptor_statement *statement);
+static int twine_rdf_model_parse_statement_(librdf_statement *statement, librdf_node *graph, void *userdata);
+static size_t twine_rdf_node_usage_(librdf_node *node);
+static raptor_parser *twine_rdf_parser_acquire_(const char *name);
+static void twine_rdf_parser_release_(raptor_parser *parser);
+static librdf_serializer *twine_rdf_serializer_acquire_(const char *name);
+static void twine_rdf_serializer_release_(librdf_serializer *serializer);
+static struct twine_rdf_pool_struct *twine_rdf_pool_(void);
+static void *twine_rdf_pool_acquire_(twine_rdf_pool_kind kind, const char *key);
+static int twine_rdf_pool_add_(twine_rdf_pool_kind kind, const char *key, void *obj);
+static int twine_rdf_pool_release_(void *obj);
+static void twine_rdf_pool_free_entry_(struct twine_rdf_pooled_struct *entry);
+static void twine_rdf_pool_init_(void);
+static void twine_rdf_pool_destroy_(void *ptr);
+
+/* Profile names, as used in storage-NAME configuration options */
+static const char *twine_rdf_profiles_[TWINE_STORAGE_PROFILES] = {
+	"default",
+	"single",
+	"append",
+	"indexed"
+};
+
+static pthread_once_t twine_rdf_pool_once_ = PTHREAD_ONCE_INIT;
+static pthread_key_t twine_rdf_pool_key_;
+static pthread_mutex_t twine_rdf_pool_lock_ = PTHREAD_MUTEX_INITIALIZER;
+static struct twine_rdf_pool_struct *twine_rdf_pools_;
 
 int
 twine_rdf_init_(TWINE *context)
 {
+	int c;
+
 	context->world = librdf_new_world();
 	if(!context->world)
 	{
 		twine_logf(LOG_CRIT, "failed to create new RDF world\n");
 		return -1;
 	}
-	librdf_world_open(context->world);
+	/* The world isn't opened until the configuration has been loaded (see
+	 * twine_rdf_ready_()), because whether URI interning can be used
+	 * depends upon it
+	 */
+	context->raptor = raptor_new_world();
+	if(context->raptor)
+	{
+		librdf_world_set_raptor(context->world, context->raptor);
+	}
 	librdf_world_set_logger(context->world, NULL, twine_librdf_logger);
+	context->rdf_native_ntriples = 1;
+	/* Until the configuration has been loaded, all profiles use the hashes
+	 * storage
+	 */
+	for(c = 0; c < TWINE_STORAGE_PROFILES; c++)
+	{
+		twine_rdf_storage_profile_(context, (TWINESTORAGEPROFILE) c, "hashes");
+	}
 	return 0;
 }
 
+/* Private: apply RDF-related configuration once it has been loaded */
+int
+twine_rdf_ready_(TWINE *context)
+{
+	char *t;
+	const char *def;
+	char key[64];
+	int c;
+
+	context->rdf_native_ntriples = twine_config_get_bool("*:rdf-native-ntriples", 1);
+	/* rdf-storage selects the storage used by the default profile */
+	t = twine_config_geta("*:rdf-storage", "hashes");
+	if(twine_rdf_storage_profile_(context, TWINE_STORAGE_DEFAULT, t))
+	{
+		twine_logf(LOG_CRIT, "unsupported rdf-storage '%s' (should be 'hashes' or 'compact')\n", t);
+		free(t);
+		return -1;
+	}
+	free(t);
+	/* The other profiles also use hashes storage unless configured
+	 * otherwise; storage-default overrides rdf-storage
+	 */
+	for(c = 0; c < TWINE_STORAGE_PROFILES; c++)
+	{
+		def = (c == TWINE_STORAGE_DEFAULT ? NULL : "hashes");
+		snprintf(key, sizeof(key), "*:storage-%s", twine_rdf_profiles_[c]);
+		t = twine_config_geta(key, def);
+		if(t && twine_rdf_storage_profile_(context, (TWINESTORAGEPROFILE) c, t))
+		{
+			twine_logf(LOG_CRIT, "unsupported storage-%s '%s' (should be 'hashes' or 'compact')\n", twine_rdf_profiles_[c], t);
+			free(t);
+			return -1;
+		}
+		free(t);
+		twine_logf(LOG_DEBUG, "RDF models using the '%s' profile will use '%s' storage\n", twine_rdf_profiles_[c], context->rdf_storage[c]);
+	}
+	/* Graphs are only ever read by several threads at once if there's more
+	 * than one processor thread and compact storage is in use. In that
+	 * case, URI interning must be disabled, because it shares every URI
+	 * object with the same value (reference-counted without locking) across
+	 * the whole world; otherwise, interning saves an allocation for each
+	 * occurrence of a URI, and so is left enabled. The flag can only be
+	 * changed before the world is opened.
+	 */
+	context->rdf_concurrent = 0;
+	if(twine_config_get_int("*:processor-threads", DEFAULT_PROCESSOR_THREADS) > 1)
+	{
+		for(c = 0; c < TWINE_STORAGE_PROFILES; c++)
+		{
+			if(!strcmp(context->rdf_storage[c], TWINE_STORAGE_COMPACT))
+			{
+				context->rdf_concurrent = 1;
+				break;
+			}
+		}
+	}
+	if(context->rdf_concurrent &&
+	   (!context->raptor || raptor_world_set_flag(context->raptor, RAPTOR_WORLD_FLAG_URI_INTERNING, 0)))
+	{
+		twine_logf(LOG_WARNING, "URI interning could not be disabled because the RDF world has already been opened; processors will be run one at a time\n");
+		context->rdf_concurrent = 0;
+	}
+	librdf_world_open(context->world);
+	if(twine_storage_register_(context->world))
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/* Private: set the storage used by a profile from a backend name */
+static int
+twine_rdf_storage_profile_(TWINE *context, TWINESTORAGEPROFILE profile, const char *name)
+{
+	if(!strcmp(name, "compact"))
+	{
+		context->rdf_storage[profile] = TWINE_STORAGE_COMPACT;
+		context->rdf_storage_options[profile] = (profile == TWINE_STORAGE_SINGLE ? "contexts='no'" : "contexts='yes'");
+		return 0;
+	}
+	if(!strcmp(name, "hashes"))
+	{
+		/* The hashes storage will refuse statements with contexts if
+		 * contexts are disabled, so they're always enabled
+		 */
+		context->rdf_storage[profile] = "hashes";
+		context->rdf_storage_options[profile] = (profile == TWINE_STORAGE_INDEXED ? "hash-type='memory',contexts='yes',index-predicates='yes'" : "hash-type='memory',contexts='yes'");
+		return 0;
+	}
+	return -1;
+}
+
 int
 twine_rdf_cleanup_(TWINE *context)
 {
+	struct twine_rdf_pool_struct *pool;
+	size_t c;
+
 	if(context->world)
 	{
+		/* Discard any pooled parsers and serialisers which belong to this
+		 * world, in every thread, before it goes away
+		 */
+		pthread_mutex_lock(&twine_rdf_pool_lock_);
+		for(pool = twine_rdf_pools_; pool; pool = pool->next)
+		{
+			for(c = 0; c < TWINE_RDF_NODE_CACHE; c++)
+			{
+				if(pool->nodes[c].node && pool->nodes[c].world == context->world)
+				{
+					librdf_free_node(pool->nodes[c].node);
+					pool->nodes[c].node = NULL;
+				}
+			}
+			c = 0;
+			while(c < pool->nentries)
+			{
+				if(pool->entries[c].world != context->world)
+				{
+					c++;
+					continue;
+				}
+				twine_rdf_pool_free_entry_(&(pool->entries[c]));
+				pool->nentries--;
+				pool->entries[c] = pool->entries[pool->nentries];
+			}
+		}
+		pthread_mutex_unlock(&twine_rdf_pool_lock_);
 		librdf_free_world(context->world);
 		context->world = NULL;
+		/* The raptor world isn't freed along with the librdf world when it
+		 * was supplied by us
+		 */
+		if(context->raptor)
+		{
+			raptor_free_world(context->raptor);
+			context->raptor = NULL;
+		}
 	}
 	return 0;
 }
@@ -64,11 +318,22 @@ twine_rdf_world(void)
 /* Create a new model */
 librdf_model *
 twine_rdf_model_create(void)
+{
+	return twine_rdf_model_create_profile(TWINE_STORAGE_DEFAULT);
+}
+
+/* Create a new model using the storage configured for a profile */
+librdf_model *
+twine_rdf_model_create_profile(TWINESTORAGEPROFILE profile)
 {
 	librdf_model *model;
 	librdf_storage *storage;
-	
-	storage = librdf_new_storage(twine_->world, "hashes", NULL, "hash-type='memory',contexts='yes'");
+
+	if((int) profile < 0 || profile >= TWINE_STORAGE_PROFILES)
+	{
+		profile = TWINE_STORAGE_DEFAULT;
+	}
+	storage = librdf_new_storage(twine_->world, twine_->rdf_storage[profile], NULL, twine_->rdf_storage_options[profile]);
 	if(!storage)
 	{
 		twine_logf(LOG_CRIT, "failed to create new RDF storage\n");
@@ -84,30 +349,90 @@ twine_rdf_model_create(void)
 	return model;
 }
 
+/* Private: create an empty model using the same kind of storage as an
+ * existing one, so that statements can later be copied between compact
+ * storage instances directly; anything other than compact storage results
+ * in a model using the default profile
+ */
+librdf_model *
+twine_rdf_model_create_like_(librdf_model *model)
+{
+	librdf_model *dest;
+	librdf_storage *src, *storage;
+	const uint32_t *s, *p, *o, *g;
+	size_t nquads, live;
+	uint32_t nterms;
+
+	src = librdf_model_get_storage(model);
+	if(!src || !twine_storage_is_compact_(src))
+	{
+		return twine_rdf_model_create();
+	}
+	/* Contexts are only recorded if the existing storage records them */
+	twine_storage_columns_(src, &s, &p, &o, &g, &nquads, &live, &nterms);
+	storage = librdf_new_storage(twine_->world, TWINE_STORAGE_COMPACT, NULL, (g ? "contexts='yes'" : "contexts='no'"));
+	if(!storage)
+	{
+		twine_logf(LOG_CRIT, "failed to create new RDF storage\n");
+		return NULL;
+	}
+	dest = librdf_new_model(twine_->world, storage, NULL);
+	if(!dest)
+	{
+		twine_logf(LOG_CRIT, "failed to create new RDF model\n");
+		librdf_free_storage(storage);
+		return NULL;
+	}
+	return dest;
+}
+
+/* Create a copy of a model, including the contexts of its statements */
 librdf_model *
 twine_rdf_model_clone(librdf_model *model)
 {
 	librdf_model *dest;
-	char *nq;
-	size_t nqlen;
-	
+	librdf_stream *stream;
+	librdf_storage *src, *dst;
+
 	dest = twine_rdf_model_create();
 	if(!dest)
 	{
 		return NULL;
 	}
-	if(!(nq = twine_rdf_model_nquads(model, &nqlen)))
+	/* Between compact storage instances, copy the dictionary-encoded quads
+	 * without constructing any nodes
+	 */
+	src = librdf_model_get_storage(model);
+	dst = librdf_model_get_storage(dest);
+	if(src && dst && twine_storage_is_compact_(src) && twine_storage_is_compact_(dst))
+	{
+		if(twine_storage_copy_(dst, src))
+		{
+			twine_logf(LOG_ERR, "failed to copy statements to cloned model\n");
+			twine_rdf_model_destroy(dest);
+			return NULL;
+		}
+		return dest;
+	}
+	/* Copy statements directly rather than serialising and re-parsing */
+	stream = librdf_model_as_stream(model);
+	if(!stream)
 	{
+		twine_logf(LOG_ERR, "failed to obtain stream from model being cloned\n");
 		twine_rdf_model_destroy(dest);
 		return NULL;
 	}
-	if(twine_rdf_model_parse(dest, MIME_NQUADS, nq, nqlen))
+	for(; !librdf_stream_end(stream); librdf_stream_next(stream))
 	{
-		librdf_free_memory(nq);
-		twine_rdf_model_destroy(dest);
-		return NULL;
+		if(librdf_model_context_add_statement(dest, librdf_stream_get_context2(stream), librdf_stream_get_object(stream)))
+		{
+			twine_logf(LOG_ERR, "failed to add statement to cloned model\n");
+			librdf_free_stream(stream);
+			twine_rdf_model_destroy(dest);
+			return NULL;
+		}
 	}
-	librdf_free_memory(nq);
+	librdf_free_stream(stream);
 	return dest;
 }
 
@@ -129,6 +454,106 @@ twine_rdf_model_destroy(librdf_model *model)
 	return 0;
 }
 
+/* Obtain the number of statements in a model and (approximately) the
+ * memory it's using; either pointer may be NULL
+ *
+ * The figures are exact for compact storage and cheap to obtain; for other
+ * storage, the size is estimated from the lengths of the terms in each
+ * statement, which requires a pass over the model.
+ */
+int
+twine_rdf_model_usage(librdf_model *model, size_t *triples, size_t *bytes)
+{
+	librdf_storage *storage;
+	librdf_stream *stream;
+	size_t n, b;
+	int r;
+
+	storage = librdf_model_get_storage(model);
+	if(storage && twine_storage_is_compact_(storage))
+	{
+		return twine_storage_usage_(storage, triples, bytes);
+	}
+	r = librdf_model_size(model);
+	if(r >= 0 && !bytes)
+	{
+		if(triples)
+		{
+			*triples = (size_t) r;
+		}
+		return 0;
+	}
+	stream = librdf_model_as_stream(model);
+	if(!stream)
+	{
+		twine_logf(LOG_ERR, "failed to obtain stream from model to determine its size\n");
+		return -1;
+	}
+	n = 0;
+	b = 0;
+	for(; !librdf_stream_end(stream); librdf_stream_next(stream))
+	{
+		b += twine_rdf_st_usage_(librdf_stream_get_object(stream));
+		n++;
+	}
+	librdf_free_stream(stream);
+	if(triples)
+	{
+		*triples = n;
+	}
+	if(bytes)
+	{
+		*bytes = b;
+	}
+	return 0;
+}
+
+/* Private: estimate the memory used by a statement */
+size_t
+twine_rdf_st_usage_(librdf_statement *statement)
+{
+	return TWINE_RDF_ST_OVERHEAD +
+		twine_rdf_node_usage_(librdf_statement_get_subject(statement)) +
+		twine_rdf_node_usage_(librdf_statement_get_predicate(statement)) +
+		twine_rdf_node_usage_(librdf_statement_get_object(statement));
+}
+
+/* Private: estimate the memory used by a node */
+static size_t
+twine_rdf_node_usage_(librdf_node *node)
+{
+	librdf_uri *uri;
+	const char *str;
+	size_t len, n;
+
+	if(!node)
+	{
+		return 0;
+	}
+	n = TWINE_RDF_NODE_OVERHEAD;
+	if(librdf_node_is_resource(node))
+	{
+		librdf_uri_as_counted_string(librdf_node_get_uri(node), &len);
+		return n + len + 1;
+	}
+	if(librdf_node_is_blank(node))
+	{
+		return n + strlen((const char *) librdf_node_get_blank_identifier(node)) + 1;
+	}
+	librdf_node_get_literal_value_as_counted_string(node, &len);
+	n += len + 1;
+	if((uri = librdf_node_get_literal_value_datatype_uri(node)))
+	{
+		librdf_uri_as_counted_string(uri, &len);
+		n += len + 1;
+	}
+	if((str = librdf_node_get_literal_value_language(node)))
+	{
+		n += strlen(str) + 1;
+	}
+	return n;
+}
+
 /* Parse a buffer of a particular MIME type into a model */
 int
 twine_rdf_model_parse_base(librdf_model *model, const char *mime, const char *buf, size_t buflen, librdf_uri *base)
@@ -142,24 +567,46 @@ twine_rdf_model_parse_base(librdf_model *model, const char *mime, const char *bu
 int
 twine_rdf_model_parse_base_graph(librdf_model *model, const char *mime, const char *buf, size_t buflen, librdf_uri *base, librdf_node *graph)
 {
-	const char *name, *t;
-	librdf_parser *parser;	
-	int r, sl;
-	librdf_model *pmodel;
-	librdf_stream *stream;
-	librdf_node *ctx;
+	struct twine_rdf_model_parse_struct data;
 
-	if(graph)
-	{
-		/* If a graph has been specified, create a model just for parsing
-		 * the buffer into
-		 */
-		pmodel = twine_rdf_model_create();
-	}
-	else
+	/* Statements are added to the model as they are parsed, applying the
+	 * default graph to any which don't specify one, rather than being
+	 * parsed into an intermediate model and copied
+	 */
+	data.model = model;
+	data.graph = graph;
+	return twine_rdf_parse(mime, buf, buflen, base, twine_rdf_model_parse_statement_, &data);
+}
+
+/* Private: statement callback used by twine_rdf_model_parse_base_graph() */
+static int
+twine_rdf_model_parse_statement_(librdf_statement *statement, librdf_node *graph, void *userdata)
+{
+	struct twine_rdf_model_parse_struct *data;
+
+	data = (struct twine_rdf_model_parse_struct *) userdata;
+	if(librdf_model_context_add_statement(data->model, graph ? graph : data->graph, statement))
 	{
-		pmodel = NULL;
+		twine_logf(LOG_ERR, "failed to add parsed statement to model\n");
+		return -1;
 	}
+	return 0;
+}
+
+/* Parse a buffer of a particular MIME type, invoking a callback for each
+ * statement
+ *
+ * N-Triples and N-Quads are handled by Twine's own parser (unless disabled
+ * by setting rdf-native-ntriples=no), as is Twine's binary quad format;
+ * everything else by raptor.
+ */
+int
+twine_rdf_parse(const char *mime, const char *buf, size_t buflen, librdf_uri *base, TWINESTATEMENTFN fn, void *userdata)
+{
+	const char *name, *t;
+	raptor_parser *parser;
+	struct twine_rdf_parse_struct data;
+	int r, sl;
 
 	t = strchr(mime, ';');
 	if(t)
@@ -170,6 +617,15 @@ twine_rdf_model_parse_base_graph(librdf_model *model, const char *mime, const ch
 	{
 		sl = strlen(mime);
 	}
+	if(!nstrcasecmp(mime, TWINE_MIME_BINARY, sl))
+	{
+		r = twine_binary_parse_(buf, buflen, fn, userdata);
+		if(r)
+		{
+			twine_logf(LOG_DEBUG, "failed to parse buffer of %u bytes as binary quads\n", (unsigned int) buflen);
+		}
+		return r;
+	}
 	name = NULL;
 	/* Handle specific MIME types whether or not librdf already knows
 	 * about them
@@ -194,55 +650,64 @@ twine_rdf_model_parse_base_graph(librdf_model *model, const char *mime, const ch
 	{
 		name = "rdfxml";
 	}
-	/* If we have a specific parser name, don't use the MIME type */
-	if(name)
+	else
 	{
-		mime = NULL;
+		/* Ask raptor for a parser which can handle this MIME type */
+		name = raptor_world_guess_parser_name(librdf_world_get_raptor(twine_->world), NULL, mime, (const unsigned char *) buf, buflen, NULL);
 	}
-	parser = librdf_new_parser(twine_->world, name, mime, NULL);
-	if(!parser)
+	if(name && twine_->rdf_native_ntriples &&
+	   (!strcmp(name, "ntriples") || !strcmp(name, "nquads")))
 	{
-		if(!name)
+		r = twine_ntriples_parse_(buf, buflen, base, !strcmp(name, "nquads"), fn, userdata);
+		if(r)
 		{
-			name = "auto";
-		}
-		twine_logf(LOG_ERR, "failed to create a new parser for %s (%s)\n", mime, name);
-		if(pmodel)
-		{
-			twine_rdf_model_destroy(pmodel);
+			twine_logf(LOG_DEBUG, "failed to parse buffer of %u bytes as %s\n", (unsigned int) buflen, name);
 		}
+		return r;
+	}
+	parser = (name ? twine_rdf_parser_acquire_(name) : NULL);
+	if(!parser)
+	{
+		twine_logf(LOG_ERR, "failed to create a new parser for %s (%s)\n", mime, name ? name : "auto");
 		return -1;
 	}
-	r = librdf_parser_parse_counted_string_into_model(parser, (const unsigned char *) buf, buflen, base, pmodel ? pmodel : model);
-	if(r)
+	data.fn = fn;
+	data.data = userdata;
+	data.parser = parser;
+	data.failed = 0;
+	raptor_parser_set_statement_handler(parser, &data, twine_rdf_parse_statement_);
+	r = raptor_parser_parse_start(parser, base);
+	if(!r)
 	{
-		twine_logf(LOG_DEBUG, "failed to parse buffer of %u bytes as %s\n", (unsigned int) buflen, mime ? mime : name);
+		r = raptor_parser_parse_chunk(parser, (const unsigned char *) buf, buflen, 1);
 	}
-	else if(pmodel)
+	if(r || data.failed)
 	{
-		/* r = 0 and pmodel is not NULL; we have successfully parsed the
-		 * buffer into pmodel and must now add the statements to the
-		 * supplied model
-		 */
-		for(stream = librdf_model_as_stream(pmodel);
-			!librdf_stream_end(stream);
-			librdf_stream_next(stream))
-		{
-			ctx = librdf_stream_get_context2(stream);
-			if(!ctx)
-			{
-				ctx = graph;
-			}
-			librdf_model_context_add_statement(model, ctx, librdf_stream_get_object(stream));
-		}
-		librdf_free_stream(stream);
+		twine_logf(LOG_DEBUG, "failed to parse buffer of %u bytes as %s\n", (unsigned int) buflen, name);
+		r = -1;
+	}
+	raptor_parser_set_statement_handler(parser, NULL, NULL);
+	twine_rdf_parser_release_(parser);
+	return r;
+}
+
+/* Private: raptor statement handler used by twine_rdf_parse() */
+static void
+twine_rdf_parse_statement_(void *user_data, raptor_statement *statement)
+{
+	struct twine_rdf_parse_struct *data;
+
+	data = (struct twine_rdf_parse_struct *) user_data;
+	if(data->failed)
+	{
+		return;
 	}
-	if(pmodel)
+	/* librdf_statement and raptor_statement are the same type */
+	if(data->fn(statement, statement->graph, data->data))
 	{
-		twine_rdf_model_destroy(pmodel);
+		data->failed = 1;
+		raptor_parser_parse_abort(data->parser);
 	}
-	librdf_free_parser(parser);
-	return r;	
 }
 
 /* Parse a buffer of a particular MIME type into a model */
@@ -312,13 +777,81 @@ twine_rdf_model_add_st(librdf_model *model, librdf_statement *statement, librdf_
 int
 twine_rdf_model_add_stream(librdf_model *model, librdf_stream *stream, librdf_node *ctx)
 {
+	return twine_rdf_model_add_unique(model, stream, ctx);
+}
+
+/* Add a stream to a model, skipping statements which already exist in it
+ * (or in the context ctx, if specified) or which occur earlier in the stream
+ *
+ * The existing statements are hashed into a set once, so that each
+ * statement in the stream only needs to be looked up in the model itself
+ * if its hash matches one which has already been seen.
+ */
+int
+twine_rdf_model_add_unique(librdf_model *model, librdf_stream *stream, librdf_node *ctx)
+{
+	TWINESTSET *set;
+	librdf_stream *existing;
+	librdf_statement *st;
+	int size, r;
+
+	size = librdf_model_size(model);
+	set = twine_stset_create_(size > 0 ? (size_t) size : 0);
+	if(!set)
+	{
+		return -1;
+	}
+	if(ctx)
+	{
+		existing = librdf_model_context_as_stream(model, ctx);
+	}
+	else
+	{
+		existing = librdf_model_as_stream(model);
+	}
+	if(!existing)
+	{
+		twine_stset_destroy_(set);
+		return -1;
+	}
+	for(; !librdf_stream_end(existing); librdf_stream_next(existing))
+	{
+		if(twine_stset_add_(set, librdf_stream_get_object(existing)) < 0)
+		{
+			librdf_free_stream(existing);
+			twine_stset_destroy_(set);
+			return -1;
+		}
+	}
+	librdf_free_stream(existing);
 	for(; !librdf_stream_end(stream); librdf_stream_next(stream))
 	{
-		if(twine_rdf_model_add_st(model, librdf_stream_get_object(stream), ctx))
+		st = librdf_stream_get_object(stream);
+		r = twine_stset_add_(set, st);
+		if(r == 1)
 		{
+			/* Definitely not present */
+			if(ctx)
+			{
+				r = librdf_model_context_add_statement(model, ctx, st);
+			}
+			else
+			{
+				r = librdf_model_add_statement(model, st);
+			}
+		}
+		else if(!r)
+		{
+			/* Possibly present: check the model */
+			r = twine_rdf_model_add_st(model, st, ctx);
+		}
+		if(r)
+		{
+			twine_stset_destroy_(set);
 			return -1;
 		}
 	}
+	twine_stset_destroy_(set);
 	return 0;
 }
 
@@ -391,13 +924,16 @@ twine_rdf_node_clone(librdf_node *node)
 	return p;
 }
 
-/* Create a new URI node */
+/* Create a new URI node; the node may be shared with other callers, but
+ * should be freed with twine_rdf_node_destroy() or librdf_free_node() as
+ * normal
+ */
 librdf_node *
 twine_rdf_node_createuri(const char *uri)
 {
 	librdf_node *p;
 
-	p = librdf_new_node_from_uri_string(twine_->world, (const unsigned char *) uri);
+	p = twine_rdf_node_intern_(uri, strlen(uri));
 	if(!p)
 	{
 		twine_logf(LOG_ERR, "failed to create new node from <%s>\n", uri);
@@ -406,74 +942,125 @@ twine_rdf_node_createuri(const char *uri)
 	return p;
 }
 
-/* Destroy a node */
-int
-twine_rdf_node_destroy(librdf_node *node)
+/* Create a new URI; like twine_rdf_node_createuri(), the result may be
+ * shared, and should be freed with librdf_free_uri()
+ */
+librdf_uri *
+twine_rdf_uri_create(const char *uri)
 {
-	if(node)
+	librdf_node *node;
+	librdf_uri *p;
+
+	node = twine_rdf_node_intern_(uri, strlen(uri));
+	if(!node)
 	{
-		librdf_free_node(node);
+		twine_logf(LOG_ERR, "failed to create new URI from <%s>\n", uri);
+		return NULL;
 	}
-	return 0;
+	p = librdf_new_uri_from_uri(librdf_node_get_uri(node));
+	librdf_free_node(node);
+	return p;
 }
 
-/* Check if a node's datatype URI is an integer */
-int
-twine_rdf_node_isint(librdf_node *node)
+/* Private: obtain a reference to a URI node from the calling thread's
+ * cache, creating it (and replacing whichever node previously occupied its
+ * slot) if it isn't already present.
+ *
+ * librdf nodes are reference-counted, so the cache retains one reference
+ * and each caller receives another; the cache is per-thread because the
+ * reference counts are not updated atomically.
+ */
+librdf_node *
+twine_rdf_node_intern_(const char *uri, size_t len)
 {
-	librdf_uri *uri;
-	const char *dtstr;
+	struct twine_rdf_pool_struct *pool;
+	struct twine_rdf_cached_node_struct *slot;
+	unsigned long hash;
+	const char *str;
+	size_t l;
 
-	uri = librdf_node_get_literal_value_datatype_uri(node);
-	if(!uri)
+	pool = twine_rdf_pool_();
+	if(!pool)
 	{
-		return 0;
+		return librdf_new_node_from_counted_uri_string(twine_->world, (const unsigned char *) uri, len);
 	}
-	dtstr = (const char *) librdf_uri_as_string(uri);
-	if(strcmp(dtstr, "http://www.w3.org/2001/XMLSchema#integer") &&
-	   strcmp(dtstr, "http://www.w3.org/2001/XMLSchema#long") &&
-	   strcmp(dtstr, "http://www.w3.org/2001/XMLSchema#short") &&
-	   strcmp(dtstr, "http://www.w3.org/2001/XMLSchema#byte") &&
-	   strcmp(dtstr, "http://www.w3.org/2001/XMLSchema#int") &&
-	   strcmp(dtstr, "http://www.w3.org/2001/XMLSchema#nonPositiveInteger") &&
-	   strcmp(dtstr, "http://www.w3.org/2001/XMLSchema#nonNegativeInteger") &&
-	   strcmp(dtstr, "http://www.w3.org/2001/XMLSchema#negativeInteger") &&
-	   strcmp(dtstr, "http://www.w3.org/2001/XMLSchema#positiveInteger") &&
-	   strcmp(dtstr, "http://www.w3.org/2001/XMLSchema#unsignedLong") &&
-	   strcmp(dtstr, "http://www.w3.org/2001/XMLSchema#unsignedInt") &&
-	   strcmp(dtstr, "http://www.w3.org/2001/XMLSchema#unsignedShort") &&
-	   strcmp(dtstr, "http://www.w3.org/2001/XMLSchema#unsignedByte"))
+	hash = twine_rdf_hash_(uri, len, 0);
+	slot = &(pool->nodes[hash & (TWINE_RDF_NODE_CACHE - 1)]);
+	if(slot->node && slot->hash == hash && slot->world == twine_->world)
 	{
-		return 0;
+		str = (const char *) librdf_uri_as_counted_string(librdf_node_get_uri(slot->node), &l);
+		if(l == len && !memcmp(str, uri, len))
+		{
+			return librdf_new_node_from_node(slot->node);
+		}
+	}
+	if(slot->node)
+	{
+		librdf_free_node(slot->node);
+		slot->node = NULL;
 	}
-	return 1;
+	slot->node = librdf_new_node_from_counted_uri_string(twine_->world, (const unsigned char *) uri, len);
+	if(!slot->node)
+	{
+		return NULL;
+	}
+	slot->hash = hash;
+	slot->world = twine_->world;
+	return librdf_new_node_from_node(slot->node);
 }
 
-/* Get the integer value of a node */
+/* Private: look up the classification of a literal datatype URI in the
+ * current thread's cache, returning -1 if it isn't present
+ */
 int
-twine_rdf_node_intval(librdf_node *node, long *value)
+twine_rdf_datatype_get_(const char *uri, size_t len)
 {
-	const char *str;
-	char *endp;
+	struct twine_rdf_pool_struct *pool;
+	struct twine_rdf_cached_datatype_struct *slot;
+	unsigned long hash;
 
-	if(!librdf_node_is_literal(node))
+	if(len > TWINE_RDF_DATATYPE_MAX || !(pool = twine_rdf_pool_()))
 	{
-		return 0;
+		return -1;
 	}
-	if(!twine_rdf_node_isint(node))
+	hash = twine_rdf_hash_(uri, len, 0);
+	slot = &(pool->datatypes[hash & (TWINE_RDF_DATATYPE_CACHE - 1)]);
+	if(slot->len == len && slot->hash == hash && !memcmp(slot->uri, uri, len))
 	{
-		return 0;
+		return (int) slot->type;
 	}
-	str = (const char *) librdf_node_get_literal_value(node);
-	if(!str || !*str)
+	return -1;
+}
+
+/* Private: cache the classification of a literal datatype URI, replacing
+ * whichever one previously occupied its slot
+ */
+void
+twine_rdf_datatype_set_(const char *uri, size_t len, TWINEDATATYPE type)
+{
+	struct twine_rdf_pool_struct *pool;
+	struct twine_rdf_cached_datatype_struct *slot;
+	unsigned long hash;
+
+	if(!len || len > TWINE_RDF_DATATYPE_MAX || !(pool = twine_rdf_pool_()))
 	{
-		return 0;
+		return;
 	}
-	endp = NULL;
-	*value = strtol(str, &endp, 10);
-	if(!endp || !*endp)
+	hash = twine_rdf_hash_(uri, len, 0);
+	slot = &(pool->datatypes[hash & (TWINE_RDF_DATATYPE_CACHE - 1)]);
+	slot->hash = hash;
+	slot->len = len;
+	memcpy(slot->uri, uri, len);
+	slot->type = type;
+}
+
+/* Destroy a node */
+int
+twine_rdf_node_destroy(librdf_node *node)
+{
+	if(node)
 	{
-		return 1;
+		librdf_free_node(node);
 	}
 	return 0;
 }
@@ -518,25 +1105,21 @@ char *
 twine_rdf_model_ntriples(librdf_model *model, size_t *buflen)
 {
 	char *buf;
-	librdf_world *world;
 	librdf_serializer *serializer;
 
 	*buflen = 0;
-	world = twine_rdf_world();
-	serializer = librdf_new_serializer(world, "ntriples", NULL, NULL);
+	serializer = twine_rdf_serializer_acquire_("ntriples");
 	if(!serializer)
 	{
-		twine_logf(LOG_ERR, "failed to create ntriples serializer\n");
 		return NULL;
 	}
 	buf = (char *) librdf_serializer_serialize_model_to_counted_string(serializer, NULL, model, buflen);
+	twine_rdf_serializer_release_(serializer);
 	if(!buf)
 	{
-		librdf_free_serializer(serializer);
 		twine_logf(LOG_ERR, "failed to serialise model to buffer\n");
 		return NULL;
 	}
-	librdf_free_serializer(serializer);
 	return buf;
 }
 
@@ -545,9 +1128,24 @@ twine_rdf_model_ntriples(librdf_model *model, size_t *buflen)
  */
 char *
 twine_rdf_model_nquads(librdf_model *model, size_t *buflen)
-{   
+{
+	char *buf;
+	librdf_serializer *serializer;
+
 	*buflen = 0;
-	return (char *) librdf_model_to_counted_string(model, NULL, "nquads", NULL, NULL, buflen);
+	serializer = twine_rdf_serializer_acquire_("nquads");
+	if(!serializer)
+	{
+		return NULL;
+	}
+	buf = (char *) librdf_serializer_serialize_model_to_counted_string(serializer, NULL, model, buflen);
+	twine_rdf_serializer_release_(serializer);
+	if(!buf)
+	{
+		twine_logf(LOG_ERR, "failed to serialise model to buffer\n");
+		return NULL;
+	}
+	return buf;
 }
 
 /* Serialise a stream to a string - the result should be freed by
@@ -557,28 +1155,44 @@ char *
 twine_rdf_stream_ntriples(librdf_stream *stream, size_t *buflen)
 {
 	char *buf;
-	librdf_world *world;
 	librdf_serializer *serializer;
 
 	*buflen = 0;
-	world = twine_rdf_world();
-	serializer = librdf_new_serializer(world, "ntriples", NULL, NULL);
+	serializer = twine_rdf_serializer_acquire_("ntriples");
 	if(!serializer)
 	{
-		twine_logf(LOG_ERR, "failed to create ntriples serializer\n");
 		return NULL;
 	}
 	buf = (char *) librdf_serializer_serialize_stream_to_counted_string(serializer, NULL, stream, buflen);
+	twine_rdf_serializer_release_(serializer);
 	if(!buf)
 	{
-		librdf_free_serializer(serializer);
 		twine_logf(LOG_ERR, "failed to serialise stream to buffer\n");
 		return NULL;
 	}
-	librdf_free_serializer(serializer);
 	return buf;
 }
 
+/* Private: hash a counted string (FNV-1a), optionally continuing from a
+ * previous hash value; pass zero to start a new hash
+ */
+unsigned long
+twine_rdf_hash_(const char *str, size_t len, unsigned long hash)
+{
+	size_t c;
+
+	if(!hash)
+	{
+		hash = 2166136261UL;
+	}
+	for(c = 0; c < len; c++)
+	{
+		hash ^= (unsigned char) str[c];
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
 static int
 nstrcasecmp(const char *a, const char *b, size_t alen)
 {
@@ -588,3 +1202,238 @@ nstrcasecmp(const char *a, const char *b, size_t alen)
 	}
 	return strncasecmp(a, b, alen);
 }
+
+/* Private: obtain a raptor parser by name, re-using an idle one belonging to
+ * this thread if available; it must be returned via
+ * twine_rdf_parser_release_()
+ */
+static raptor_parser *
+twine_rdf_parser_acquire_(const char *name)
+{
+	raptor_parser *parser;
+
+	if((parser = (raptor_parser *) twine_rdf_pool_acquire_(POOL_PARSER, name)))
+	{
+		return parser;
+	}
+	parser = raptor_new_parser(librdf_world_get_raptor(twine_->world), name);
+	if(parser)
+	{
+		twine_rdf_pool_add_(POOL_PARSER, name, parser);
+	}
+	return parser;
+}
+
+/* Private: return a parser obtained via twine_rdf_parser_acquire_() */
+static void
+twine_rdf_parser_release_(raptor_parser *parser)
+{
+	if(twine_rdf_pool_release_(parser))
+	{
+		raptor_free_parser(parser);
+	}
+}
+
+/* Private: obtain a serialiser by name, re-using an idle one belonging to
+ * this thread if available; it must be returned via
+ * twine_rdf_serializer_release_()
+ */
+static librdf_serializer *
+twine_rdf_serializer_acquire_(const char *name)
+{
+	librdf_serializer *serializer;
+
+	if((serializer = (librdf_serializer *) twine_rdf_pool_acquire_(POOL_SERIALIZER, name)))
+	{
+		return serializer;
+	}
+	serializer = librdf_new_serializer(twine_->world, name, NULL, NULL);
+	if(!serializer)
+	{
+		twine_logf(LOG_ERR, "failed to create %s serializer\n", name);
+		return NULL;
+	}
+	twine_rdf_pool_add_(POOL_SERIALIZER, name, serializer);
+	return serializer;
+}
+
+/* Private: return a serialiser obtained via twine_rdf_serializer_acquire_() */
+static void
+twine_rdf_serializer_release_(librdf_serializer *serializer)
+{
+	if(twine_rdf_pool_release_(serializer))
+	{
+		librdf_free_serializer(serializer);
+	}
+}
+
+/* Private: obtain the calling thread's pool, creating it if needed */
+static struct twine_rdf_pool_struct *
+twine_rdf_pool_(void)
+{
+	struct twine_rdf_pool_struct *pool;
+
+	pthread_once(&twine_rdf_pool_once_, twine_rdf_pool_init_);
+	pool = (struct twine_rdf_pool_struct *) pthread_getspecific(twine_rdf_pool_key_);
+	if(pool)
+	{
+		return pool;
+	}
+	pool = (struct twine_rdf_pool_struct *) calloc(1, sizeof(struct twine_rdf_pool_struct));
+	if(!pool)
+	{
+		return NULL;
+	}
+	pthread_mutex_lock(&twine_rdf_pool_lock_);
+	pool->next = twine_rdf_pools_;
+	if(twine_rdf_pools_)
+	{
+		twine_rdf_pools_->prev = pool;
+	}
+	twine_rdf_pools_ = pool;
+	pthread_mutex_unlock(&twine_rdf_pool_lock_);
+	pthread_setspecific(twine_rdf_pool_key_, pool);
+	return pool;
+}
+
+/* Private: find an idle pooled instance of the given kind and key belonging
+ * to the current world, marking it as in use.
+ *
+ * Because an instance is marked busy until it is released, re-entrant use
+ * (for example, a parse triggered from within a parse) will always be given
+ * a distinct instance.
+ */
+static void *
+twine_rdf_pool_acquire_(twine_rdf_pool_kind kind, const char *key)
+{
+	struct twine_rdf_pool_struct *pool;
+	size_t c;
+
+	if(!(pool = twine_rdf_pool_()))
+	{
+		return NULL;
+	}
+	for(c = 0; c < pool->nentries; c++)
+	{
+		if(!pool->entries[c].busy && pool->entries[c].kind == kind &&
+		   pool->entries[c].world == twine_->world &&
+		   !strcmp(pool->entries[c].key, key))
+		{
+			pool->entries[c].busy = 1;
+			return pool->entries[c].obj;
+		}
+	}
+	return NULL;
+}
+
+/* Private: add a newly-created, in-use, instance to the current thread's
+ * pool if there is room for it
+ */
+static int
+twine_rdf_pool_add_(twine_rdf_pool_kind kind, const char *key, void *obj)
+{
+	struct twine_rdf_pool_struct *pool;
+	struct twine_rdf_pooled_struct *entry;
+
+	if(!(pool = twine_rdf_pool_()) || pool->nentries >= TWINE_RDF_POOL_MAX)
+	{
+		return -1;
+	}
+	entry = &(pool->entries[pool->nentries]);
+	entry->key = strdup(key);
+	if(!entry->key)
+	{
+		return -1;
+	}
+	entry->kind = kind;
+	entry->world = twine_->world;
+	entry->obj = obj;
+	entry->busy = 1;
+	pool->nentries++;
+	return 0;
+}
+
+/* Private: mark a pooled instance as idle; returns -1 if the instance is not
+ * pooled, in which case the caller should free it
+ */
+static int
+twine_rdf_pool_release_(void *obj)
+{
+	struct twine_rdf_pool_struct *pool;
+	size_t c;
+
+	pool = (struct twine_rdf_pool_struct *) pthread_getspecific(twine_rdf_pool_key_);
+	if(!pool)
+	{
+		return -1;
+	}
+	for(c = 0; c < pool->nentries; c++)
+	{
+		if(pool->entries[c].obj == obj)
+		{
+			pool->entries[c].busy = 0;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* Private: free a pooled instance */
+static void
+twine_rdf_pool_free_entry_(struct twine_rdf_pooled_struct *entry)
+{
+	switch(entry->kind)
+	{
+	case POOL_PARSER:
+		raptor_free_parser((raptor_parser *) entry->obj);
+		break;
+	case POOL_SERIALIZER:
+		librdf_free_serializer((librdf_serializer *) entry->obj);
+		break;
+	}
+	free(entry->key);
+	entry->key = NULL;
+	entry->obj = NULL;
+}
+
+static void
+twine_rdf_pool_init_(void)
+{
+	pthread_key_create(&twine_rdf_pool_key_, twine_rdf_pool_destroy_);
+}
+
+/* Private: discard a thread's pool when the thread exits */
+static void
+twine_rdf_pool_destroy_(void *ptr)
+{
+	struct twine_rdf_pool_struct *pool;
+	size_t c;
+
+	pool = (struct twine_rdf_pool_struct *) ptr;
+	pthread_mutex_lock(&twine_rdf_pool_lock_);
+	if(pool->prev)
+	{
+		pool->prev->next = pool->next;
+	}
+	else
+	{
+		twine_rdf_pools_ = pool->next;
+	}
+	if(pool->next)
+	{
+		pool->next->prev = pool->prev;
+	}
+	for(c = 0; c < pool->nentries; c++)
+	{
+		twine_rdf_pool_free_entry_(&(pool->entries[c]));
+	}
+	for(c = 0; c < TWINE_RDF_NODE_CACHE; c++)
+	{
+		if(pool->nodes[c].node)
+		{
+			librdf_free_node(pool->nodes[c].node);
+		}
+	}
+	pthread_mutex_unlock(&twine_rdf_pool_lock_);
+	free(pool);
+}
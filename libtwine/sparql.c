@@ -23,6 +23,13 @@
 
 #include "p_libtwine.h"
 
+static int twine_sparql_put_chunk_(TWINE *context, SPARQL *conn, twine_graph *graph, librdf_model *chunk, int replace);
+static int twine_sparql_put_model_(TWINE *context, SPARQL *conn, twine_graph *graph, librdf_model *model, size_t *nchunks);
+static int twine_sparql_fits_(TWINE *context, librdf_model *model);
+static int twine_sparql_has_blank_(librdf_model *model);
+static int twine_sparql_rollback_(TWINE *context, SPARQL *conn, twine_graph *graph);
+static size_t twine_sparql_node_size_(librdf_node *node);
+
 /* Internal API: set configuration for SPARQL connections
  *
  * Note that this will have no effect on SPARQL connection objects which
@@ -104,6 +111,25 @@ twine_sparql_create(void)
 int
 twine_sparql_init_(TWINE *context)
 {
+	char *t;
+	int r;
+
+	/* The serialisation used for the bodies of SPARQL PUT requests */
+	t = twine_config_geta("*:sparql-put-format", "ntriples");
+	r = twine_sparql_format_(t);
+	if(r < 0)
+	{
+		twine_logf(LOG_CRIT, "unsupported sparql-put-format '%s'\n", t);
+		free(t);
+		return -1;
+	}
+	free(t);
+	context->sparql_put_format = (twine_format) r;
+	/* Size thresholds above which graphs will be written in chunks */
+	r = twine_config_get_int("*:sparql-put-max-triples", 0);
+	context->sparql_put_max_triples = (r > 0 ? (size_t) r : 0);
+	r = twine_config_get_int("*:sparql-put-max-bytes", 0);
+	context->sparql_put_max_bytes = (r > 0 ? (size_t) r : 0);
 	if(context->sparql_uri ||
 	   (context->sparql_query_uri && context->sparql_update_uri && context->sparql_data_uri))
 	{
@@ -147,3 +173,335 @@ twine_sparql_init_(TWINE *context)
 	context->sparql_data_uri = twine_config_geta("*:sparql-data", NULL);	
 	return 0;
 }
+
+/* Private: map a serialisation name or MIME type to a twine_format, returning
+ * -1 if it isn't one which can be used for SPARQL requests
+ */
+int
+twine_sparql_format_(const char *name)
+{
+	if(!name || !strcasecmp(name, "ntriples") || !strcasecmp(name, MIME_NTRIPLES))
+	{
+		return TWINE_FORMAT_NTRIPLES;
+	}
+	if(!strcasecmp(name, "turtle") || !strcasecmp(name, MIME_TURTLE))
+	{
+		return TWINE_FORMAT_TURTLE;
+	}
+	return -1;
+}
+
+/* Private: write a graph to the store, replacing any existing version of it
+ *
+ * Graphs which exceed the configured sparql-put-max-triples or
+ * sparql-put-max-bytes thresholds are written as an initial PUT of the first
+ * chunk of statements, followed by a series of INSERT DATA requests each
+ * bounded by the same limits, so that neither the size of a request nor
+ * the serialisation buffer grows with the size of the graph. Blank nodes
+ * are scoped to a single request, so graphs containing them are always
+ * written in one request, because chunking them would split the statements
+ * about a blank node between different ones.
+ *
+ * If any chunk after the first fails, the graph is rolled back: if the
+ * previous version was fetched (by sparql-get), it is written back into the
+ * store in the same way (in chunks, if it exceeds the thresholds);
+ * otherwise the graph is cleared, so that a partially-written graph is
+ * never left behind.
+ */
+int
+twine_sparql_put_graph_(TWINE *context, SPARQL *conn, twine_graph *graph)
+{
+	size_t nchunks;
+
+	if(twine_sparql_fits_(context, graph->store))
+	{
+		/* The graph is small enough to be written in one request */
+		return twine_sparql_put_chunk_(context, conn, graph, graph->store, 1);
+	}
+	if(twine_sparql_has_blank_(graph->store))
+	{
+		cluster_job_logf(graph->job, LOG_WARNING, "<%s> contains blank nodes and so can't be written in chunks; writing it in a single request\n", graph->uri);
+		return twine_sparql_put_chunk_(context, conn, graph, graph->store, 1);
+	}
+	if(twine_sparql_put_model_(context, conn, graph, graph->store, &nchunks))
+	{
+		if(nchunks)
+		{
+			twine_sparql_rollback_(context, conn, graph);
+		}
+		return -1;
+	}
+	if(nchunks > 1)
+	{
+		twine_logf(LOG_DEBUG, "wrote <%s> to the store in %lu chunks\n", graph->uri, (unsigned long) nchunks);
+	}
+	return 0;
+}
+
+/* Private: write the statements of a model to a graph in the store as a
+ * series of chunks, the first replacing the graph and the rest appended to
+ * it; the number of chunks successfully written is stored in nchunks
+ */
+static int
+twine_sparql_put_model_(TWINE *context, SPARQL *conn, twine_graph *graph, librdf_model *model, size_t *nchunks)
+{
+	librdf_stream *stream;
+	librdf_statement *st;
+	librdf_model *chunk;
+	size_t ntriples, nbytes;
+	int r;
+
+	*nchunks = 0;
+	stream = librdf_model_as_stream(model);
+	if(!stream)
+	{
+		cluster_job_logf(graph->job, LOG_ERR, "failed to obtain statement stream for <%s>\n", graph->uri);
+		return -1;
+	}
+	chunk = NULL;
+	ntriples = 0;
+	nbytes = 0;
+	r = 0;
+	for(; !librdf_stream_end(stream); librdf_stream_next(stream))
+	{
+		st = librdf_stream_get_object(stream);
+		if(!chunk)
+		{
+			chunk = twine_rdf_model_create_profile(TWINE_STORAGE_SINGLE);
+			if(!chunk)
+			{
+				r = -1;
+				break;
+			}
+		}
+		if(librdf_model_add_statement(chunk, st))
+		{
+			r = -1;
+			break;
+		}
+		ntriples++;
+		/* Approximate the serialised size of the statement */
+		nbytes += twine_sparql_node_size_(librdf_statement_get_subject(st)) +
+			twine_sparql_node_size_(librdf_statement_get_predicate(st)) +
+			twine_sparql_node_size_(librdf_statement_get_object(st)) + 4;
+		if((context->sparql_put_max_triples && ntriples >= context->sparql_put_max_triples) ||
+		   (context->sparql_put_max_bytes && nbytes >= context->sparql_put_max_bytes))
+		{
+			r = twine_sparql_put_chunk_(context, conn, graph, chunk, !*nchunks);
+			librdf_free_model(chunk);
+			chunk = NULL;
+			if(r)
+			{
+				break;
+			}
+			(*nchunks)++;
+			ntriples = 0;
+			nbytes = 0;
+		}
+	}
+	librdf_free_stream(stream);
+	if(!r && (chunk || !*nchunks))
+	{
+		/* Write the final partial chunk, or an empty graph */
+		r = twine_sparql_put_chunk_(context, conn, graph, chunk ? chunk : model, !*nchunks);
+		if(!r)
+		{
+			(*nchunks)++;
+		}
+	}
+	if(chunk)
+	{
+		librdf_free_model(chunk);
+	}
+	return (r ? -1 : 0);
+}
+
+/* Private: determine whether a model can be written in a single request
+ * without exceeding sparql-put-max-triples or sparql-put-max-bytes
+ *
+ * The size is estimated in the same way as for chunks, and the estimate
+ * stops as soon as the limit is reached, so that small graphs aren't
+ * copied into chunks and large ones aren't measured in full.
+ */
+static int
+twine_sparql_fits_(TWINE *context, librdf_model *model)
+{
+	librdf_stream *stream;
+	librdf_statement *st;
+	size_t nbytes;
+	int size;
+
+	if(!context->sparql_put_max_triples && !context->sparql_put_max_bytes)
+	{
+		return 1;
+	}
+	size = librdf_model_size(model);
+	if(size >= 0 && context->sparql_put_max_triples &&
+	   (size_t) size > context->sparql_put_max_triples)
+	{
+		return 0;
+	}
+	if(!context->sparql_put_max_bytes)
+	{
+		return (size >= 0);
+	}
+	stream = librdf_model_as_stream(model);
+	if(!stream)
+	{
+		/* Fall back to writing the model in chunks */
+		return 0;
+	}
+	nbytes = 0;
+	for(; !librdf_stream_end(stream) && nbytes < context->sparql_put_max_bytes; librdf_stream_next(stream))
+	{
+		st = librdf_stream_get_object(stream);
+		nbytes += twine_sparql_node_size_(librdf_statement_get_subject(st)) +
+			twine_sparql_node_size_(librdf_statement_get_predicate(st)) +
+			twine_sparql_node_size_(librdf_statement_get_object(st)) + 4;
+	}
+	librdf_free_stream(stream);
+	return (nbytes < context->sparql_put_max_bytes);
+}
+
+/* Private: determine whether any statement in a model has a blank node as
+ * its subject or object; errors are treated as blank nodes being present,
+ * so that the model is written in one request
+ */
+static int
+twine_sparql_has_blank_(librdf_model *model)
+{
+	librdf_stream *stream;
+	librdf_statement *st;
+	int r;
+
+	stream = librdf_model_as_stream(model);
+	if(!stream)
+	{
+		return 1;
+	}
+	r = 0;
+	for(; !librdf_stream_end(stream); librdf_stream_next(stream))
+	{
+		st = librdf_stream_get_object(stream);
+		if(librdf_node_is_blank(librdf_statement_get_subject(st)) ||
+		   librdf_node_is_blank(librdf_statement_get_object(st)))
+		{
+			r = 1;
+			break;
+		}
+	}
+	librdf_free_stream(stream);
+	return r;
+}
+
+/* Private: write a single chunk of a graph to the store, either replacing
+ * the graph entirely (via PUT) or appending to it (via INSERT DATA)
+ */
+static int
+twine_sparql_put_chunk_(TWINE *context, SPARQL *conn, twine_graph *graph, librdf_model *chunk, int replace)
+{
+	char *tbuf;
+	size_t l;
+	int r;
+
+	/* Appended chunks are always sent as N-Triples, which is valid within
+	 * an INSERT DATA block without needing a separate prologue
+	 */
+	if(replace && context->sparql_put_format == TWINE_FORMAT_TURTLE)
+	{
+		tbuf = twine_rdf_model_turtle(chunk, &l);
+	}
+	else
+	{
+		tbuf = twine_rdf_model_ntriples(chunk, &l);
+	}
+	if(!tbuf)
+	{
+		cluster_job_logf(graph->job, LOG_ERR, "failed to serialise <%s> for SPARQL PUT\n", graph->uri);
+		return -1;
+	}
+	if(!replace)
+	{
+		r = sparql_insert(conn, tbuf, l, graph->uri);
+	}
+	else if(context->sparql_put_format == TWINE_FORMAT_TURTLE)
+	{
+		r = sparql_put_format(conn, graph->uri, tbuf, l, MIME_TURTLE);
+	}
+	else
+	{
+		r = sparql_put(conn, graph->uri, tbuf, l);
+	}
+	librdf_free_memory(tbuf);
+	if(r)
+	{
+		cluster_job_logf(graph->job, LOG_ERR, "failed to perform SPARQL %s for <%s>\n", (replace ? "PUT" : "INSERT"), graph->uri);
+		return -1;
+	}
+	return 0;
+}
+
+/* Private: restore a graph following a failed chunked write */
+static int
+twine_sparql_rollback_(TWINE *context, SPARQL *conn, twine_graph *graph)
+{
+	size_t nchunks;
+	int r;
+
+	if(graph->old)
+	{
+		/* The previous version is written in chunks too, if it's large */
+		cluster_job_logf(graph->job, LOG_WARNING, "restoring previous version of <%s> following failed write\n", graph->uri);
+		if(twine_sparql_fits_(context, graph->old) || twine_sparql_has_blank_(graph->old))
+		{
+			r = twine_sparql_put_chunk_(context, conn, graph, graph->old, 1);
+		}
+		else
+		{
+			r = twine_sparql_put_model_(context, conn, graph, graph->old, &nchunks);
+		}
+	}
+	else
+	{
+		cluster_job_logf(graph->job, LOG_WARNING, "clearing <%s> following failed write\n", graph->uri);
+		r = sparql_updatef(conn, "CLEAR SILENT GRAPH <%s>", graph->uri);
+	}
+	if(r)
+	{
+		cluster_job_logf(graph->job, LOG_ERR, "failed to roll back <%s>; the graph may be incomplete\n", graph->uri);
+		return -1;
+	}
+	return 0;
+}
+
+/* Private: estimate the serialised size of a node */
+static size_t
+twine_sparql_node_size_(librdf_node *node)
+{
+	librdf_uri *uri;
+	size_t len, l;
+
+	len = 0;
+	if(librdf_node_is_resource(node))
+	{
+		librdf_uri_as_counted_string(librdf_node_get_uri(node), &len);
+		return len + 2;
+	}
+	if(librdf_node_is_blank(node))
+	{
+		return strlen((const char *) librdf_node_get_blank_identifier(node)) + 2;
+	}
+	librdf_node_get_literal_value_as_counted_string(node, &len);
+	/* Allow for escaping of a proportion of the literal */
+	len += (len / 8) + 2;
+	if((uri = librdf_node_get_literal_value_datatype_uri(node)))
+	{
+		librdf_uri_as_counted_string(uri, &l);
+		len += l + 4;
+	}
+	else if(librdf_node_get_literal_value_language(node))
+	{
+		len += strlen(librdf_node_get_literal_value_language(node)) + 1;
+	}
+	return len;
+}
@@ -0,0 +1,1600 @@
+/* Twine: Compact in-memory quad storage
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdint.h>
+
+#include "p_libtwine.h"
+
+/* The 'twine-compact' storage module is an alternative to librdf's 'hashes'
+ * storage for in-memory models.
+ *
+ * Each distinct term is stored once, in a dictionary which maps it to a
+ * 32-bit identifier, and quads are stored as parallel arrays of those
+ * identifiers (the context column is only allocated if contexts are
+ * enabled). A hash set over the quads provides duplicate suppression and
+ * exact lookups, and indices of quads by subject and by context are built
+ * on demand when a query with a bound subject or context is made; all other
+ * queries are linear scans over the identifier arrays, which are cheap
+ * compared with constructing nodes.
+ *
+ * Nodes and statements returned from streams and iterators are created on
+ * demand from the dictionary and are owned by the stream or iterator.
+ *
+ * Once its indices have been built (see twine_storage_prepare_()), an
+ * instance which isn't being modified can be read by several threads at
+ * once. Streams and iterators hold a reference to the storage while they
+ * exist, and because librdf doesn't update reference counts atomically,
+ * those updates are serialised by a lock shared by all instances (which,
+ * unlike a lock belonging to an instance, can't be freed along with it).
+ *
+ * Removing a statement leaves a hole in the quad arrays, which is not
+ * reclaimed until the storage is reset via the TWINE_STORAGE_FEATURE_RESET
+ * feature; this storage is intended for the write-mostly models Twine
+ * processes.
+ */
+
+/* Term identifier used to mean "no term" (for an absent context, or as a
+ * wildcard in a query)
+ */
+#define COMPACT_NONE                    0
+
+#define COMPACT_BLOCK_SIZE              65536
+#define COMPACT_MIN_TERMS               64
+#define COMPACT_MIN_QUADS               64
+
+typedef enum
+{
+	TERM_URI = 1,
+	TERM_BLANK,
+	TERM_LITERAL
+} compact_term_type;
+
+struct compact_term_struct
+{
+	unsigned long hash;
+	const char *str;
+	const char *lang;
+	size_t len;
+	uint32_t datatype;
+	compact_term_type type;
+};
+
+/* Block of term string storage */
+struct compact_block_struct
+{
+	struct compact_block_struct *next;
+	size_t used;
+	size_t size;
+	char data[1];
+};
+
+/* Quad indices ordered by the term in one column, and the offset of each
+ * term's first entry within that list; rebuilt when needed after quads have
+ * been added
+ */
+struct compact_index_struct
+{
+	size_t *index;
+	size_t *start;
+	int valid;
+};
+
+struct compact_struct
+{
+	librdf_storage *storage;
+	librdf_world *world;
+	int contexts;
+	/* Term dictionary; terms[0] is unused */
+	struct compact_term_struct *terms;
+	uint32_t nterms;
+	uint32_t termsize;
+	uint32_t *dict;
+	size_t dictsize;
+	struct compact_block_struct *blocks;
+	/* Quads, stored column-wise; a subject of COMPACT_NONE marks a quad
+	 * which has been removed
+	 */
+	uint32_t *s, *p, *o, *g;
+	size_t nquads;
+	size_t quadsize;
+	size_t live;
+	/* Open-addressed set of quad indices (plus one) */
+	size_t *qset;
+	size_t qsetsize;
+	/* Indices of quads by subject and by context */
+	struct compact_index_struct sindex;
+	struct compact_index_struct gindex;
+};
+
+struct compact_stream_struct
+{
+	struct compact_struct *cs;
+	/* The pattern being matched, COMPACT_NONE matching any term */
+	uint32_t s, p, o, g;
+	/* Quad indices to visit, if not scanning all quads */
+	size_t *index;
+	size_t pos;
+	size_t end;
+	librdf_statement *statement;
+	librdf_node *context;
+};
+
+struct compact_iterator_struct
+{
+	struct compact_struct *cs;
+	uint32_t *ids;
+	size_t nids;
+	size_t pos;
+	librdf_node *node;
+};
+
+static pthread_mutex_t compact_ref_lock_ = PTHREAD_MUTEX_INITIALIZER;
+
+static void twine_storage_factory_(librdf_storage_factory *factory);
+static void compact_ref_(librdf_storage *storage);
+static void compact_unref_(librdf_storage *storage);
+
+static int compact_init_(librdf_storage *storage, const char *name, librdf_hash *options);
+static void compact_terminate_(librdf_storage *storage);
+static int compact_open_(librdf_storage *storage, librdf_model *model);
+static int compact_close_(librdf_storage *storage);
+static int compact_size_(librdf_storage *storage);
+static int compact_add_statement_(librdf_storage *storage, librdf_statement *statement);
+static int compact_add_statements_(librdf_storage *storage, librdf_stream *stream);
+static int compact_remove_statement_(librdf_storage *storage, librdf_statement *statement);
+static int compact_contains_statement_(librdf_storage *storage, librdf_statement *statement);
+static librdf_stream *compact_serialise_(librdf_storage *storage);
+static librdf_stream *compact_find_statements_(librdf_storage *storage, librdf_statement *statement);
+static librdf_stream *compact_find_statements_with_options_(librdf_storage *storage, librdf_statement *statement, librdf_node *context, librdf_hash *options);
+static int compact_context_add_statement_(librdf_storage *storage, librdf_node *context, librdf_statement *statement);
+static int compact_context_add_statements_(librdf_storage *storage, librdf_node *context, librdf_stream *stream);
+static int compact_context_remove_statement_(librdf_storage *storage, librdf_node *context, librdf_statement *statement);
+static int compact_context_remove_statements_(librdf_storage *storage, librdf_node *context);
+static int compact_context_contains_statement_(librdf_storage *storage, librdf_node *context, librdf_statement *statement);
+static librdf_stream *compact_context_serialise_(librdf_storage *storage, librdf_node *context);
+static librdf_stream *compact_find_statements_in_context_(librdf_storage *storage, librdf_statement *statement, librdf_node *context);
+static librdf_iterator *compact_get_contexts_(librdf_storage *storage);
+static librdf_node *compact_get_feature_(librdf_storage *storage, librdf_uri *feature);
+static int compact_set_feature_(librdf_storage *storage, librdf_uri *feature, librdf_node *value);
+
+static int compact_reset_(struct compact_struct *cs);
+static uint32_t compact_intern_(struct compact_struct *cs, librdf_node *node, int create);
+static uint32_t compact_intern_string_(struct compact_struct *cs, compact_term_type type, const char *str, size_t len, uint32_t datatype, const char *lang, int create);
+static const char *compact_strdup_(struct compact_struct *cs, const char *str, size_t len);
+static int compact_dict_grow_(struct compact_struct *cs);
+static librdf_node *compact_node_(struct compact_struct *cs, uint32_t id);
+static unsigned long compact_quad_hash_(uint32_t s, uint32_t p, uint32_t o, uint32_t g);
+static size_t compact_quad_find_(struct compact_struct *cs, uint32_t s, uint32_t p, uint32_t o, uint32_t g);
+static int compact_quad_add_(struct compact_struct *cs, uint32_t s, uint32_t p, uint32_t o, uint32_t g);
+static int compact_qset_grow_(struct compact_struct *cs);
+static int compact_index_(struct compact_struct *cs, struct compact_index_struct *idx, uint32_t *column);
+static int compact_pattern_(struct compact_struct *cs, librdf_statement *statement, librdf_node *context, uint32_t *ids);
+static librdf_stream *compact_stream_(struct compact_struct *cs, uint32_t s, uint32_t p, uint32_t o, uint32_t g);
+static int compact_stream_match_(struct compact_stream_struct *stream, size_t idx);
+static void compact_stream_advance_(struct compact_stream_struct *stream);
+static int compact_stream_end_(void *context);
+static int compact_stream_next_(void *context);
+static void *compact_stream_get_(void *context, int flags);
+static void compact_stream_finished_(void *context);
+static int compact_iterator_end_(void *context);
+static int compact_iterator_next_(void *context);
+static void *compact_iterator_get_(void *context, int flags);
+static void compact_iterator_finished_(void *context);
+
+/* Private: register the compact storage module with a world */
+int
+twine_storage_register_(librdf_world *world)
+{
+	if(librdf_storage_register_factory(world, TWINE_STORAGE_COMPACT, "Twine compact in-memory quad store", twine_storage_factory_))
+	{
+		twine_logf(LOG_CRIT, "failed to register '%s' storage module\n", TWINE_STORAGE_COMPACT);
+		return -1;
+	}
+	return 0;
+}
+
+/* Private: determine whether a storage instance is a twine-compact one */
+int
+twine_storage_is_compact_(librdf_storage *storage)
+{
+	librdf_uri *uri;
+	librdf_node *node;
+
+	uri = librdf_new_uri(librdf_storage_get_world(storage), (const unsigned char *) TWINE_STORAGE_FEATURE_COMPACT);
+	if(!uri)
+	{
+		return 0;
+	}
+	node = librdf_storage_get_feature(storage, uri);
+	librdf_free_uri(uri);
+	if(!node)
+	{
+		return 0;
+	}
+	librdf_free_node(node);
+	return 1;
+}
+
+/* Private: discard the contents of a twine-compact storage instance,
+ * retaining its allocations for re-use
+ */
+int
+twine_storage_reset_(librdf_storage *storage)
+{
+	librdf_uri *uri;
+	int r;
+
+	uri = librdf_new_uri(librdf_storage_get_world(storage), (const unsigned char *) TWINE_STORAGE_FEATURE_RESET);
+	if(!uri)
+	{
+		return -1;
+	}
+	r = librdf_storage_set_feature(storage, uri, NULL);
+	librdf_free_uri(uri);
+	return r;
+}
+
+/* Private: obtain direct access to the quad columns of a twine-compact
+ * storage instance; the columns may contain holes (quads whose subject is
+ * zero) left by removals, and g is NULL if contexts are disabled. The
+ * columns are only valid until the storage is next modified.
+ */
+int
+twine_storage_columns_(librdf_storage *storage, const uint32_t **s, const uint32_t **p, const uint32_t **o, const uint32_t **g, size_t *nquads, size_t *live, uint32_t *nterms)
+{
+	struct compact_struct *cs;
+
+	cs = (struct compact_struct *) librdf_storage_get_instance(storage);
+	*s = cs->s;
+	*p = cs->p;
+	*o = cs->o;
+	*g = (cs->contexts ? cs->g : NULL);
+	*nquads = cs->nquads;
+	*live = cs->live;
+	*nterms = cs->nterms;
+	return 0;
+}
+
+/* Private: return the identifier of a term in a twine-compact storage
+ * instance's dictionary, or zero if it isn't present
+ */
+uint32_t
+twine_storage_term_(librdf_storage *storage, librdf_node *node)
+{
+	struct compact_struct *cs;
+
+	cs = (struct compact_struct *) librdf_storage_get_instance(storage);
+	return compact_intern_(cs, node, 0);
+}
+
+/* Private: create a new node from a term in a twine-compact storage
+ * instance's dictionary
+ */
+librdf_node *
+twine_storage_node_(librdf_storage *storage, uint32_t id)
+{
+	struct compact_struct *cs;
+
+	cs = (struct compact_struct *) librdf_storage_get_instance(storage);
+	if(id >= cs->nterms)
+	{
+		return NULL;
+	}
+	return compact_node_(cs, id);
+}
+
+/* Private: obtain the number of statements held by a twine-compact storage
+ * instance and the memory it has allocated
+ */
+int
+twine_storage_usage_(librdf_storage *storage, size_t *triples, size_t *bytes)
+{
+	struct compact_struct *cs;
+	struct compact_block_struct *block;
+	size_t n;
+
+	cs = (struct compact_struct *) librdf_storage_get_instance(storage);
+	if(triples)
+	{
+		*triples = cs->live;
+	}
+	if(bytes)
+	{
+		n = sizeof(struct compact_struct);
+		n += cs->termsize * sizeof(struct compact_term_struct);
+		n += cs->dictsize * sizeof(uint32_t);
+		for(block = cs->blocks; block; block = block->next)
+		{
+			n += sizeof(struct compact_block_struct) + block->size;
+		}
+		n += cs->quadsize * sizeof(uint32_t) * (cs->contexts ? 4 : 3);
+		n += cs->qsetsize * sizeof(size_t);
+		if(cs->sindex.index)
+		{
+			n += (cs->nterms + 1 + cs->nquads) * sizeof(size_t);
+		}
+		if(cs->gindex.index)
+		{
+			n += (cs->nterms + 1 + cs->nquads) * sizeof(size_t);
+		}
+		*bytes = n;
+	}
+	return 0;
+}
+
+/* Private: build any indices which a twine-compact storage instance would
+ * otherwise build lazily, so that it can be read by several threads at once
+ * (provided that none of them modify it)
+ */
+int
+twine_storage_prepare_(librdf_storage *storage)
+{
+	struct compact_struct *cs;
+
+	cs = (struct compact_struct *) librdf_storage_get_instance(storage);
+	if(compact_index_(cs, &(cs->sindex), cs->s))
+	{
+		return -1;
+	}
+	if(cs->contexts && compact_index_(cs, &(cs->gindex), cs->g))
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/* Private: add the statements held by one twine-compact storage instance
+ * to another, translating term identifiers between their dictionaries
+ * rather than constructing nodes for each statement
+ */
+int
+twine_storage_copy_(librdf_storage *dest, librdf_storage *src)
+{
+	struct compact_struct *ds, *ss;
+	struct compact_term_struct *term;
+	uint32_t *map, g;
+	uint32_t c;
+	size_t idx;
+
+	ds = (struct compact_struct *) librdf_storage_get_instance(dest);
+	ss = (struct compact_struct *) librdf_storage_get_instance(src);
+	map = (uint32_t *) calloc(ss->nterms, sizeof(uint32_t));
+	if(!map)
+	{
+		twine_logf(LOG_CRIT, "failed to allocate memory for compact storage term map\n");
+		return -1;
+	}
+	/* A literal's datatype is always interned before the literal itself, so
+	 * it will already have been mapped
+	 */
+	for(c = 1; c < ss->nterms; c++)
+	{
+		term = &(ss->terms[c]);
+		map[c] = compact_intern_string_(ds, term->type, term->str, term->len, map[term->datatype], term->lang, 1);
+		if(map[c] == COMPACT_NONE)
+		{
+			free(map);
+			return -1;
+		}
+	}
+	for(idx = 0; idx < ss->nquads; idx++)
+	{
+		if(ss->s[idx] == COMPACT_NONE)
+		{
+			continue;
+		}
+		g = ((ss->g && ds->contexts) ? map[ss->g[idx]] : COMPACT_NONE);
+		if(compact_quad_find_(ds, map[ss->s[idx]], map[ss->p[idx]], map[ss->o[idx]], g))
+		{
+			continue;
+		}
+		if(compact_quad_add_(ds, map[ss->s[idx]], map[ss->p[idx]], map[ss->o[idx]], g))
+		{
+			free(map);
+			return -1;
+		}
+	}
+	free(map);
+	return 0;
+}
+
+static void
+twine_storage_factory_(librdf_storage_factory *factory)
+{
+	factory->version = LIBRDF_STORAGE_INTERFACE_VERSION;
+	factory->init = compact_init_;
+	factory->terminate = compact_terminate_;
+	factory->open = compact_open_;
+	factory->close = compact_close_;
+	factory->size = compact_size_;
+	factory->add_statement = compact_add_statement_;
+	factory->add_statements = compact_add_statements_;
+	factory->remove_statement = compact_remove_statement_;
+	factory->contains_statement = compact_contains_statement_;
+	factory->serialise = compact_serialise_;
+	factory->find_statements = compact_find_statements_;
+	factory->find_statements_with_options = compact_find_statements_with_options_;
+	factory->context_add_statement = compact_context_add_statement_;
+	factory->context_add_statements = compact_context_add_statements_;
+	factory->context_remove_statement = compact_context_remove_statement_;
+	factory->context_remove_statements = compact_context_remove_statements_;
+	factory->context_contains_statement = compact_context_contains_statement_;
+	factory->context_serialise = compact_context_serialise_;
+	factory->find_statements_in_context = compact_find_statements_in_context_;
+	factory->get_contexts = compact_get_contexts_;
+	factory->get_feature = compact_get_feature_;
+	factory->set_feature = compact_set_feature_;
+}
+
+/* Storage module methods */
+
+static int
+compact_init_(librdf_storage *storage, const char *name, librdf_hash *options)
+{
+	struct compact_struct *cs;
+
+	(void) name;
+
+	cs = (struct compact_struct *) calloc(1, sizeof(struct compact_struct));
+	if(!cs)
+	{
+		twine_logf(LOG_CRIT, "failed to allocate memory for compact storage\n");
+		if(options)
+		{
+			librdf_free_hash(options);
+		}
+		return -1;
+	}
+	cs->storage = storage;
+	cs->world = librdf_storage_get_world(storage);
+	/* Contexts are enabled unless contexts='no' is specified */
+	cs->contexts = 1;
+	if(options)
+	{
+		if(!librdf_hash_get_as_boolean(options, "contexts"))
+		{
+			cs->contexts = 0;
+		}
+		librdf_free_hash(options);
+	}
+	librdf_storage_set_instance(storage, cs);
+	if(compact_reset_(cs))
+	{
+		compact_terminate_(storage);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+compact_terminate_(librdf_storage *storage)
+{
+	struct compact_struct *cs;
+	struct compact_block_struct *block;
+
+	cs = (struct compact_struct *) librdf_storage_get_instance(storage);
+	if(!cs)
+	{
+		return;
+	}
+	while(cs->blocks)
+	{
+		block = cs->blocks;
+		cs->blocks = block->next;
+		free(block);
+	}
+	free(cs->terms);
+	free(cs->dict);
+	free(cs->s);
+	free(cs->p);
+	free(cs->o);
+	free(cs->g);
+	free(cs->qset);
+	free(cs->sindex.index);
+	free(cs->sindex.start);
+	free(cs->gindex.index);
+	free(cs->gindex.start);
+	free(cs);
+	librdf_storage_set_instance(storage, NULL);
+}
+
+static int
+compact_open_(librdf_storage *storage, librdf_model *model)
+{
+	(void) storage;
+	(void) model;
+
+	return 0;
+}
+
+static int
+compact_close_(librdf_storage *storage)
+{
+	(void) storage;
+
+	return 0;
+}
+
+static int
+compact_size_(librdf_storage *storage)
+{
+	struct compact_struct *cs;
+
+	cs = (struct compact_struct *) librdf_storage_get_instance(storage);
+	return (int) cs->live;
+}
+
+static int
+compact_add_statement_(librdf_storage *storage, librdf_statement *statement)
+{
+	return compact_context_add_statement_(storage, NULL, statement);
+}
+
+static int
+compact_add_statements_(librdf_storage *storage, librdf_stream *stream)
+{
+	return compact_context_add_statements_(storage, NULL, stream);
+}
+
+static int
+compact_remove_statement_(librdf_storage *storage, librdf_statement *statement)
+{
+	return compact_context_remove_statement_(storage, NULL, statement);
+}
+
+/* Determine whether a triple exists in any context */
+static int
+compact_contains_statement_(librdf_storage *storage, librdf_statement *statement)
+{
+	struct compact_struct *cs;
+	librdf_stream *stream;
+	int r;
+
+	cs = (struct compact_struct *) librdf_storage_get_instance(storage);
+	if(!cs->contexts)
+	{
+		return compact_context_contains_statement_(storage, NULL, statement);
+	}
+	stream = compact_find_statements_(storage, statement);
+	if(!stream)
+	{
+		return 0;
+	}
+	r = !librdf_stream_end(stream);
+	librdf_free_stream(stream);
+	return r;
+}
+
+static librdf_stream *
+compact_serialise_(librdf_storage *storage)
+{
+	return compact_find_statements_with_options_(storage, NULL, NULL, NULL);
+}
+
+static librdf_stream *
+compact_find_statements_(librdf_storage *storage, librdf_statement *statement)
+{
+	return compact_find_statements_with_options_(storage, statement, NULL, NULL);
+}
+
+static librdf_stream *
+compact_find_statements_with_options_(librdf_storage *storage, librdf_statement *statement, librdf_node *context, librdf_hash *options)
+{
+	struct compact_struct *cs;
+	uint32_t ids[4];
+
+	(void) options;
+
+	cs = (struct compact_struct *) librdf_storage_get_instance(storage);
+	if(compact_pattern_(cs, statement, context, ids))
+	{
+		/* One of the terms in the pattern isn't in the dictionary */
+		return librdf_new_empty_stream(cs->world);
+	}
+	return compact_stream_(cs, ids[0], ids[1], ids[2], ids[3]);
+}
+
+static int
+compact_context_add_statement_(librdf_storage *storage, librdf_node *context, librdf_statement *statement)
+{
+	struct compact_struct *cs;
+	uint32_t s, p, o, g;
+
+	cs = (struct compact_struct *) librdf_storage_get_instance(storage);
+	if(!librdf_statement_get_subject(statement) ||
+	   !librdf_statement_get_predicate(statement) ||
+	   !librdf_statement_get_object(statement))
+	{
+		twine_logf(LOG_ERR, "cannot add an incomplete statement to compact storage\n");
+		return -1;
+	}
+	/* As with the hashes storage, a context can't be recorded (or simply
+	 * discarded) if contexts are disabled
+	 */
+	if(context && !cs->contexts)
+	{
+		twine_logf(LOG_ERR, "cannot add a statement with a context to compact storage without contexts\n");
+		return -1;
+	}
+	s = compact_intern_(cs, librdf_statement_get_subject(statement), 1);
+	p = compact_intern_(cs, librdf_statement_get_predicate(statement), 1);
+	o = compact_intern_(cs, librdf_statement_get_object(statement), 1);
+	g = COMPACT_NONE;
+	if(context)
+	{
+		g = compact_intern_(cs, context, 1);
+		if(g == COMPACT_NONE)
+		{
+			return -1;
+		}
+	}
+	if(s == COMPACT_NONE || p == COMPACT_NONE || o == COMPACT_NONE)
+	{
+		return -1;
+	}
+	if(compact_quad_find_(cs, s, p, o, g))
+	{
+		/* Duplicates are silently ignored, as with the hashes storage */
+		return 0;
+	}
+	return compact_quad_add_(cs, s, p, o, g);
+}
+
+static int
+compact_context_add_statements_(librdf_storage *storage, librdf_node *context, librdf_stream *stream)
+{
+	for(; !librdf_stream_end(stream); librdf_stream_next(stream))
+	{
+		if(compact_context_add_statement_(storage, context, librdf_stream_get_object(stream)))
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int
+compact_context_remove_statement_(librdf_storage *storage, librdf_node *context, librdf_statement *statement)
+{
+	struct compact_struct *cs;
+	uint32_t ids[4];
+	size_t idx;
+
+	cs = (struct compact_struct *) librdf_storage_get_instance(storage);
+	if(context && !cs->contexts)
+	{
+		twine_logf(LOG_ERR, "cannot remove a statement from a context in compact storage without contexts\n");
+		return -1;
+	}
+	if(compact_pattern_(cs, statement, context, ids) ||
+	   ids[0] == COMPACT_NONE || ids[1] == COMPACT_NONE || ids[2] == COMPACT_NONE)
+	{
+		return 0;
+	}
+	idx = compact_quad_find_(cs, ids[0], ids[1], ids[2], ids[3]);
+	if(idx)
+	{
+		cs->s[idx - 1] = COMPACT_NONE;
+		cs->live--;
+	}
+	return 0;
+}
+
+static int
+compact_context_remove_statements_(librdf_storage *storage, librdf_node *context)
+{
+	struct compact_struct *cs;
+	uint32_t g;
+	size_t c;
+
+	cs = (struct compact_struct *) librdf_storage_get_instance(storage);
+	/* Without contexts, there's no context whose statements could be
+	 * removed; this mustn't be treated as matching every statement
+	 */
+	if(context && !cs->contexts)
+	{
+		twine_logf(LOG_ERR, "cannot remove the statements in a context from compact storage without contexts\n");
+		return -1;
+	}
+	g = COMPACT_NONE;
+	if(context)
+	{
+		g = compact_intern_(cs, context, 0);
+		if(g == COMPACT_NONE)
+		{
+			return 0;
+		}
+	}
+	for(c = 0; c < cs->nquads; c++)
+	{
+		if(cs->s[c] != COMPACT_NONE && (cs->g ? cs->g[c] : COMPACT_NONE) == g)
+		{
+			cs->s[c] = COMPACT_NONE;
+			cs->live--;
+		}
+	}
+	return 0;
+}
+
+static int
+compact_context_contains_statement_(librdf_storage *storage, librdf_node *context, librdf_statement *statement)
+{
+	struct compact_struct *cs;
+	uint32_t ids[4];
+
+	cs = (struct compact_struct *) librdf_storage_get_instance(storage);
+	if(compact_pattern_(cs, statement, context, ids) ||
+	   ids[0] == COMPACT_NONE || ids[1] == COMPACT_NONE || ids[2] == COMPACT_NONE)
+	{
+		return 0;
+	}
+	return compact_quad_find_(cs, ids[0], ids[1], ids[2], ids[3]) ? 1 : 0;
+}
+
+static librdf_stream *
+compact_context_serialise_(librdf_storage *storage, librdf_node *context)
+{
+	return compact_find_statements_with_options_(storage, NULL, context, NULL);
+}
+
+static librdf_stream *
+compact_find_statements_in_context_(librdf_storage *storage, librdf_statement *statement, librdf_node *context)
+{
+	return compact_find_statements_with_options_(storage, statement, context, NULL);
+}
+
+/* Return an iterator over the distinct contexts in use */
+static librdf_iterator *
+compact_get_contexts_(librdf_storage *storage)
+{
+	struct compact_struct *cs;
+	struct compact_iterator_struct *it;
+	unsigned char *seen;
+	librdf_iterator *iterator;
+	size_t c;
+
+	cs = (struct compact_struct *) librdf_storage_get_instance(storage);
+	if(!cs->g)
+	{
+		return librdf_new_empty_iterator(cs->world);
+	}
+	it = (struct compact_iterator_struct *) calloc(1, sizeof(struct compact_iterator_struct));
+	seen = (unsigned char *) calloc(cs->nterms, 1);
+	if(!it || !seen)
+	{
+		twine_logf(LOG_CRIT, "failed to allocate memory for context iterator\n");
+		free(it);
+		free(seen);
+		return NULL;
+	}
+	it->cs = cs;
+	for(c = 0; c < cs->nquads; c++)
+	{
+		if(cs->s[c] != COMPACT_NONE && cs->g[c] != COMPACT_NONE && !seen[cs->g[c]])
+		{
+			seen[cs->g[c]] = 1;
+			it->nids++;
+		}
+	}
+	if(it->nids)
+	{
+		it->ids = (uint32_t *) calloc(it->nids, sizeof(uint32_t));
+		if(!it->ids)
+		{
+			twine_logf(LOG_CRIT, "failed to allocate memory for context iterator\n");
+			free(it);
+			free(seen);
+			return NULL;
+		}
+		it->nids = 0;
+		for(c = 1; c < cs->nterms; c++)
+		{
+			if(seen[c])
+			{
+				it->ids[it->nids] = (uint32_t) c;
+				it->nids++;
+			}
+		}
+	}
+	free(seen);
+	compact_ref_(storage);
+	iterator = librdf_new_iterator(cs->world, it, compact_iterator_end_, compact_iterator_next_, compact_iterator_get_, compact_iterator_finished_);
+	if(!iterator)
+	{
+		compact_iterator_finished_(it);
+	}
+	return iterator;
+}
+
+static librdf_node *
+compact_get_feature_(librdf_storage *storage, librdf_uri *feature)
+{
+	struct compact_struct *cs;
+	const char *str, *value;
+
+	cs = (struct compact_struct *) librdf_storage_get_instance(storage);
+	if(!feature)
+	{
+		return NULL;
+	}
+	str = (const char *) librdf_uri_as_string(feature);
+	if(!strcmp(str, LIBRDF_MODEL_FEATURE_CONTEXTS))
+	{
+		value = (cs->contexts ? "1" : "0");
+	}
+	else if(!strcmp(str, TWINE_STORAGE_FEATURE_COMPACT))
+	{
+		value = "1";
+	}
+	else
+	{
+		return NULL;
+	}
+	return librdf_new_node_from_typed_counted_literal(cs->world, (const unsigned char *) value, 1, NULL, 0, NULL);
+}
+
+static int
+compact_set_feature_(librdf_storage *storage, librdf_uri *feature, librdf_node *value)
+{
+	struct compact_struct *cs;
+
+	(void) value;
+
+	cs = (struct compact_struct *) librdf_storage_get_instance(storage);
+	if(feature && !strcmp((const char *) librdf_uri_as_string(feature), TWINE_STORAGE_FEATURE_RESET))
+	{
+		return compact_reset_(cs);
+	}
+	return -1;
+}
+
+/* Internal helpers */
+
+/* Discard all terms and quads, retaining the allocated arrays */
+static int
+compact_reset_(struct compact_struct *cs)
+{
+	struct compact_block_struct *block;
+
+	/* Keep only the first string block */
+	if(cs->blocks)
+	{
+		while(cs->blocks->next)
+		{
+			block = cs->blocks->next;
+			cs->blocks->next = block->next;
+			free(block);
+		}
+		cs->blocks->used = 0;
+	}
+	if(!cs->terms)
+	{
+		cs->termsize = COMPACT_MIN_TERMS;
+		cs->terms = (struct compact_term_struct *) calloc(cs->termsize, sizeof(struct compact_term_struct));
+		cs->dictsize = COMPACT_MIN_TERMS * 2;
+		cs->dict = (uint32_t *) calloc(cs->dictsize, sizeof(uint32_t));
+		cs->qsetsize = COMPACT_MIN_QUADS * 2;
+		cs->qset = (size_t *) calloc(cs->qsetsize, sizeof(size_t));
+		if(!cs->terms || !cs->dict || !cs->qset)
+		{
+			twine_logf(LOG_CRIT, "failed to allocate memory for compact storage\n");
+			return -1;
+		}
+	}
+	else
+	{
+		memset(cs->dict, 0, cs->dictsize * sizeof(uint32_t));
+		memset(cs->qset, 0, cs->qsetsize * sizeof(size_t));
+	}
+	/* Term 0 is COMPACT_NONE */
+	cs->nterms = 1;
+	cs->nquads = 0;
+	cs->live = 0;
+	cs->sindex.valid = 0;
+	cs->gindex.valid = 0;
+	return 0;
+}
+
+/* Obtain the identifier for a node, optionally adding it to the dictionary
+ * if it isn't already present; returns COMPACT_NONE if the node isn't
+ * present (or can't be added)
+ */
+static uint32_t
+compact_intern_(struct compact_struct *cs, librdf_node *node, int create)
+{
+	const char *str, *lang;
+	size_t len;
+	librdf_uri *uri;
+	uint32_t datatype;
+
+	if(librdf_node_is_resource(node))
+	{
+		str = (const char *) librdf_uri_as_counted_string(librdf_node_get_uri(node), &len);
+		return compact_intern_string_(cs, TERM_URI, str, len, COMPACT_NONE, NULL, create);
+	}
+	if(librdf_node_is_blank(node))
+	{
+		str = (const char *) librdf_node_get_counted_blank_identifier(node, &len);
+		return compact_intern_string_(cs, TERM_BLANK, str, len, COMPACT_NONE, NULL, create);
+	}
+	if(!librdf_node_is_literal(node))
+	{
+		return COMPACT_NONE;
+	}
+	datatype = COMPACT_NONE;
+	if((uri = librdf_node_get_literal_value_datatype_uri(node)))
+	{
+		str = (const char *) librdf_uri_as_counted_string(uri, &len);
+		datatype = compact_intern_string_(cs, TERM_URI, str, len, COMPACT_NONE, NULL, create);
+		if(datatype == COMPACT_NONE)
+		{
+			return COMPACT_NONE;
+		}
+	}
+	lang = librdf_node_get_literal_value_language(node);
+	str = (const char *) librdf_node_get_literal_value_as_counted_string(node, &len);
+	return compact_intern_string_(cs, TERM_LITERAL, str, len, datatype, lang, create);
+}
+
+static uint32_t
+compact_intern_string_(struct compact_struct *cs, compact_term_type type, const char *str, size_t len, uint32_t datatype, const char *lang, int create)
+{
+	struct compact_term_struct *term;
+	unsigned long hash;
+	size_t c;
+	char tc;
+
+	tc = (char) type;
+	hash = twine_rdf_hash_(&tc, 1, 0);
+	hash = twine_rdf_hash_(str, len, hash);
+	hash = twine_rdf_hash_((const char *) &datatype, sizeof(datatype), hash);
+	if(lang)
+	{
+		hash = twine_rdf_hash_(lang, strlen(lang), hash);
+	}
+	for(c = hash & (cs->dictsize - 1); cs->dict[c]; c = (c + 1) & (cs->dictsize - 1))
+	{
+		term = &(cs->terms[cs->dict[c]]);
+		if(term->hash == hash && term->type == type && term->len == len &&
+		   term->datatype == datatype && !memcmp(term->str, str, len) &&
+		   ((!term->lang && !lang) || (term->lang && lang && !strcmp(term->lang, lang))))
+		{
+			return cs->dict[c];
+		}
+	}
+	if(!create)
+	{
+		return COMPACT_NONE;
+	}
+	if(cs->nterms >= cs->termsize)
+	{
+		term = (struct compact_term_struct *) realloc(cs->terms, cs->termsize * 2 * sizeof(struct compact_term_struct));
+		if(!term)
+		{
+			twine_logf(LOG_CRIT, "failed to allocate memory for compact storage terms\n");
+			return COMPACT_NONE;
+		}
+		cs->terms = term;
+		cs->termsize *= 2;
+	}
+	term = &(cs->terms[cs->nterms]);
+	term->hash = hash;
+	term->type = type;
+	term->len = len;
+	term->datatype = datatype;
+	term->str = compact_strdup_(cs, str, len);
+	term->lang = (lang ? compact_strdup_(cs, lang, strlen(lang)) : NULL);
+	if(!term->str || (lang && !term->lang))
+	{
+		return COMPACT_NONE;
+	}
+	cs->dict[c] = cs->nterms;
+	cs->nterms++;
+	if(cs->nterms * 2 >= cs->dictsize && compact_dict_grow_(cs))
+	{
+		return COMPACT_NONE;
+	}
+	return cs->nterms - 1;
+}
+
+/* Copy a string into the term storage blocks */
+static const char *
+compact_strdup_(struct compact_struct *cs, const char *str, size_t len)
+{
+	struct compact_block_struct *block;
+	size_t size;
+	char *p;
+
+	block = cs->blocks;
+	if(!block || block->size - block->used < len + 1)
+	{
+		size = (len + 1 > COMPACT_BLOCK_SIZE ? len + 1 : COMPACT_BLOCK_SIZE);
+		block = (struct compact_block_struct *) malloc(sizeof(struct compact_block_struct) + size);
+		if(!block)
+		{
+			twine_logf(LOG_CRIT, "failed to allocate memory for compact storage strings\n");
+			return NULL;
+		}
+		block->size = size;
+		block->used = 0;
+		block->next = cs->blocks;
+		cs->blocks = block;
+	}
+	p = &(block->data[block->used]);
+	memcpy(p, str, len);
+	p[len] = 0;
+	block->used += len + 1;
+	return p;
+}
+
+static int
+compact_dict_grow_(struct compact_struct *cs)
+{
+	uint32_t *dict, id;
+	size_t size, c;
+
+	size = cs->dictsize * 2;
+	dict = (uint32_t *) calloc(size, sizeof(uint32_t));
+	if(!dict)
+	{
+		twine_logf(LOG_CRIT, "failed to allocate memory for compact storage dictionary\n");
+		return -1;
+	}
+	for(id = 1; id < cs->nterms; id++)
+	{
+		for(c = cs->terms[id].hash & (size - 1); dict[c]; c = (c + 1) & (size - 1));
+		dict[c] = id;
+	}
+	free(cs->dict);
+	cs->dict = dict;
+	cs->dictsize = size;
+	return 0;
+}
+
+/* Create a new node from a term in the dictionary */
+static librdf_node *
+compact_node_(struct compact_struct *cs, uint32_t id)
+{
+	struct compact_term_struct *term, *dt;
+	librdf_uri *uri;
+	librdf_node *node;
+
+	if(id == COMPACT_NONE)
+	{
+		return NULL;
+	}
+	term = &(cs->terms[id]);
+	switch(term->type)
+	{
+	case TERM_URI:
+		if(cs->world == twine_->world)
+		{
+			/* Predicates and classes recur constantly, so use the shared
+			 * URI node cache
+			 */
+			return twine_rdf_node_intern_(term->str, term->len);
+		}
+		return librdf_new_node_from_counted_uri_string(cs->world, (const unsigned char *) term->str, term->len);
+	case TERM_BLANK:
+		return librdf_new_node_from_counted_blank_identifier(cs->world, (const unsigned char *) term->str, term->len);
+	case TERM_LITERAL:
+		uri = NULL;
+		if(term->datatype != COMPACT_NONE)
+		{
+			dt = &(cs->terms[term->datatype]);
+			if(cs->world == twine_->world && (node = twine_rdf_node_intern_(dt->str, dt->len)))
+			{
+				uri = librdf_new_uri_from_uri(librdf_node_get_uri(node));
+				librdf_free_node(node);
+			}
+			else
+			{
+				uri = librdf_new_uri2(cs->world, (const unsigned char *) dt->str, dt->len);
+			}
+			if(!uri)
+			{
+				return NULL;
+			}
+		}
+		node = librdf_new_node_from_typed_counted_literal(cs->world, (const unsigned char *) term->str, term->len, term->lang, term->lang ? strlen(term->lang) : 0, uri);
+		if(uri)
+		{
+			librdf_free_uri(uri);
+		}
+		return node;
+	}
+	return NULL;
+}
+
+static unsigned long
+compact_quad_hash_(uint32_t s, uint32_t p, uint32_t o, uint32_t g)
+{
+	unsigned long hash;
+
+	hash = s;
+	hash = (hash * 31) ^ p;
+	hash = (hash * 31) ^ o;
+	hash = (hash * 31) ^ g;
+	/* Mix the bits so that sequential identifiers spread across the table */
+	hash ^= hash >> 15;
+	hash *= 2246822519UL;
+	hash ^= hash >> 13;
+	return hash;
+}
+
+/* Find a quad, returning its index plus one, or zero if not present */
+static size_t
+compact_quad_find_(struct compact_struct *cs, uint32_t s, uint32_t p, uint32_t o, uint32_t g)
+{
+	size_t c, idx;
+
+	for(c = compact_quad_hash_(s, p, o, g) & (cs->qsetsize - 1); cs->qset[c]; c = (c + 1) & (cs->qsetsize - 1))
+	{
+		idx = cs->qset[c] - 1;
+		if(cs->s[idx] == s && cs->p[idx] == p && cs->o[idx] == o &&
+		   (cs->g ? cs->g[idx] : COMPACT_NONE) == g)
+		{
+			return idx + 1;
+		}
+	}
+	return 0;
+}
+
+static int
+compact_quad_add_(struct compact_struct *cs, uint32_t s, uint32_t p, uint32_t o, uint32_t g)
+{
+	uint32_t *q;
+	size_t size, c;
+
+	if(cs->nquads >= cs->quadsize)
+	{
+		size = (cs->quadsize ? cs->quadsize * 2 : COMPACT_MIN_QUADS);
+		if(!(q = (uint32_t *) realloc(cs->s, size * sizeof(uint32_t))))
+		{
+			goto nomem;
+		}
+		cs->s = q;
+		if(!(q = (uint32_t *) realloc(cs->p, size * sizeof(uint32_t))))
+		{
+			goto nomem;
+		}
+		cs->p = q;
+		if(!(q = (uint32_t *) realloc(cs->o, size * sizeof(uint32_t))))
+		{
+			goto nomem;
+		}
+		cs->o = q;
+		if(cs->contexts)
+		{
+			if(!(q = (uint32_t *) realloc(cs->g, size * sizeof(uint32_t))))
+			{
+				goto nomem;
+			}
+			cs->g = q;
+		}
+		cs->quadsize = size;
+	}
+	cs->s[cs->nquads] = s;
+	cs->p[cs->nquads] = p;
+	cs->o[cs->nquads] = o;
+	if(cs->g)
+	{
+		cs->g[cs->nquads] = g;
+	}
+	for(c = compact_quad_hash_(s, p, o, g) & (cs->qsetsize - 1); cs->qset[c]; c = (c + 1) & (cs->qsetsize - 1));
+	cs->qset[c] = cs->nquads + 1;
+	cs->nquads++;
+	cs->live++;
+	cs->sindex.valid = 0;
+	cs->gindex.valid = 0;
+	if(cs->nquads * 2 >= cs->qsetsize)
+	{
+		return compact_qset_grow_(cs);
+	}
+	return 0;
+nomem:
+	twine_logf(LOG_CRIT, "failed to allocate memory for compact storage quads\n");
+	return -1;
+}
+
+static int
+compact_qset_grow_(struct compact_struct *cs)
+{
+	size_t *qset;
+	size_t size, c, idx;
+
+	size = cs->qsetsize * 2;
+	qset = (size_t *) calloc(size, sizeof(size_t));
+	if(!qset)
+	{
+		twine_logf(LOG_CRIT, "failed to allocate memory for compact storage index\n");
+		return -1;
+	}
+	for(idx = 0; idx < cs->nquads; idx++)
+	{
+		if(cs->s[idx] == COMPACT_NONE)
+		{
+			continue;
+		}
+		for(c = compact_quad_hash_(cs->s[idx], cs->p[idx], cs->o[idx], cs->g ? cs->g[idx] : COMPACT_NONE) & (size - 1); qset[c]; c = (c + 1) & (size - 1));
+		qset[c] = idx + 1;
+	}
+	free(cs->qset);
+	cs->qset = qset;
+	cs->qsetsize = size;
+	return 0;
+}
+
+/* (Re-)build an index of quads by the terms in one column, using a
+ * counting sort over the term identifiers
+ */
+static int
+compact_index_(struct compact_struct *cs, struct compact_index_struct *idx, uint32_t *column)
+{
+	size_t *start, *index;
+	size_t c;
+
+	if(idx->valid)
+	{
+		return 0;
+	}
+	start = (size_t *) realloc(idx->start, (cs->nterms + 1) * sizeof(size_t));
+	if(!start)
+	{
+		return -1;
+	}
+	idx->start = start;
+	index = (size_t *) realloc(idx->index, (cs->nquads ? cs->nquads : 1) * sizeof(size_t));
+	if(!index)
+	{
+		return -1;
+	}
+	idx->index = index;
+	memset(start, 0, (cs->nterms + 1) * sizeof(size_t));
+	for(c = 0; c < cs->nquads; c++)
+	{
+		start[column[c] + 1]++;
+	}
+	for(c = 1; c <= cs->nterms; c++)
+	{
+		start[c] += start[c - 1];
+	}
+	for(c = 0; c < cs->nquads; c++)
+	{
+		index[start[column[c]]] = c;
+		start[column[c]]++;
+	}
+	/* Each start[n] is now the end of term n's range, which is the
+	 * beginning of term n + 1's; shift them back into place
+	 */
+	for(c = cs->nterms; c > 0; c--)
+	{
+		start[c] = start[c - 1];
+	}
+	start[0] = 0;
+	idx->valid = 1;
+	return 0;
+}
+
+/* Translate a statement pattern and optional context into identifiers;
+ * returns -1 if any bound term isn't present in the dictionary (and so
+ * nothing can match)
+ */
+static int
+compact_pattern_(struct compact_struct *cs, librdf_statement *statement, librdf_node *context, uint32_t *ids)
+{
+	librdf_node *node;
+	int c;
+
+	ids[0] = ids[1] = ids[2] = ids[3] = COMPACT_NONE;
+	for(c = 0; statement && c < 3; c++)
+	{
+		switch(c)
+		{
+		case 0:
+			node = librdf_statement_get_subject(statement);
+			break;
+		case 1:
+			node = librdf_statement_get_predicate(statement);
+			break;
+		default:
+			node = librdf_statement_get_object(statement);
+			break;
+		}
+		if(node && (ids[c] = compact_intern_(cs, node, 0)) == COMPACT_NONE)
+		{
+			return -1;
+		}
+	}
+	if(context && cs->contexts && (ids[3] = compact_intern_(cs, context, 0)) == COMPACT_NONE)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/* Create a stream over the quads matching a pattern */
+static librdf_stream *
+compact_stream_(struct compact_struct *cs, uint32_t s, uint32_t p, uint32_t o, uint32_t g)
+{
+	struct compact_stream_struct *stream;
+	struct compact_index_struct *idx;
+	librdf_stream *result;
+	uint32_t id;
+
+	stream = (struct compact_stream_struct *) calloc(1, sizeof(struct compact_stream_struct));
+	if(!stream)
+	{
+		twine_logf(LOG_CRIT, "failed to allocate memory for compact storage stream\n");
+		return NULL;
+	}
+	stream->cs = cs;
+	stream->s = s;
+	stream->p = p;
+	stream->o = o;
+	stream->g = g;
+	stream->end = cs->nquads;
+	idx = NULL;
+	id = COMPACT_NONE;
+	if(s != COMPACT_NONE && !compact_index_(cs, &(cs->sindex), cs->s))
+	{
+		/* Only visit the quads with the requested subject */
+		idx = &(cs->sindex);
+		id = s;
+	}
+	else if(g != COMPACT_NONE && !compact_index_(cs, &(cs->gindex), cs->g))
+	{
+		/* Only visit the quads in the requested context */
+		idx = &(cs->gindex);
+		id = g;
+	}
+	if(idx)
+	{
+		/* The range is copied because the index may be rebuilt if
+		 * statements are added while the stream is in use
+		 */
+		stream->end = idx->start[id + 1] - idx->start[id];
+		stream->index = (size_t *) malloc((stream->end ? stream->end : 1) * sizeof(size_t));
+		if(!stream->index)
+		{
+			twine_logf(LOG_CRIT, "failed to allocate memory for compact storage stream\n");
+			free(stream);
+			return NULL;
+		}
+		memcpy(stream->index, &(idx->index[idx->start[id]]), stream->end * sizeof(size_t));
+	}
+	compact_stream_advance_(stream);
+	compact_ref_(cs->storage);
+	result = librdf_new_stream(cs->world, stream, compact_stream_end_, compact_stream_next_, compact_stream_get_, compact_stream_finished_);
+	if(!result)
+	{
+		compact_stream_finished_(stream);
+	}
+	return result;
+}
+
+static int
+compact_stream_match_(struct compact_stream_struct *stream, size_t idx)
+{
+	struct compact_struct *cs;
+
+	cs = stream->cs;
+	if(cs->s[idx] == COMPACT_NONE)
+	{
+		return 0;
+	}
+	if((stream->s != COMPACT_NONE && cs->s[idx] != stream->s) ||
+	   (stream->p != COMPACT_NONE && cs->p[idx] != stream->p) ||
+	   (stream->o != COMPACT_NONE && cs->o[idx] != stream->o) ||
+	   (stream->g != COMPACT_NONE && cs->g[idx] != stream->g))
+	{
+		return 0;
+	}
+	return 1;
+}
+
+/* Move to the next matching quad at or after the current position */
+static void
+compact_stream_advance_(struct compact_stream_struct *stream)
+{
+	while(stream->pos < stream->end &&
+		  !compact_stream_match_(stream, stream->index ? stream->index[stream->pos] : stream->pos))
+	{
+		stream->pos++;
+	}
+}
+
+static int
+compact_stream_end_(void *context)
+{
+	struct compact_stream_struct *stream;
+
+	stream = (struct compact_stream_struct *) context;
+	return stream->pos >= stream->end;
+}
+
+static int
+compact_stream_next_(void *context)
+{
+	struct compact_stream_struct *stream;
+
+	stream = (struct compact_stream_struct *) context;
+	if(stream->statement)
+	{
+		librdf_free_statement(stream->statement);
+		stream->statement = NULL;
+	}
+	if(stream->context)
+	{
+		librdf_free_node(stream->context);
+		stream->context = NULL;
+	}
+	if(stream->pos < stream->end)
+	{
+		stream->pos++;
+		compact_stream_advance_(stream);
+	}
+	return stream->pos >= stream->end;
+}
+
+static void *
+compact_stream_get_(void *context, int flags)
+{
+	struct compact_stream_struct *stream;
+	struct compact_struct *cs;
+	librdf_node *s, *p, *o;
+	size_t idx;
+
+	stream = (struct compact_stream_struct *) context;
+	cs = stream->cs;
+	if(stream->pos >= stream->end)
+	{
+		return NULL;
+	}
+	idx = (stream->index ? stream->index[stream->pos] : stream->pos);
+	switch(flags)
+	{
+	case LIBRDF_STREAM_GET_METHOD_GET_OBJECT:
+		if(!stream->statement)
+		{
+			s = compact_node_(cs, cs->s[idx]);
+			p = compact_node_(cs, cs->p[idx]);
+			o = compact_node_(cs, cs->o[idx]);
+			if(!s || !p || !o)
+			{
+				librdf_free_node(s);
+				librdf_free_node(p);
+				librdf_free_node(o);
+				return NULL;
+			}
+			stream->statement = librdf_new_statement_from_nodes(cs->world, s, p, o);
+		}
+		return stream->statement;
+	case LIBRDF_STREAM_GET_METHOD_GET_CONTEXT:
+		if(!stream->context && cs->g)
+		{
+			stream->context = compact_node_(cs, cs->g[idx]);
+		}
+		return stream->context;
+	}
+	return NULL;
+}
+
+static void
+compact_stream_finished_(void *context)
+{
+	struct compact_stream_struct *stream;
+
+	stream = (struct compact_stream_struct *) context;
+	if(stream->statement)
+	{
+		librdf_free_statement(stream->statement);
+	}
+	if(stream->context)
+	{
+		librdf_free_node(stream->context);
+	}
+	compact_unref_(stream->cs->storage);
+	free(stream->index);
+	free(stream);
+}
+
+static int
+compact_iterator_end_(void *context)
+{
+	struct compact_iterator_struct *it;
+
+	it = (struct compact_iterator_struct *) context;
+	return it->pos >= it->nids;
+}
+
+static int
+compact_iterator_next_(void *context)
+{
+	struct compact_iterator_struct *it;
+
+	it = (struct compact_iterator_struct *) context;
+	if(it->node)
+	{
+		librdf_free_node(it->node);
+		it->node = NULL;
+	}
+	if(it->pos < it->nids)
+	{
+		it->pos++;
+	}
+	return it->pos >= it->nids;
+}
+
+static void *
+compact_iterator_get_(void *context, int flags)
+{
+	struct compact_iterator_struct *it;
+
+	it = (struct compact_iterator_struct *) context;
+	if(it->pos >= it->nids || flags != LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT)
+	{
+		return NULL;
+	}
+	if(!it->node)
+	{
+		it->node = compact_node_(it->cs, it->ids[it->pos]);
+	}
+	return it->node;
+}
+
+static void
+compact_iterator_finished_(void *context)
+{
+	struct compact_iterator_struct *it;
+
+	it = (struct compact_iterator_struct *) context;
+	if(it->node)
+	{
+		librdf_free_node(it->node);
+	}
+	compact_unref_(it->cs->storage);
+	free(it->ids);
+	free(it);
+}
+
+/* Take a reference to a storage instance on behalf of a stream or
+ * iterator, which may be being created by one of several threads reading
+ * the same instance
+ */
+static void
+compact_ref_(librdf_storage *storage)
+{
+	pthread_mutex_lock(&compact_ref_lock_);
+	librdf_storage_add_reference(storage);
+	pthread_mutex_unlock(&compact_ref_lock_);
+}
+
+/* Release a reference taken by compact_ref_() */
+static void
+compact_unref_(librdf_storage *storage)
+{
+	pthread_mutex_lock(&compact_ref_lock_);
+	librdf_storage_remove_reference(storage);
+	pthread_mutex_unlock(&compact_ref_lock_);
+}
@@ -0,0 +1,496 @@
+/* Twine: Streaming graph processing
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libtwine.h"
+
+/* A stream delivers the statements of a single graph, in batches, to a run
+ * of consecutive streaming processors: each batch is passed to every stage
+ * in turn before the next is collected, so that only a batch's worth of
+ * statements need be held in memory at once. Statements which survive
+ * every stage can optionally be added to a model, which is how the graph
+ * is materialised when a later stage needs it.
+ */
+struct twine_stream_struct
+{
+	TWINE *context;
+	TWINEGRAPH *graph;
+	struct twine_callback_struct **stages;
+	CLUSTERJOB **jobs;
+	size_t nstages;
+	/* The number of stages whose begin callbacks have been invoked */
+	size_t begun;
+	/* The index of the stage which failed, or -1 */
+	ssize_t failed;
+	/* The model to which surviving statements are added, if any */
+	librdf_model *model;
+	librdf_node *ctx;
+	/* The current batch, and the copy of it passed to each stage */
+	librdf_statement **st;
+	librdf_node **stctx;
+	librdf_statement **pass;
+	size_t count;
+	size_t size;
+	/* The number of statements added to the stream, and their approximate
+	 * size in memory
+	 */
+	size_t total;
+	size_t bytes;
+	/* When streaming an existing model, the statements which were
+	 * removed by a stage, and must be removed from the model afterwards
+	 */
+	int recording;
+	librdf_statement **removed;
+	librdf_node **removedctx;
+	size_t nremoved;
+	size_t removedsize;
+};
+
+static int twine_stream_flush_(TWINESTREAM *stream);
+static int twine_stream_remove_(TWINESTREAM *stream, librdf_statement *statement, librdf_node *ctx);
+static void twine_stream_clear_(TWINESTREAM *stream);
+
+/* Internal API: create a stream which will deliver statements to the given
+ * streaming processor callbacks, invoking each with the corresponding job
+ */
+TWINESTREAM *
+twine_stream_create_(TWINE *context, TWINEGRAPH *graph, struct twine_callback_struct **stages, CLUSTERJOB **jobs, size_t nstages)
+{
+	TWINESTREAM *p;
+
+	p = (TWINESTREAM *) calloc(1, sizeof(TWINESTREAM));
+	if(!p)
+	{
+		twine_logf(LOG_CRIT, "failed to allocate memory for statement stream\n");
+		return NULL;
+	}
+	p->context = context;
+	p->graph = graph;
+	p->stages = stages;
+	p->jobs = jobs;
+	p->nstages = nstages;
+	p->failed = -1;
+	p->size = context->stream_batch_size ? context->stream_batch_size : 1;
+	p->st = (librdf_statement **) calloc(p->size, sizeof(librdf_statement *));
+	p->stctx = (librdf_node **) calloc(p->size, sizeof(librdf_node *));
+	p->pass = (librdf_statement **) calloc(p->size, sizeof(librdf_statement *));
+	if(!p->st || !p->stctx || !p->pass)
+	{
+		twine_logf(LOG_CRIT, "failed to allocate memory for statement stream batch of %u statements\n", (unsigned) p->size);
+		twine_stream_destroy_(p);
+		return NULL;
+	}
+	return p;
+}
+
+/* Internal API: destroy a stream */
+int
+twine_stream_destroy_(TWINESTREAM *stream)
+{
+	size_t c;
+
+	twine_stream_clear_(stream);
+	for(c = 0; c < stream->nremoved; c++)
+	{
+		librdf_free_statement(stream->removed[c]);
+		if(stream->removedctx[c])
+		{
+			librdf_free_node(stream->removedctx[c]);
+		}
+	}
+	free(stream->removed);
+	free(stream->removedctx);
+	free(stream->st);
+	free(stream->stctx);
+	free(stream->pass);
+	free(stream);
+	return 0;
+}
+
+/* Internal API: add statements which survive every stage to a model, using
+ * ctx as the context of any which don't have their own
+ */
+int
+twine_stream_materialise_(TWINESTREAM *stream, librdf_model *model, librdf_node *ctx)
+{
+	stream->model = model;
+	stream->ctx = ctx;
+	return 0;
+}
+
+/* Internal API: invoke the begin callbacks of each stage */
+int
+twine_stream_begin_(TWINESTREAM *stream)
+{
+	struct twine_callback_struct *cb;
+	void *prev;
+	CLUSTERJOB *job;
+	int r;
+
+	prev = stream->context->plugin_current;
+	job = stream->graph->job;
+	r = 0;
+	for(stream->begun = 0; stream->begun < stream->nstages; stream->begun++)
+	{
+		cb = stream->stages[stream->begun];
+		if(!cb->m.stream.begin)
+		{
+			continue;
+		}
+		stream->context->plugin_current = cb->module;
+		stream->graph->job = stream->jobs[stream->begun];
+		if(cb->m.stream.begin(stream->context, stream->graph, cb->data))
+		{
+			cluster_job_logf(stream->graph->job, LOG_ERR, "streaming processor '%s' failed to begin processing\n", cb->m.stream.name);
+			stream->failed = stream->begun;
+			r = -1;
+			break;
+		}
+	}
+	stream->context->plugin_current = prev;
+	stream->graph->job = job;
+	return r;
+}
+
+/* Internal API: add a copy of a statement to the current batch, passing the
+ * batch along the stream once it's full
+ */
+int
+twine_stream_add_(TWINESTREAM *stream, librdf_statement *statement, librdf_node *ctx)
+{
+	librdf_node *s, *p, *o;
+
+	if(stream->failed >= 0)
+	{
+		return -1;
+	}
+	if(stream->count == stream->size && twine_stream_flush_(stream))
+	{
+		return -1;
+	}
+	stream->total++;
+	stream->bytes += twine_rdf_st_usage_(statement);
+	if(stream->context->max_graph_triples && stream->total > stream->context->max_graph_triples)
+	{
+		cluster_job_logf(stream->graph->job, LOG_ERR, "graph <%s> has more than %lu triples, exceeding the limit\n", stream->graph->uri, (unsigned long) stream->context->max_graph_triples);
+		return -1;
+	}
+	if(stream->context->max_graph_bytes && stream->bytes > stream->context->max_graph_bytes)
+	{
+		cluster_job_logf(stream->graph->job, LOG_ERR, "graph <%s> is using more than %lu bytes, exceeding the limit\n", stream->graph->uri, (unsigned long) stream->context->max_graph_bytes);
+		return -1;
+	}
+	/* Statements supplied by parsers and storage streams may be re-used
+	 * once we return, so the batch holds copies made from their nodes
+	 * (which are reference-counted)
+	 */
+	s = librdf_new_node_from_node(librdf_statement_get_subject(statement));
+	p = librdf_new_node_from_node(librdf_statement_get_predicate(statement));
+	o = librdf_new_node_from_node(librdf_statement_get_object(statement));
+	if(!s || !p || !o)
+	{
+		twine_logf(LOG_CRIT, "failed to duplicate statement nodes for stream\n");
+		if(s)
+		{
+			librdf_free_node(s);
+		}
+		if(p)
+		{
+			librdf_free_node(p);
+		}
+		if(o)
+		{
+			librdf_free_node(o);
+		}
+		return -1;
+	}
+	stream->st[stream->count] = librdf_new_statement_from_nodes(stream->context->world, s, p, o);
+	if(!stream->st[stream->count])
+	{
+		twine_logf(LOG_CRIT, "failed to duplicate statement for stream\n");
+		return -1;
+	}
+	stream->stctx[stream->count] = (ctx ? librdf_new_node_from_node(ctx) : NULL);
+	stream->count++;
+	return 0;
+}
+
+/* Internal API: pass the statements of an existing model along the stream;
+ * any which are removed by a stage are removed from the model afterwards
+ */
+int
+twine_stream_model_(TWINESTREAM *stream, librdf_model *model)
+{
+	librdf_stream *st;
+	size_t c;
+	int r;
+
+	st = librdf_model_as_stream(model);
+	if(!st)
+	{
+		twine_logf(LOG_ERR, "failed to obtain stream for model\n");
+		return -1;
+	}
+	stream->recording = 1;
+	r = 0;
+	while(!librdf_stream_end(st))
+	{
+		if(twine_stream_add_(stream, librdf_stream_get_object(st), librdf_stream_get_context2(st)))
+		{
+			r = -1;
+			break;
+		}
+		librdf_stream_next(st);
+	}
+	librdf_free_stream(st);
+	if(!r && stream->count)
+	{
+		r = twine_stream_flush_(stream);
+	}
+	stream->recording = 0;
+	if(r)
+	{
+		return -1;
+	}
+	/* The model can't be modified while it's being streamed, so removals
+	 * are deferred until now
+	 */
+	for(c = 0; c < stream->nremoved; c++)
+	{
+		if(stream->removedctx[c])
+		{
+			librdf_model_context_remove_statement(model, stream->removedctx[c], stream->removed[c]);
+		}
+		else
+		{
+			librdf_model_remove_statement(model, stream->removed[c]);
+		}
+	}
+	return 0;
+}
+
+/* Internal API: deliver any remaining statements and invoke the end
+ * callbacks of each stage which was begun; status should be nonzero if
+ * the stream is being abandoned
+ */
+int
+twine_stream_end_(TWINESTREAM *stream, int status)
+{
+	struct twine_callback_struct *cb;
+	void *prev;
+	CLUSTERJOB *job;
+	size_t c;
+	int r;
+
+	r = 0;
+	if(!status && stream->failed < 0 && stream->count)
+	{
+		r = twine_stream_flush_(stream);
+	}
+	if(status || stream->failed >= 0)
+	{
+		r = -1;
+	}
+	twine_stream_clear_(stream);
+	prev = stream->context->plugin_current;
+	job = stream->graph->job;
+	for(c = 0; c < stream->begun; c++)
+	{
+		cb = stream->stages[c];
+		if(!cb->m.stream.end)
+		{
+			continue;
+		}
+		stream->context->plugin_current = cb->module;
+		stream->graph->job = stream->jobs[c];
+		if(cb->m.stream.end(stream->context, stream->graph, r, cb->data) && !r)
+		{
+			cluster_job_logf(stream->graph->job, LOG_ERR, "streaming processor '%s' failed to complete processing\n", cb->m.stream.name);
+			stream->failed = c;
+			r = -1;
+		}
+	}
+	stream->begun = 0;
+	stream->context->plugin_current = prev;
+	stream->graph->job = job;
+	return r;
+}
+
+/* Internal API: obtain the number of statements which have been added to a
+ * stream, and their approximate size
+ */
+int
+twine_stream_usage_(TWINESTREAM *stream, size_t *triples, size_t *bytes)
+{
+	*triples = stream->total;
+	*bytes = stream->bytes;
+	return 0;
+}
+
+/* Internal API: return the index of the stage which failed, or -1 */
+ssize_t
+twine_stream_failed_(TWINESTREAM *stream)
+{
+	return stream->failed;
+}
+
+/* Private: pass the current batch to each stage in turn */
+static int
+twine_stream_flush_(TWINESTREAM *stream)
+{
+	struct twine_callback_struct *cb;
+	void *prev;
+	CLUSTERJOB *job;
+	size_t c, i, n;
+	int r;
+
+	prev = stream->context->plugin_current;
+	job = stream->graph->job;
+	r = 0;
+	for(c = 0; c < stream->nstages && stream->count; c++)
+	{
+		cb = stream->stages[c];
+		if(twine_cancelled(stream->context))
+		{
+			cluster_job_logf(stream->jobs[c], LOG_ERR, "streaming processor '%s' was cancelled because it ran out of time\n", cb->m.stream.name);
+			stream->failed = c;
+			r = -1;
+			break;
+		}
+		stream->context->plugin_current = cb->module;
+		stream->graph->job = stream->jobs[c];
+		/* The stage is passed a copy of the array so that we still know
+		 * which statements it removed
+		 */
+		memcpy(stream->pass, stream->st, sizeof(librdf_statement *) * stream->count);
+		if(cb->m.stream.batch(stream->context, stream->graph, stream->pass, stream->count, cb->data))
+		{
+			cluster_job_logf(stream->graph->job, LOG_ERR, "streaming processor '%s' failed\n", cb->m.stream.name);
+			stream->failed = c;
+			r = -1;
+			break;
+		}
+		/* Compact the batch, dropping any statements which were removed */
+		for(i = 0, n = 0; i < stream->count; i++)
+		{
+			if(stream->pass[i])
+			{
+				stream->st[n] = stream->st[i];
+				stream->stctx[n] = stream->stctx[i];
+				n++;
+			}
+			else if(twine_stream_remove_(stream, stream->st[i], stream->stctx[i]))
+			{
+				stream->failed = c;
+				r = -1;
+			}
+		}
+		stream->count = n;
+		if(r)
+		{
+			break;
+		}
+	}
+	stream->context->plugin_current = prev;
+	stream->graph->job = job;
+	if(!r && stream->model)
+	{
+		for(i = 0; i < stream->count; i++)
+		{
+			if(librdf_model_context_add_statement(stream->model, stream->stctx[i] ? stream->stctx[i] : stream->ctx, stream->st[i]))
+			{
+				twine_logf(LOG_ERR, "failed to add streamed statement to model\n");
+				r = -1;
+				break;
+			}
+		}
+	}
+	twine_stream_clear_(stream);
+	return r;
+}
+
+/* Private: dispose of a statement which was removed by a stage, recording
+ * it if it must later be removed from the model being streamed
+ */
+static int
+twine_stream_remove_(TWINESTREAM *stream, librdf_statement *statement, librdf_node *ctx)
+{
+	librdf_statement **st;
+	librdf_node **stctx;
+	size_t n;
+
+	if(stream->recording)
+	{
+		if(stream->nremoved == stream->removedsize)
+		{
+			n = (stream->removedsize ? stream->removedsize * 2 : 64);
+			st = (librdf_statement **) realloc(stream->removed, sizeof(librdf_statement *) * n);
+			if(st)
+			{
+				stream->removed = st;
+			}
+			stctx = (librdf_node **) realloc(stream->removedctx, sizeof(librdf_node *) * n);
+			if(stctx)
+			{
+				stream->removedctx = stctx;
+			}
+			if(!st || !stctx)
+			{
+				twine_logf(LOG_CRIT, "failed to expand list of statements removed from stream\n");
+				librdf_free_statement(statement);
+				if(ctx)
+				{
+					librdf_free_node(ctx);
+				}
+				return -1;
+			}
+			stream->removedsize = n;
+		}
+		stream->removed[stream->nremoved] = statement;
+		stream->removedctx[stream->nremoved] = ctx;
+		stream->nremoved++;
+		return 0;
+	}
+	librdf_free_statement(statement);
+	if(ctx)
+	{
+		librdf_free_node(ctx);
+	}
+	return 0;
+}
+
+/* Private: release the statements in the current batch */
+static void
+twine_stream_clear_(TWINESTREAM *stream)
+{
+	size_t c;
+
+	for(c = 0; c < stream->count; c++)
+	{
+		librdf_free_statement(stream->st[c]);
+		if(stream->stctx[c])
+		{
+			librdf_free_node(stream->stctx[c]);
+		}
+	}
+	stream->count = 0;
+}
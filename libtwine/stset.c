@@ -0,0 +1,193 @@
+/* Twine: hashed statement sets
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libtwine.h"
+
+/* A statement set records the hashes of the statements which have been added
+ * to it in an open-addressed table. Because only hashes are stored, a hit
+ * means that the statement is *probably* present and the caller must
+ * confirm it if an exact answer is needed; a miss is always definitive.
+ */
+
+#define STSET_MIN_SIZE                  64
+
+struct twine_stset_struct
+{
+	unsigned long *hashes;
+	size_t size;
+	size_t count;
+};
+
+static int twine_stset_grow_(TWINESTSET *set);
+
+/* Private: create a new statement set, sized for approximately hint
+ * statements
+ */
+TWINESTSET *
+twine_stset_create_(size_t hint)
+{
+	TWINESTSET *set;
+
+	set = (TWINESTSET *) calloc(1, sizeof(TWINESTSET));
+	if(!set)
+	{
+		twine_logf(LOG_CRIT, "failed to allocate memory for statement set\n");
+		return NULL;
+	}
+	set->size = STSET_MIN_SIZE;
+	while(set->size < hint * 2)
+	{
+		set->size *= 2;
+	}
+	set->hashes = (unsigned long *) calloc(set->size, sizeof(unsigned long));
+	if(!set->hashes)
+	{
+		twine_logf(LOG_CRIT, "failed to allocate memory for statement set\n");
+		free(set);
+		return NULL;
+	}
+	return set;
+}
+
+/* Private: destroy a statement set */
+void
+twine_stset_destroy_(TWINESTSET *set)
+{
+	if(set)
+	{
+		free(set->hashes);
+		free(set);
+	}
+}
+
+/* Private: add a statement to a set; returns 1 if it was added, 0 if a
+ * statement with the same hash was already present, or -1 on error
+ */
+int
+twine_stset_add_(TWINESTSET *set, librdf_statement *statement)
+{
+	unsigned long hash;
+	size_t c;
+
+	if(set->count * 2 >= set->size && twine_stset_grow_(set))
+	{
+		return -1;
+	}
+	hash = twine_rdf_st_hash_(statement);
+	for(c = hash & (set->size - 1); set->hashes[c]; c = (c + 1) & (set->size - 1))
+	{
+		if(set->hashes[c] == hash)
+		{
+			return 0;
+		}
+	}
+	set->hashes[c] = hash;
+	set->count++;
+	return 1;
+}
+
+/* Private: hash the subject, predicate and object of a statement; the
+ * result is never zero
+ */
+unsigned long
+twine_rdf_st_hash_(librdf_statement *statement)
+{
+	unsigned long hash;
+
+	hash = twine_rdf_node_hash_(librdf_statement_get_subject(statement), 0);
+	hash = twine_rdf_node_hash_(librdf_statement_get_predicate(statement), hash);
+	hash = twine_rdf_node_hash_(librdf_statement_get_object(statement), hash);
+	return hash ? hash : 1;
+}
+
+/* Private: hash a node (which may be NULL), continuing from a previous
+ * hash value
+ */
+unsigned long
+twine_rdf_node_hash_(librdf_node *node, unsigned long hash)
+{
+	const char *str;
+	size_t len;
+	librdf_uri *uri;
+
+	if(!node)
+	{
+		return twine_rdf_hash_("-", 1, hash);
+	}
+	if(librdf_node_is_resource(node))
+	{
+		str = (const char *) librdf_uri_as_counted_string(librdf_node_get_uri(node), &len);
+		hash = twine_rdf_hash_("<", 1, hash);
+		return twine_rdf_hash_(str, len, hash);
+	}
+	if(librdf_node_is_blank(node))
+	{
+		str = (const char *) librdf_node_get_blank_identifier(node);
+		hash = twine_rdf_hash_("_", 1, hash);
+		return twine_rdf_hash_(str, strlen(str), hash);
+	}
+	str = (const char *) librdf_node_get_literal_value_as_counted_string(node, &len);
+	hash = twine_rdf_hash_("\"", 1, hash);
+	hash = twine_rdf_hash_(str, len, hash);
+	if((uri = librdf_node_get_literal_value_datatype_uri(node)))
+	{
+		str = (const char *) librdf_uri_as_counted_string(uri, &len);
+		hash = twine_rdf_hash_("^", 1, hash);
+		hash = twine_rdf_hash_(str, len, hash);
+	}
+	else if((str = librdf_node_get_literal_value_language(node)))
+	{
+		hash = twine_rdf_hash_("@", 1, hash);
+		hash = twine_rdf_hash_(str, strlen(str), hash);
+	}
+	return hash;
+}
+
+/* Double the size of a set's table and re-insert its hashes */
+static int
+twine_stset_grow_(TWINESTSET *set)
+{
+	unsigned long *hashes;
+	size_t size, c, d;
+
+	size = set->size * 2;
+	hashes = (unsigned long *) calloc(size, sizeof(unsigned long));
+	if(!hashes)
+	{
+		twine_logf(LOG_CRIT, "failed to allocate memory for statement set\n");
+		return -1;
+	}
+	for(c = 0; c < set->size; c++)
+	{
+		if(!set->hashes[c])
+		{
+			continue;
+		}
+		for(d = set->hashes[c] & (size - 1); hashes[d]; d = (d + 1) & (size - 1));
+		hashes[d] = set->hashes[c];
+	}
+	free(set->hashes);
+	set->hashes = hashes;
+	set->size = size;
+	return 0;
+}
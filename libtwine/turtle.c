@@ -0,0 +1,654 @@
+/* Twine: Turtle serialisation
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libtwine.h"
+
+/* This is a deliberately simple Turtle writer: unlike the raptor 'turtle'
+ * serialiser, it performs no nesting of blank nodes and no abbreviation
+ * beyond prefixed names and subject/predicate grouping, which means it
+ * can write a graph in two linear passes (one to measure, one to write)
+ * after sorting the statements.
+ *
+ * Prefixes are derived automatically: every URI is split after its final
+ * '#' or '/', and any namespace which occurs more than once is assigned a
+ * prefix (a well-known one if there is one, otherwise nsN).
+ */
+
+#define TURTLE_NS_MIN_COUNT             2
+#define TURTLE_PREFIX_LEN               15
+
+#define NS_RDF                          "http://www.w3.org/1999/02/22-rdf-syntax-ns#"
+#define RDF_TYPE                        NS_RDF "type"
+
+struct turtle_ns_struct
+{
+	const char *uri;
+	size_t len;
+	unsigned long hash;
+	size_t count;
+	char prefix[TURTLE_PREFIX_LEN + 1];
+};
+
+struct turtle_st_struct
+{
+	librdf_statement *st;
+	int stype;
+	const char *skey;
+	const char *pkey;
+};
+
+struct turtle_struct
+{
+	struct turtle_st_struct *st;
+	size_t nst;
+	size_t stsize;
+	struct turtle_ns_struct *ns;
+	size_t nns;
+	size_t nssize;
+	unsigned nsgen;
+	size_t nprefix;
+	/* Output buffer, NULL when measuring */
+	char *buf;
+	size_t len;
+};
+
+static const struct
+{
+	const char *prefix;
+	const char *uri;
+} turtle_wellknown[] = {
+	{ "rdf", NS_RDF },
+	{ "rdfs", "http://www.w3.org/2000/01/rdf-schema#" },
+	{ "owl", "http://www.w3.org/2002/07/owl#" },
+	{ "xsd", "http://www.w3.org/2001/XMLSchema#" },
+	{ "dct", "http://purl.org/dc/terms/" },
+	{ "dc", "http://purl.org/dc/elements/1.1/" },
+	{ "foaf", "http://xmlns.com/foaf/0.1/" },
+	{ "skos", "http://www.w3.org/2004/02/skos/core#" },
+	{ "geo", "http://www.w3.org/2003/01/geo/wgs84_pos#" },
+	{ "schema", "http://schema.org/" },
+	{ "void", "http://rdfs.org/ns/void#" },
+	{ NULL, NULL }
+};
+
+static int turtle_init_(struct turtle_struct *t);
+static void turtle_done_(struct turtle_struct *t);
+static int turtle_add_(struct turtle_struct *t, librdf_statement *statement);
+static int turtle_ns_count_(struct turtle_struct *t, librdf_node *node);
+static int turtle_ns_count_uri_(struct turtle_struct *t, librdf_uri *uri);
+static struct turtle_ns_struct *turtle_ns_find_(struct turtle_struct *t, const char *uri, size_t len, unsigned long hash);
+static int turtle_ns_grow_(struct turtle_struct *t);
+static void turtle_ns_assign_(struct turtle_struct *t);
+static size_t turtle_ns_split_(const char *uri, size_t len);
+static int turtle_local_valid_(const char *local, size_t len);
+static int turtle_st_compare_(const void *a, const void *b);
+static char *turtle_write_(struct turtle_struct *t, size_t *buflen);
+static void turtle_emit_(struct turtle_struct *t);
+static void turtle_put_(struct turtle_struct *t, const char *str, size_t len);
+static void turtle_puts_(struct turtle_struct *t, const char *str);
+static void turtle_put_node_(struct turtle_struct *t, librdf_node *node);
+static void turtle_put_predicate_(struct turtle_struct *t, librdf_node *node);
+static void turtle_put_uri_(struct turtle_struct *t, librdf_uri *uri);
+static void turtle_put_escaped_(struct turtle_struct *t, const char *str, size_t len, int iri);
+
+/* Public: serialise a model to a string as Turtle - the result should be
+ * freed by librdf_free_memory()
+ */
+char *
+twine_rdf_model_turtle(librdf_model *model, size_t *buflen)
+{
+	librdf_stream *stream;
+	char *buf;
+
+	*buflen = 0;
+	stream = librdf_model_as_stream(model);
+	if(!stream)
+	{
+		twine_logf(LOG_ERR, "failed to obtain stream from model\n");
+		return NULL;
+	}
+	buf = twine_rdf_stream_turtle(stream, buflen);
+	librdf_free_stream(stream);
+	return buf;
+}
+
+/* Public: serialise a stream to a string as Turtle - the result should be
+ * freed by librdf_free_memory()
+ */
+char *
+twine_rdf_stream_turtle(librdf_stream *stream, size_t *buflen)
+{
+	struct turtle_struct t;
+	char *buf;
+
+	*buflen = 0;
+	if(turtle_init_(&t))
+	{
+		return NULL;
+	}
+	for(; !librdf_stream_end(stream); librdf_stream_next(stream))
+	{
+		if(turtle_add_(&t, librdf_stream_get_object(stream)))
+		{
+			turtle_done_(&t);
+			return NULL;
+		}
+	}
+	buf = turtle_write_(&t, buflen);
+	turtle_done_(&t);
+	return buf;
+}
+
+static int
+turtle_init_(struct turtle_struct *t)
+{
+	memset(t, 0, sizeof(struct turtle_struct));
+	return turtle_ns_grow_(t);
+}
+
+static void
+turtle_done_(struct turtle_struct *t)
+{
+	size_t c;
+
+	for(c = 0; c < t->nst; c++)
+	{
+		librdf_free_statement(t->st[c].st);
+	}
+	free(t->st);
+	free(t->ns);
+}
+
+/* Take a copy of a statement and account for the namespaces it uses */
+static int
+turtle_add_(struct turtle_struct *t, librdf_statement *statement)
+{
+	struct turtle_st_struct *p;
+	librdf_node *subject;
+
+	if(t->nst >= t->stsize)
+	{
+		p = (struct turtle_st_struct *) realloc(t->st, sizeof(struct turtle_st_struct) * (t->stsize ? t->stsize * 2 : 256));
+		if(!p)
+		{
+			twine_logf(LOG_CRIT, "failed to expand Turtle statement buffer\n");
+			return -1;
+		}
+		t->st = p;
+		t->stsize = t->stsize ? t->stsize * 2 : 256;
+	}
+	p = &(t->st[t->nst]);
+	p->st = librdf_new_statement_from_statement(statement);
+	if(!p->st)
+	{
+		twine_logf(LOG_CRIT, "failed to duplicate statement\n");
+		return -1;
+	}
+	t->nst++;
+	subject = librdf_statement_get_subject(p->st);
+	if(librdf_node_is_blank(subject))
+	{
+		p->stype = 1;
+		p->skey = (const char *) librdf_node_get_blank_identifier(subject);
+	}
+	else
+	{
+		p->stype = 0;
+		p->skey = (const char *) librdf_uri_as_string(librdf_node_get_uri(subject));
+	}
+	p->pkey = (const char *) librdf_uri_as_string(librdf_node_get_uri(librdf_statement_get_predicate(p->st)));
+	if(turtle_ns_count_(t, subject) ||
+	   turtle_ns_count_(t, librdf_statement_get_predicate(p->st)) ||
+	   turtle_ns_count_(t, librdf_statement_get_object(p->st)))
+	{
+		return -1;
+	}
+	return 0;
+}
+
+static int
+turtle_ns_count_(struct turtle_struct *t, librdf_node *node)
+{
+	librdf_uri *uri;
+
+	if(librdf_node_is_resource(node))
+	{
+		return turtle_ns_count_uri_(t, librdf_node_get_uri(node));
+	}
+	if(librdf_node_is_literal(node) &&
+	   (uri = librdf_node_get_literal_value_datatype_uri(node)))
+	{
+		return turtle_ns_count_uri_(t, uri);
+	}
+	return 0;
+}
+
+static int
+turtle_ns_count_uri_(struct turtle_struct *t, librdf_uri *uri)
+{
+	const char *str;
+	size_t len, nslen;
+	unsigned long hash;
+	struct turtle_ns_struct *ns;
+
+	str = (const char *) librdf_uri_as_counted_string(uri, &len);
+	nslen = turtle_ns_split_(str, len);
+	if(!nslen || !turtle_local_valid_(str + nslen, len - nslen))
+	{
+		return 0;
+	}
+	hash = twine_rdf_hash_(str, nslen, 0);
+	ns = turtle_ns_find_(t, str, nslen, hash);
+	if(ns->uri)
+	{
+		ns->count++;
+		return 0;
+	}
+	ns->uri = str;
+	ns->len = nslen;
+	ns->hash = hash;
+	ns->count = 1;
+	t->nns++;
+	if(t->nns * 2 >= t->nssize)
+	{
+		return turtle_ns_grow_(t);
+	}
+	return 0;
+}
+
+/* Locate the slot for a namespace in the (open-addressed) namespace table;
+ * the table is never more than half-full, so this always terminates
+ */
+static struct turtle_ns_struct *
+turtle_ns_find_(struct turtle_struct *t, const char *uri, size_t len, unsigned long hash)
+{
+	size_t c;
+	struct turtle_ns_struct *ns;
+
+	for(c = hash & (t->nssize - 1); ; c = (c + 1) & (t->nssize - 1))
+	{
+		ns = &(t->ns[c]);
+		if(!ns->uri)
+		{
+			return ns;
+		}
+		if(ns->hash == hash && ns->len == len && !memcmp(ns->uri, uri, len))
+		{
+			return ns;
+		}
+	}
+}
+
+static int
+turtle_ns_grow_(struct turtle_struct *t)
+{
+	struct turtle_ns_struct *old, *ns;
+	size_t oldsize, c;
+
+	old = t->ns;
+	oldsize = t->nssize;
+	t->nssize = oldsize ? oldsize * 2 : 64;
+	t->ns = (struct turtle_ns_struct *) calloc(t->nssize, sizeof(struct turtle_ns_struct));
+	if(!t->ns)
+	{
+		twine_logf(LOG_CRIT, "failed to allocate Turtle namespace table\n");
+		t->ns = old;
+		t->nssize = oldsize;
+		return -1;
+	}
+	for(c = 0; c < oldsize; c++)
+	{
+		if(old[c].uri)
+		{
+			ns = turtle_ns_find_(t, old[c].uri, old[c].len, old[c].hash);
+			*ns = old[c];
+		}
+	}
+	free(old);
+	return 0;
+}
+
+/* Assign prefixes to all of the namespaces used often enough to be worth
+ * declaring
+ */
+static void
+turtle_ns_assign_(struct turtle_struct *t)
+{
+	size_t c, n;
+	struct turtle_ns_struct *ns;
+
+	for(c = 0; c < t->nssize; c++)
+	{
+		ns = &(t->ns[c]);
+		if(!ns->uri || ns->count < TURTLE_NS_MIN_COUNT)
+		{
+			continue;
+		}
+		for(n = 0; turtle_wellknown[n].prefix; n++)
+		{
+			if(strlen(turtle_wellknown[n].uri) == ns->len &&
+			   !memcmp(turtle_wellknown[n].uri, ns->uri, ns->len))
+			{
+				strcpy(ns->prefix, turtle_wellknown[n].prefix);
+				break;
+			}
+		}
+		if(!ns->prefix[0])
+		{
+			snprintf(ns->prefix, sizeof(ns->prefix), "ns%u", t->nsgen);
+			t->nsgen++;
+		}
+		t->nprefix++;
+	}
+}
+
+/* Return the length of the namespace portion of a URI, or zero if it
+ * cannot be split
+ */
+static size_t
+turtle_ns_split_(const char *uri, size_t len)
+{
+	size_t c;
+
+	for(c = len; c > 0; c--)
+	{
+		if(uri[c - 1] == '#' || uri[c - 1] == '/')
+		{
+			return c;
+		}
+	}
+	return 0;
+}
+
+/* Determine whether a local name can be written as part of a prefixed name
+ * without escaping; this is a conservative subset of PN_LOCAL which is also
+ * valid in SPARQL
+ */
+static int
+turtle_local_valid_(const char *local, size_t len)
+{
+	size_t c;
+
+	for(c = 0; c < len; c++)
+	{
+		if(isalnum((unsigned char) local[c]) || local[c] == '_' ||
+		   (c && local[c] == '-'))
+		{
+			continue;
+		}
+		return 0;
+	}
+	return 1;
+}
+
+static int
+turtle_st_compare_(const void *a, const void *b)
+{
+	const struct turtle_st_struct *sa, *sb;
+	int r;
+
+	sa = (const struct turtle_st_struct *) a;
+	sb = (const struct turtle_st_struct *) b;
+	if(sa->stype != sb->stype)
+	{
+		return sa->stype - sb->stype;
+	}
+	r = strcmp(sa->skey, sb->skey);
+	if(r)
+	{
+		return r;
+	}
+	return strcmp(sa->pkey, sb->pkey);
+}
+
+/* Measure the serialised size, allocate a buffer and then write into it */
+static char *
+turtle_write_(struct turtle_struct *t, size_t *buflen)
+{
+	if(t->nst > 1)
+	{
+		qsort(t->st, t->nst, sizeof(struct turtle_st_struct), turtle_st_compare_);
+	}
+	turtle_ns_assign_(t);
+	t->buf = NULL;
+	t->len = 0;
+	turtle_emit_(t);
+	t->buf = (char *) librdf_alloc_memory(t->len + 1);
+	if(!t->buf)
+	{
+		twine_logf(LOG_CRIT, "failed to allocate %lu bytes for Turtle buffer\n", (unsigned long) t->len + 1);
+		return NULL;
+	}
+	*buflen = t->len;
+	t->len = 0;
+	turtle_emit_(t);
+	t->buf[t->len] = 0;
+	return t->buf;
+}
+
+static void
+turtle_emit_(struct turtle_struct *t)
+{
+	size_t c;
+	struct turtle_ns_struct *ns;
+	struct turtle_st_struct *prev, *st;
+
+	for(c = 0; c < t->nssize; c++)
+	{
+		ns = &(t->ns[c]);
+		if(!ns->prefix[0])
+		{
+			continue;
+		}
+		turtle_puts_(t, "@prefix ");
+		turtle_puts_(t, ns->prefix);
+		turtle_puts_(t, ": <");
+		turtle_put_escaped_(t, ns->uri, ns->len, 1);
+		turtle_puts_(t, "> .\n");
+	}
+	if(t->nprefix)
+	{
+		turtle_puts_(t, "\n");
+	}
+	prev = NULL;
+	for(c = 0; c < t->nst; c++)
+	{
+		st = &(t->st[c]);
+		if(prev && prev->stype == st->stype && !strcmp(prev->skey, st->skey))
+		{
+			if(!strcmp(prev->pkey, st->pkey))
+			{
+				turtle_puts_(t, " ,\n\t\t");
+			}
+			else
+			{
+				turtle_puts_(t, " ;\n\t");
+				turtle_put_predicate_(t, librdf_statement_get_predicate(st->st));
+				turtle_puts_(t, " ");
+			}
+		}
+		else
+		{
+			if(prev)
+			{
+				turtle_puts_(t, " .\n");
+			}
+			turtle_put_node_(t, librdf_statement_get_subject(st->st));
+			turtle_puts_(t, "\n\t");
+			turtle_put_predicate_(t, librdf_statement_get_predicate(st->st));
+			turtle_puts_(t, " ");
+		}
+		turtle_put_node_(t, librdf_statement_get_object(st->st));
+		prev = st;
+	}
+	if(prev)
+	{
+		turtle_puts_(t, " .\n");
+	}
+}
+
+static void
+turtle_put_(struct turtle_struct *t, const char *str, size_t len)
+{
+	if(t->buf)
+	{
+		memcpy(&(t->buf[t->len]), str, len);
+	}
+	t->len += len;
+}
+
+static void
+turtle_puts_(struct turtle_struct *t, const char *str)
+{
+	turtle_put_(t, str, strlen(str));
+}
+
+static void
+turtle_put_node_(struct turtle_struct *t, librdf_node *node)
+{
+	const char *str;
+	size_t len;
+	librdf_uri *dt;
+
+	if(librdf_node_is_resource(node))
+	{
+		turtle_put_uri_(t, librdf_node_get_uri(node));
+	}
+	else if(librdf_node_is_blank(node))
+	{
+		str = (const char *) librdf_node_get_counted_blank_identifier(node, &len);
+		turtle_puts_(t, "_:");
+		turtle_put_(t, str, len);
+	}
+	else if(librdf_node_is_literal(node))
+	{
+		str = (const char *) librdf_node_get_literal_value_as_counted_string(node, &len);
+		turtle_puts_(t, "\"");
+		turtle_put_escaped_(t, str, len, 0);
+		turtle_puts_(t, "\"");
+		if((dt = librdf_node_get_literal_value_datatype_uri(node)))
+		{
+			turtle_puts_(t, "^^");
+			turtle_put_uri_(t, dt);
+		}
+		else if((str = librdf_node_get_literal_value_language(node)) && *str)
+		{
+			turtle_puts_(t, "@");
+			turtle_puts_(t, str);
+		}
+	}
+}
+
+/* Write a predicate, using the 'a' keyword for rdf:type */
+static void
+turtle_put_predicate_(struct turtle_struct *t, librdf_node *node)
+{
+	const char *str;
+	size_t len;
+
+	str = (const char *) librdf_uri_as_counted_string(librdf_node_get_uri(node), &len);
+	if(len == sizeof(RDF_TYPE) - 1 && !memcmp(str, RDF_TYPE, len))
+	{
+		turtle_puts_(t, "a");
+		return;
+	}
+	turtle_put_node_(t, node);
+}
+
+static void
+turtle_put_uri_(struct turtle_struct *t, librdf_uri *uri)
+{
+	const char *str;
+	size_t len, nslen;
+	struct turtle_ns_struct *ns;
+
+	str = (const char *) librdf_uri_as_counted_string(uri, &len);
+	nslen = turtle_ns_split_(str, len);
+	if(nslen && turtle_local_valid_(str + nslen, len - nslen))
+	{
+		ns = turtle_ns_find_(t, str, nslen, twine_rdf_hash_(str, nslen, 0));
+		if(ns->prefix[0])
+		{
+			turtle_puts_(t, ns->prefix);
+			turtle_puts_(t, ":");
+			turtle_put_(t, str + nslen, len - nslen);
+			return;
+		}
+	}
+	turtle_puts_(t, "<");
+	turtle_put_escaped_(t, str, len, 1);
+	turtle_puts_(t, ">");
+}
+
+/* Write a string, escaping it as required for a string literal or for an
+ * IRI reference; runs of characters which don't require escaping are
+ * copied in one go
+ */
+static void
+turtle_put_escaped_(struct turtle_struct *t, const char *str, size_t len, int iri)
+{
+	size_t c, start;
+	unsigned char ch;
+	char esc[8];
+
+	for(c = start = 0; c < len; c++)
+	{
+		ch = (unsigned char) str[c];
+		if(iri)
+		{
+			if(ch > 0x20 && !strchr("<>\"{}|^`\\", ch))
+			{
+				continue;
+			}
+		}
+		else if(ch >= 0x20 && ch != '"' && ch != '\\')
+		{
+			continue;
+		}
+		turtle_put_(t, str + start, c - start);
+		start = c + 1;
+		switch(ch)
+		{
+		case '"':
+			turtle_puts_(t, iri ? "\\u0022" : "\\\"");
+			break;
+		case '\\':
+			turtle_puts_(t, iri ? "\\u005C" : "\\\\");
+			break;
+		case '\n':
+			turtle_puts_(t, iri ? "\\u000A" : "\\n");
+			break;
+		case '\r':
+			turtle_puts_(t, iri ? "\\u000D" : "\\r");
+			break;
+		case '\t':
+			turtle_puts_(t, iri ? "\\u0009" : "\\t");
+			break;
+		default:
+			snprintf(esc, sizeof(esc), "\\u%04X", (unsigned) ch);
+			turtle_puts_(t, esc);
+			break;
+		}
+	}
+	turtle_put_(t, str + start, c - start);
+}
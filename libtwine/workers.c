@@ -0,0 +1,184 @@
+/* Twine: Worker thread pool
+ *
+ * Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2014-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libtwine.h"
+
+/* The pool runs one set of tasks at a time: the thread which submits them
+ * claims tasks alongside the workers, and then waits for any which are
+ * still running to finish.
+ */
+struct twine_workers_struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	pthread_cond_t done;
+	pthread_t *threads;
+	size_t nthreads;
+	TWINEWORKERTASK *tasks;
+	size_t ntasks;
+	size_t next;
+	size_t pending;
+	int shutdown;
+};
+
+static void *twine_workers_thread_(void *arg);
+static int twine_workers_claim_(TWINEWORKERS *workers);
+
+/* Private: create a pool of worker threads */
+TWINEWORKERS *
+twine_workers_create_(size_t nthreads)
+{
+	TWINEWORKERS *p;
+
+	p = (TWINEWORKERS *) calloc(1, sizeof(TWINEWORKERS));
+	if(!p)
+	{
+		twine_logf(LOG_CRIT, "failed to allocate memory for worker pool\n");
+		return NULL;
+	}
+	p->threads = (pthread_t *) calloc(nthreads, sizeof(pthread_t));
+	if(!p->threads)
+	{
+		twine_logf(LOG_CRIT, "failed to allocate memory for worker threads\n");
+		free(p);
+		return NULL;
+	}
+	pthread_mutex_init(&(p->lock), NULL);
+	pthread_cond_init(&(p->ready), NULL);
+	pthread_cond_init(&(p->done), NULL);
+	for(p->nthreads = 0; p->nthreads < nthreads; p->nthreads++)
+	{
+		if(pthread_create(&(p->threads[p->nthreads]), NULL, twine_workers_thread_, p))
+		{
+			twine_logf(LOG_ERR, "failed to create worker thread: %s\n", strerror(errno));
+			break;
+		}
+	}
+	if(!p->nthreads)
+	{
+		twine_workers_destroy_(p);
+		return NULL;
+	}
+	twine_logf(LOG_DEBUG, "started %lu worker threads\n", (unsigned long) p->nthreads);
+	return p;
+}
+
+/* Private: stop the threads in a worker pool and free it */
+int
+twine_workers_destroy_(TWINEWORKERS *workers)
+{
+	size_t c;
+
+	pthread_mutex_lock(&(workers->lock));
+	workers->shutdown = 1;
+	pthread_cond_broadcast(&(workers->ready));
+	pthread_mutex_unlock(&(workers->lock));
+	for(c = 0; c < workers->nthreads; c++)
+	{
+		pthread_join(workers->threads[c], NULL);
+	}
+	pthread_cond_destroy(&(workers->done));
+	pthread_cond_destroy(&(workers->ready));
+	pthread_mutex_destroy(&(workers->lock));
+	free(workers->threads);
+	free(workers);
+	return 0;
+}
+
+/* Private: run a set of tasks to completion, using the calling thread as
+ * well as the pool's workers; each task's result is stored in the task
+ */
+int
+twine_workers_run_(TWINEWORKERS *workers, TWINEWORKERTASK *tasks, size_t ntasks)
+{
+	pthread_mutex_lock(&(workers->lock));
+	workers->tasks = tasks;
+	workers->ntasks = ntasks;
+	workers->next = 0;
+	workers->pending = ntasks;
+	pthread_cond_broadcast(&(workers->ready));
+	pthread_mutex_unlock(&(workers->lock));
+	while(!twine_workers_claim_(workers)) { }
+	pthread_mutex_lock(&(workers->lock));
+	while(workers->pending)
+	{
+		pthread_cond_wait(&(workers->done), &(workers->lock));
+	}
+	workers->tasks = NULL;
+	workers->ntasks = 0;
+	workers->next = 0;
+	pthread_mutex_unlock(&(workers->lock));
+	return 0;
+}
+
+/* Claim and run the next task, if any; returns nonzero once all of the
+ * tasks have been claimed
+ */
+static int
+twine_workers_claim_(TWINEWORKERS *workers)
+{
+	TWINEWORKERTASK *task;
+
+	pthread_mutex_lock(&(workers->lock));
+	if(workers->next >= workers->ntasks)
+	{
+		pthread_mutex_unlock(&(workers->lock));
+		return 1;
+	}
+	task = &(workers->tasks[workers->next]);
+	workers->next++;
+	pthread_mutex_unlock(&(workers->lock));
+	task->result = task->fn(task->data);
+	pthread_mutex_lock(&(workers->lock));
+	workers->pending--;
+	if(!workers->pending)
+	{
+		pthread_cond_signal(&(workers->done));
+	}
+	pthread_mutex_unlock(&(workers->lock));
+	return 0;
+}
+
+static void *
+twine_workers_thread_(void *arg)
+{
+	TWINEWORKERS *workers;
+
+	workers = (TWINEWORKERS *) arg;
+	for(;;)
+	{
+		pthread_mutex_lock(&(workers->lock));
+		while(!workers->shutdown && workers->next >= workers->ntasks)
+		{
+			pthread_cond_wait(&(workers->ready), &(workers->lock));
+		}
+		if(workers->shutdown)
+		{
+			pthread_mutex_unlock(&(workers->lock));
+			break;
+		}
+		pthread_mutex_unlock(&(workers->lock));
+		twine_workers_claim_(workers);
+	}
+	return NULL;
+}
@@ -23,9 +23,112 @@
 
 #include "p_libtwine.h"
 
-static int twine_workflow_parse_(TWINE *context, char *str);
+/* The statements of a graph which hasn't yet been materialised into its
+ * model: either a librdf_stream or a buffer to be parsed, along with the
+ * default context for its statements
+ */
+struct twine_workflow_source_struct
+{
+	librdf_node *node;
+	librdf_stream *stream;
+	const char *buf;
+	size_t buflen;
+	const char *type;
+	TWINESTREAM *target;
+};
+
+/* A stage of the workflow: either a single processor, or a tee(...) whose
+ * members are all invoked on the same graph, and joined, before the next
+ * stage
+ */
+struct twine_workflow_stage_struct
+{
+	char *name;
+	struct twine_workflow_stage_struct *members;
+	size_t nmembers;
+};
+
+/* A workflow: either the default workflow, or a named workflow used for
+ * messages which match its routing criteria; a message matches if it
+ * matches one of each kind of pattern which has been specified
+ */
+struct twine_workflow_struct
+{
+	char *name;
+	struct twine_workflow_stage_struct *stages;
+	size_t nstages;
+	/* NULL-terminated lists of MIME types, subject patterns and the names
+	 * of the plug-ins providing input handlers
+	 */
+	char **types;
+	char **subjects;
+	char **plugins;
+};
+
+/* A processor invoked on a worker thread, with its own view of the graph
+ * which shares the graph's models
+ */
+struct twine_workflow_task_struct
+{
+	TWINE *context;
+	TWINEGRAPH view;
+	struct twine_callback_struct *cb;
+	uint64_t started;
+	uint64_t finished;
+};
+
+/* One partition of a graph, passed along a run of partitionable processors
+ * by a worker thread
+ */
+struct twine_workflow_partition_struct
+{
+	TWINE *context;
+	TWINEGRAPH view;
+	struct twine_callback_struct **cbs;
+	CLUSTERJOB **jobs;
+	size_t count;
+	/* The index of the processor which failed, or count if none did */
+	size_t failed;
+};
+
+static int twine_workflow_parse_(TWINE *context, TWINEWORKFLOW *wf, char *str);
 static int twine_workflow_config_cb_(const char *key, const char *value, void *data);
+static int twine_workflow_add_(TWINE *context, TWINEWORKFLOW *wf, const char *value);
+static int twine_workflow_routes_(TWINE *context);
+static int twine_workflow_routes_cb_(const char *key, const char *value, void *data);
+static char **twine_workflow_list_(const char *str);
+static TWINEWORKFLOW *twine_workflow_route_(const char *mimetype, size_t typelen, const char *subject, const char *plugin);
+static int twine_workflow_stage_init_(TWINE *context, struct twine_workflow_stage_struct *stage, const char *name);
+static int twine_workflow_tee_init_(TWINE *context, struct twine_workflow_stage_struct *stage, const char *str);
 static int twine_workflow_process_single_(TWINE *context, TWINEGRAPH *graph, const char *name);
+static int twine_workflow_invoke_(TWINE *context, TWINEGRAPH *graph, struct twine_workflow_stage_struct *stage);
+static int twine_workflow_tee_run_(TWINE *context, TWINEGRAPH *graph, struct twine_workflow_stage_struct *stage);
+static int twine_workflow_run_(TWINE *context, TWINEGRAPH *graph, struct twine_workflow_source_struct *source);
+static struct twine_callback_struct *twine_workflow_stream_stage_(TWINE *context, const char *name);
+static int twine_workflow_stream_run_(TWINE *context, TWINEGRAPH *graph, TWINEWORKFLOW *wf, size_t first, size_t count, struct twine_workflow_source_struct *source);
+static int twine_workflow_source_stream_(TWINESTREAM *stream, struct twine_workflow_source_struct *source);
+static int twine_workflow_source_statement_(librdf_statement *statement, librdf_node *graph, void *userdata);
+static int twine_workflow_materialise_(TWINEGRAPH *graph, struct twine_workflow_source_struct *source);
+static int twine_workflow_limits_(TWINE *context, TWINEGRAPH *graph);
+static unsigned int twine_workflow_flags_(TWINE *context, const char *name);
+static unsigned int twine_workflow_stage_flags_(TWINE *context, struct twine_workflow_stage_struct *stage);
+static int twine_workflow_skip_(TWINE *context, TWINEWORKFLOW *wf, size_t stage);
+static int twine_workflow_shareable_(TWINE *context, TWINEGRAPH *graph);
+static size_t twine_workflow_concurrent_(TWINE *context, TWINEGRAPH *graph, TWINEWORKFLOW *wf, size_t first);
+static int twine_workflow_concurrent_run_(TWINE *context, TWINEGRAPH *graph, struct twine_workflow_stage_struct *stages, size_t count);
+static int twine_workflow_task_(void *data);
+static int twine_workflow_pool_(TWINE *context);
+static size_t twine_workflow_partitioned_(TWINE *context, TWINEGRAPH *graph, TWINEWORKFLOW *wf, size_t first);
+static int twine_workflow_partition_run_(TWINE *context, TWINEGRAPH *graph, TWINEWORKFLOW *wf, size_t first, size_t count);
+static int twine_workflow_partition_split_(TWINEGRAPH *graph, librdf_model **models, size_t nparts);
+static int twine_workflow_partition_merge_(TWINEGRAPH *graph, librdf_model **models, size_t nparts);
+static int twine_workflow_partition_task_(void *data);
+static void twine_workflow_usage_(TWINE *context, size_t triples, size_t bytes);
+static uint64_t twine_workflow_clock_(void);
+static int twine_workflow_timer_start_(TWINE *context, CLUSTERJOB *job, const char *name, uint64_t *started);
+static int twine_workflow_timer_stop_(TWINE *context, CLUSTERJOB *job, const char *name, uint64_t started);
+static int twine_workflow_overrun_(TWINE *context, uint64_t started, uint64_t now);
+static void twine_workflow_timeout_(TWINE *context, CLUSTERJOB *job, const char *name, uint64_t elapsed);
 
 /* Built-in workflow processors */
 static int twine_workflow_preprocess_(TWINE *restrict context, TWINEGRAPH *restrict graph, void *dummy);
@@ -33,8 +136,12 @@ static int twine_workflow_postprocess_(TWINE *restrict context, TWINEGRAPH *rest
 static int twine_workflow_sparql_get_(TWINE *restrict context, TWINEGRAPH *restrict graph, void *dummy);
 static int twine_workflow_sparql_put_(TWINE *restrict context, TWINEGRAPH *restrict graph, void *dummy);
 
-static char **workflow;
-static size_t nworkflow;
+/* The default workflow, and any named workflows in the order in which
+ * they're considered
+ */
+static TWINEWORKFLOW workflow = { "default", NULL, 0, NULL, NULL, NULL };
+static TWINEWORKFLOW *routes;
+static size_t nroutes;
 
 /* Public: process a single message, passing it to whatever input handler
  * supports messages of the specified MIME type */
@@ -44,8 +151,15 @@ twine_workflow_process_message(TWINE *restrict context, const char *restrict mim
 	size_t l, tl;
 	const char *s;
 	void *prev;
-	int r;
+	TWINEWORKFLOW *prevroute;
+	struct twine_callback_struct *cb;
+	int r, timed;
 
+	if(context->max_message_size && messagelen > context->max_message_size)
+	{
+		twine_logf(LOG_ERR, "message of %lu bytes exceeds the maximum message size of %lu bytes\n", (unsigned long) messagelen, (unsigned long) context->max_message_size);
+		return -1;
+	}
 	s = strchr(mimetype, ';');
 	if(s)
 	{
@@ -55,30 +169,60 @@ twine_workflow_process_message(TWINE *restrict context, const char *restrict mim
 	{
 		tl = strlen(mimetype);
 	}
-	prev = context->plugin_current;
+	cb = NULL;
 	for(l = 0; l < context->cbcount; l++)
 	{
 		if(context->callbacks[l].type == TCB_INPUT &&
 		   !strncasecmp(context->callbacks[l].m.input.type, mimetype, tl) &&
 		   !context->callbacks[l].m.input.type[tl])
 		{
-			context->plugin_current = context->callbacks[l].module;
-			r = context->callbacks[l].m.input.fn(context, mimetype, message, messagelen, subject, context->callbacks[l].data);
-			context->plugin_current = prev;
-			return r;
+			cb = &(context->callbacks[l]);
+			break;
 		}	
 		if(context->callbacks[l].type == TCB_LEGACY_MIME &&
 		   !strncasecmp(context->callbacks[l].m.legacy_mime.type, mimetype, tl) &&
 		   !context->callbacks[l].m.legacy_mime.type[tl])
 		{
-			context->plugin_current = context->callbacks[l].module;
-			r = context->callbacks[l].m.legacy_mime.fn(mimetype, message, messagelen, context->callbacks[l].data);
-			context->plugin_current = prev;
-			return r;
+			cb = &(context->callbacks[l]);
+			break;
 		}
 	}
-	twine_logf(LOG_ERR, "no available input handler for messages of type '%s'\n", mimetype);
-	return -1;	
+	if(!cb)
+	{
+		twine_logf(LOG_ERR, "no available input handler for messages of type '%s'\n", mimetype);
+		return -1;
+	}
+	prev = context->plugin_current;
+	prevroute = context->route;
+	/* A message passed on by another input handler (such as the s3 plug-in)
+	 * keeps the workflow selected for, and the time limit of, the original
+	 */
+	if(!context->route)
+	{
+		context->route = twine_workflow_route_(mimetype, tl, subject, cb->plugin);
+	}
+	timed = 0;
+	if(context->message_timeout && !context->message_deadline)
+	{
+		context->message_deadline = twine_workflow_clock_() + context->message_timeout;
+		timed = 1;
+	}
+	context->plugin_current = cb->module;
+	if(cb->type == TCB_INPUT)
+	{
+		r = cb->m.input.fn(context, mimetype, message, messagelen, subject, cb->data);
+	}
+	else
+	{
+		r = cb->m.legacy_mime.fn(mimetype, message, messagelen, cb->data);
+	}
+	context->plugin_current = prev;
+	context->route = prevroute;
+	if(timed)
+	{
+		context->message_deadline = 0;
+	}
+	return r;
 }
 
 /* Public: process a file via a registered bulk-import mechanism */
@@ -213,31 +357,7 @@ twine_workflow_process_file(TWINE *restrict context, const char *restrict mimety
 int
 twine_workflow_process_graph(TWINE *restrict context, TWINEGRAPH *restrict graph)
 {
-	size_t c;
-	int r;
-	CLUSTERJOB *job, *wfjob;
-	
-	twine_logf(LOG_DEBUG, "workflow: processing <%s>\n", graph->uri);
-	r = 0;
-	job = twine_job(context);
-	for(c = 0; c < nworkflow; c++)
-	{
-		wfjob = cluster_job_create_job_name(job, workflow[c]);
-		graph->job = wfjob;
-		cluster_job_begin(wfjob);
-		twine_logf(LOG_DEBUG, "workflow: invoking graph processor '%s'\n", workflow[c]);
-		r = twine_workflow_process_single_(context, graph, workflow[c]);
-		graph->job = job;		
-		if(r)
-		{
-			cluster_job_fail(wfjob);
-			cluster_job_destroy(wfjob);
-			break;
-		}
-		cluster_job_complete(wfjob);
-		cluster_job_destroy(wfjob);
-	}
-	return r;
+	return twine_workflow_run_(context, graph, NULL);
 }
 
 /* Public: process an update instruction */
@@ -293,19 +413,38 @@ twine_workflow_process_update(TWINE *restrict context, const char *restrict type
 
 /* Public: process a set of RDF triples (by creating a graph and then invoking
  * twine_workflow_process_graph() on it)
+ *
+ * If the workflow begins with streaming processors, the buffer is parsed
+ * directly into them, and the graph's model is only populated if a later
+ * stage requires it.
  */
 int
 twine_workflow_process_rdf(TWINE *restrict context, const char *restrict uri, const unsigned char *restrict buf, size_t buflen, const char *restrict type)
 {
+	struct twine_workflow_source_struct source;
 	TWINEGRAPH *g;
 	int r;
 
-	g = twine_graph_create_rdf(context, uri, buf, buflen, type);
+	memset(&source, 0, sizeof(source));
+	if(uri)
+	{
+		source.node = twine_rdf_node_createuri(uri);
+		if(!source.node)
+		{
+			return -1;
+		}
+	}
+	g = twine_graph_create(context, uri);
 	if(!g)
 	{
+		twine_rdf_node_destroy(source.node);
 		return -1;
 	}
-	r = twine_workflow_process_graph(context, g);
+	source.buf = (const char *) buf;
+	source.buflen = buflen;
+	source.type = type;
+	r = twine_workflow_run_(context, g, &source);
+	twine_rdf_node_destroy(source.node);
 	twine_graph_destroy(g);
 	return r;
 }
@@ -316,30 +455,47 @@ twine_workflow_process_rdf(TWINE *restrict context, const char *restrict uri, co
 int
 twine_workflow_process_stream(TWINE *restrict context, const char *restrict uri, librdf_stream *stream)
 {
+	struct twine_workflow_source_struct source;
 	TWINEGRAPH *g;
 	int r;
-	librdf_node *node;
 
-	node = twine_rdf_node_createuri(uri);
-	if(!node)
+	memset(&source, 0, sizeof(source));
+	source.node = twine_rdf_node_createuri(uri);
+	if(!source.node)
 	{
 		return -1;
 	}
 	g = twine_graph_create(context, uri);
 	if(!g)
 	{
-		twine_rdf_node_destroy(node);
+		twine_rdf_node_destroy(source.node);
 		return -1;
 	}
-	if(librdf_model_context_add_statements(g->store, node, stream))
+	source.stream = stream;
+	r = twine_workflow_run_(context, g, &source);
+	twine_rdf_node_destroy(source.node);
+	twine_graph_destroy(g);
+	return r;
+}
+
+/* Public: process a graph whose statements have already been parsed into
+ * a model, without copying them; the graph takes ownership of the model,
+ * which is destroyed once processing is complete whether or not it
+ * succeeds
+ */
+int
+twine_workflow_process_model(TWINE *restrict context, const char *restrict uri, librdf_model *restrict model)
+{
+	TWINEGRAPH *g;
+	int r;
+
+	g = twine_graph_create_from_model(context, uri, model);
+	if(!g)
 	{
-		twine_logf(LOG_ERR, "failed to add statements to graph <%s>\n", uri);
-		twine_rdf_node_destroy(node);
-		twine_graph_destroy(g);
+		twine_rdf_model_destroy(model);
 		return -1;
 	}
-	twine_rdf_node_destroy(node);
-	r = twine_workflow_process_graph(context, g);
+	r = twine_workflow_run_(context, g, NULL);
 	twine_graph_destroy(g);
 	return r;
 }
@@ -348,9 +504,63 @@ twine_workflow_process_stream(TWINE *restrict context, const char *restrict uri,
 int
 twine_workflow_init_(TWINE *context)
 {
-	int r;
+	int r, l;
 	char *s;
 
+	r = twine_config_get_int("*:stream-batch-size", DEFAULT_STREAM_BATCH_SIZE);
+	context->stream_batch_size = (r > 0 ? (size_t) r : DEFAULT_STREAM_BATCH_SIZE);
+	r = twine_config_get_int("*:max-message-size", 0);
+	context->max_message_size = (r > 0 ? (size_t) r : 0);
+	r = twine_config_get_int("*:max-graph-triples", 0);
+	context->max_graph_triples = (r > 0 ? (size_t) r : 0);
+	r = twine_config_get_int("*:max-graph-bytes", 0);
+	context->max_graph_bytes = (r > 0 ? (size_t) r : 0);
+	r = twine_config_get_int("*:graph-pool-size", DEFAULT_GRAPH_POOL_SIZE);
+	context->graph_pool_size = (r > 0 ? (size_t) r : 0);
+	r = twine_config_get_int("*:processor-threads", DEFAULT_PROCESSOR_THREADS);
+	context->processor_threads = (r > 0 ? (size_t) r : 1);
+	if(!context->rdf_concurrent)
+	{
+		/* Shared graphs can't be read safely by several threads */
+		context->processor_threads = 1;
+	}
+	r = twine_config_get_int("*:partition-threshold", DEFAULT_PARTITION_THRESHOLD);
+	context->partition_threshold = (r > 0 ? (size_t) r : 0);
+	s = twine_config_geta("*:tee-failure", "any");
+	if(s && !strcmp(s, "all"))
+	{
+		context->tee_failure = TWINE_TEE_FAIL_ALL;
+	}
+	else if(s && !strcmp(s, "never"))
+	{
+		context->tee_failure = TWINE_TEE_FAIL_NEVER;
+	}
+	else
+	{
+		if(s && strcmp(s, "any"))
+		{
+			twine_logf(LOG_WARNING, "unsupported tee-failure policy '%s'; using 'any'\n", s);
+		}
+		context->tee_failure = TWINE_TEE_FAIL_ANY;
+	}
+	free(s);
+	r = twine_config_get_int("*:stage-timeout", 0);
+	context->stage_timeout = (r > 0 ? (uint64_t) r * 1000 : 0);
+	r = twine_config_get_int("*:message-timeout", 0);
+	context->message_timeout = (r > 0 ? (uint64_t) r * 1000 : 0);
+	r = twine_config_get_int("*:memo-cache-size", DEFAULT_MEMO_CACHE_SIZE);
+	s = twine_config_geta("*:memo-cache-dir", NULL);
+	if(!context->memo && (r > 0 || (s && *s)))
+	{
+		l = twine_config_get_int("*:memo-cache-dir-size", DEFAULT_MEMO_CACHE_DIR_SIZE);
+		context->memo = twine_memo_create_(r > 0 ? (size_t) r : 0, s, l > 0 ? (size_t) l : 0);
+		if(!context->memo)
+		{
+			free(s);
+			return -1;
+		}
+	}
+	free(s);
 	if(!context->plugins_enabled)
 	{
 		return 0;
@@ -358,9 +568,13 @@ twine_workflow_init_(TWINE *context)
 	twine_plugin_allow_internal_(context, 1);
 	twine_plugin_add_processor(context, "deprecated:preprocess", twine_workflow_preprocess_, context);
 	twine_plugin_add_processor(context, "deprecated:postprocess", twine_workflow_postprocess_, context);
-	twine_plugin_add_processor(context, "sparql-get", twine_workflow_sparql_get_, context);
-	twine_plugin_add_processor(context, "sparql-put", twine_workflow_sparql_put_, context);
+	twine_plugin_add_processor_flags(context, "sparql-get", twine_workflow_sparql_get_, context, TWINE_PROC_MUTATES | TWINE_PROC_PROVIDES_ORIG);
+	twine_plugin_add_processor_flags(context, "sparql-put", twine_workflow_sparql_put_, context, TWINE_PROC_READONLY | TWINE_PROC_NEEDS_ORIG | TWINE_PROC_THREADSAFE);
 	twine_plugin_allow_internal_(context, 0);
+	if(twine_workflow_routes_(context))
+	{
+		return -1;
+	}
 	r = twine_config_get_all("workflow", "invoke", twine_workflow_config_cb_, context);
 	if(r < 0)
 	{
@@ -381,14 +595,14 @@ twine_workflow_init_(TWINE *context)
 	s = twine_config_geta("*:workflow", "");
 	if(s)
 	{		
-		r = twine_workflow_parse_(context, s);
+		r = twine_workflow_parse_(context, &workflow, s);
 		free(s);
 		if(r < 0)
 		{
 			return -1;
 		}
 	}
-	if(!nworkflow)
+	if(!workflow.nstages)
 	{
 		twine_logf(LOG_NOTICE, "no processing workflow was configured; using defaults\n");
 		twine_workflow_config_cb_(NULL, "sparql-get", context);
@@ -493,31 +707,31 @@ static int
 twine_workflow_sparql_get_(TWINE *restrict context, TWINEGRAPH *restrict graph, void *dummy)
 {
 	char *qbuf;
-	size_t l;
+	size_t l, mark;
 	SPARQL *conn;
 	int r;
 
-	(void) context;
 	(void) dummy;
 
 	conn = twine_sparql_create();
+	mark = twine_job_mark(context);
 	l = strlen(graph->uri) + 60;
-	qbuf = (char *) calloc(1, l + 1);
+	qbuf = (char *) twine_job_alloc(context, l + 1);
 	if(!qbuf)
 	{
 		sparql_destroy(conn);
 		return -1;
 	}
 	snprintf(qbuf, l, "SELECT * WHERE { GRAPH <%s> { ?s ?p ?o . } }", graph->uri);
-	graph->old = twine_rdf_model_create();
+	graph->old = twine_rdf_model_create_profile(TWINE_STORAGE_SINGLE);
 	if(!graph->old)
 	{
-		free(qbuf);
+		twine_job_release(context, mark);
 		sparql_destroy(conn);
 		return -1;
 	}
 	r = sparql_query_model(conn, qbuf, strlen(qbuf), graph->old);
-	free(qbuf);
+	twine_job_release(context, mark);
 	if(r)
 	{
 		cluster_job_logf(graph->job, LOG_ERR, "failed to obtain triples for graph <%s>\n", graph->uri);
@@ -533,25 +747,16 @@ static int
 twine_workflow_sparql_put_(TWINE *restrict context, TWINEGRAPH *restrict graph, void *dummy)
 {
 	SPARQL *conn;
-	size_t l;
-	char *tbuf;
 	int r;
 
-	(void) context;
 	(void) dummy;
 
 	conn = twine_sparql_create();
-	tbuf = twine_rdf_model_ntriples(graph->store, &l);
-	if(tbuf)
-	{
-		r = sparql_put(conn, graph->uri, tbuf, l);
-		librdf_free_memory(tbuf);
-	}
-	else
+	if(!conn)
 	{
-		cluster_job_logf(graph->job, LOG_ERR, "failed to perform SPARQL PUT for <%s>\n", graph->uri);
-		r = -1;
+		return -1;
 	}
+	r = twine_sparql_put_graph_(context, conn, graph);
 	sparql_destroy(conn);
 	return r;
 }
@@ -595,74 +800,1685 @@ twine_workflow_process_single_(TWINE *context, TWINEGRAPH *graph, const char *na
 	return r;	
 }
 
+/* Private: invoke each processor in the workflow for a graph, whose
+ * statements are supplied by source if it hasn't been materialised yet
+ */
 static int
-twine_workflow_parse_(TWINE *context, char *str)
+twine_workflow_run_(TWINE *context, TWINEGRAPH *graph, struct twine_workflow_source_struct *source)
 {
-	char *p, *s;
-
-	/* Parse a workflow=foo,bar,baz configuration option
-	 * Note that processor names can be separated either with whitespace or
-	 * with commas or semicolons (or any combination of them), and empty
-	 * elements in the list are skipped.
-	 */
-	for(p = str; *p; p = s)
+	TWINEWORKFLOW *wf;
+	size_t c, n, triples, bytes;
+	int r, streamed;
+	
+	wf = (context->route ? context->route : &workflow);
+	twine_logf(LOG_DEBUG, "workflow: processing <%s> using the '%s' workflow\n", graph->uri, wf->name);
+	r = 0;
+	streamed = 0;
+	for(c = 0; c < wf->nstages; c += n)
 	{
-		while(isspace(*p) || *p == ',' || *p == ';')
+		/* Consecutive streaming processors are run together, each batch
+		 * of statements being passed along all of them in turn
+		 */
+		for(n = 0; c + n < wf->nstages && twine_workflow_stream_stage_(context, wf->stages[c + n].name); n++) { }
+		if(n)
 		{
-			p++;
+			r = twine_workflow_stream_run_(context, graph, wf, c, n, source);
+			if(r)
+			{
+				break;
+			}
+			/* If the graph was streamed from its source straight through
+			 * to the end of the workflow, its size has already been
+			 * recorded
+			 */
+			streamed = (source && c + n == wf->nstages);
+			/* If anything follows, the graph will have been materialised
+			 * as it was streamed
+			 */
+			source = NULL;
+			continue;
 		}
-		if(!*p)
+		n = 1;
+		if(twine_workflow_skip_(context, wf, c))
+		{
+			continue;
+		}
+		if(source)
+		{
+			twine_logf(LOG_DEBUG, "workflow: graph processor '%s' requires a complete model of <%s>\n", wf->stages[c].name, graph->uri);
+			r = twine_workflow_materialise_(graph, source);
+			source = NULL;
+			if(r)
+			{
+				break;
+			}
+		}
+		/* Processors may have added to the graph, so check its size
+		 * before each one
+		 */
+		if(twine_workflow_limits_(context, graph))
 		{
+			r = -1;
 			break;
 		}
-		for(s = p; *s && !isspace(*s) && *s != ',' && *s != ';'; s++) { }
-		if(*s)
+		if(wf->stages[c].members)
 		{
-			*s = 0;
-			s++;
+			r = twine_workflow_tee_run_(context, graph, &(wf->stages[c]));
+			if(r)
+			{
+				break;
+			}
+			continue;
 		}
-		if(!*p)
+		/* Consecutive partitionable processors are invoked together on
+		 * each partition of a large graph
+		 */
+		n = twine_workflow_partitioned_(context, graph, wf, c);
+		if(n)
+		{
+			r = twine_workflow_partition_run_(context, graph, wf, c, n);
+			if(r)
+			{
+				break;
+			}
+			continue;
+		}
+		/* Consecutive thread-safe, read-only processors are run at the
+		 * same time
+		 */
+		n = twine_workflow_concurrent_(context, graph, wf, c);
+		if(n > 1)
 		{
+			if(twine_workflow_concurrent_run_(context, graph, &(wf->stages[c]), n))
+			{
+				r = -1;
+				break;
+			}
 			continue;
-		}		
-		if(twine_workflow_config_cb_(NULL, p, context) < 0)
+		}
+		n = 1;
+		r = twine_workflow_invoke_(context, graph, &(wf->stages[c]));
+		if(r)
 		{
-			return -1;
+			break;
 		}
 	}
-	return 0;
+	if(!r && !streamed && !twine_graph_usage(graph, &triples, &bytes))
+	{
+		twine_workflow_usage_(context, triples, bytes);
+	}
+	return r;
 }
 
+/* Private: invoke a single processor as a sub-job of the current job; the
+ * results of deterministic processors are cached, and replayed instead of
+ * invoking the processor when it's given an identical graph
+ */
 static int
-twine_workflow_config_cb_(const char *key, const char *value, void *data)
+twine_workflow_invoke_(TWINE *context, TWINEGRAPH *graph, struct twine_workflow_stage_struct *stage)
 {
-	char **p;
-	TWINE *context;
+	CLUSTERJOB *job, *wfjob;
+	TWINEMEMOKEY key;
+	unsigned int flags;
+	uint64_t started;
+	int r, memo;
 
-	(void) key;
+	job = twine_job(context);
+	wfjob = cluster_job_create_job_name(job, stage->name);
+	graph->job = wfjob;
+	cluster_job_begin(wfjob);
+	r = (twine_workflow_timer_start_(context, wfjob, stage->name, &started) ? -1 : 1);
+	/* Read-only processors have nothing to replay, and a processor which
+	 * reads the original graph doesn't depend on the model alone
+	 */
+	memo = 0;
+	flags = twine_workflow_flags_(context, stage->name);
+	if(r > 0 && context->memo &&
+	   (flags & (TWINE_PROC_DETERMINISTIC | TWINE_PROC_READONLY | TWINE_PROC_NEEDS_ORIG)) == TWINE_PROC_DETERMINISTIC &&
+	   !twine_memo_digest_(stage->name, graph, &key))
+	{
+		memo = 1;
+		r = twine_memo_replay_(context->memo, stage->name, &key, graph);
+		if(r > 0)
+		{
+			twine_logf(LOG_DEBUG, "workflow: replaying cached results of graph processor '%s'\n", stage->name);
+			r = 0;
+		}
+		else if(r < 0)
+		{
+			cluster_job_logf(wfjob, LOG_ERR, "failed to replay cached results of graph processor '%s'\n", stage->name);
+		}
+		else
+		{
+			r = 1;
+		}
+	}
+	if(r > 0)
+	{
+		twine_logf(LOG_DEBUG, "workflow: invoking graph processor '%s'\n", stage->name);
+		r = twine_workflow_process_single_(context, graph, stage->name);
+		if(!r && memo && twine_memo_store_(context->memo, stage->name, &key, graph))
+		{
+			/* The results are still good even if they couldn't be cached */
+			twine_logf(LOG_WARNING, "failed to cache the results of graph processor '%s'\n", stage->name);
+		}
+	}
+	if(twine_workflow_timer_stop_(context, wfjob, stage->name, started))
+	{
+		r = -1;
+	}
+	graph->job = job;
+	if(r)
+	{
+		cluster_job_fail(wfjob);
+	}
+	else
+	{
+		cluster_job_complete(wfjob);
+	}
+	cluster_job_destroy(wfjob);
+	return r;
+}
 
-	context = (TWINE *) data;
+/* Private: invoke each of the members of a tee(...) stage on a graph,
+ * concurrently if they're all thread-safe and read-only (in which case
+ * they share the graph's model, subject to the same conditions as other
+ * concurrent processors), and apply the configured failure policy to the
+ * results; a member failing doesn't stop the others from being invoked
+ */
+static int
+twine_workflow_tee_run_(TWINE *context, TWINEGRAPH *graph, struct twine_workflow_stage_struct *stage)
+{
+	unsigned int flags;
+	size_t c, failed;
+	int r;
 
-	twine_logf(LOG_DEBUG, "adding processor '%s' to workflow\n", value);
-	if(!twine_plugin_processor_exists(context, value))
+	flags = TWINE_PROC_READONLY | TWINE_PROC_THREADSAFE;
+	for(c = 0; c < stage->nmembers; c++)
 	{
-		twine_logf(LOG_CRIT, "graph processor '%s' named in workflow configuration does not exist (have all the necessary plug-ins been loaded?)\n", value);
-		return -1;
+		flags &= twine_workflow_flags_(context, stage->members[c].name);
 	}
-	p = (char **) realloc(workflow, sizeof(char *) * (nworkflow + 2));
-	if(!p)
+	context->timed_out = 0;
+	if(stage->nmembers > 1 &&
+	   flags == (TWINE_PROC_READONLY | TWINE_PROC_THREADSAFE) &&
+	   twine_workflow_shareable_(context, graph))
 	{
-		twine_logf(LOG_CRIT, "failed to expand workflow list buffer\n");
+		r = twine_workflow_concurrent_run_(context, graph, stage->members, stage->nmembers);
+		if(r < 0)
+		{
+			return -1;
+		}
+		failed = (size_t) r;
+	}
+	else
+	{
+		twine_logf(LOG_DEBUG, "workflow: invoking members of %s one at a time\n", stage->name);
+		failed = 0;
+		for(c = 0; c < stage->nmembers; c++)
+		{
+			if(twine_workflow_invoke_(context, graph, &(stage->members[c])))
+			{
+				failed++;
+			}
+		}
+	}
+	if(!failed)
+	{
+		return 0;
+	}
+	/* Running out of time fails the stage whatever the failure policy; the
+	 * member concerned has already been recorded in the job's metadata
+	 */
+	if(context->timed_out)
+	{
+		cluster_job_logf(graph->job, LOG_ERR, "%s exceeded its time limit\n", stage->name);
 		return -1;
 	}
-	workflow = p;
-	p[nworkflow] = strdup(value);
-	if(!p[nworkflow])
+	if(context->tee_failure == TWINE_TEE_FAIL_NEVER ||
+	   (context->tee_failure == TWINE_TEE_FAIL_ALL && failed < stage->nmembers))
 	{
-		twine_logf(LOG_CRIT, "failed to duplicate graph processor name while adding to workflow\n");
+		cluster_job_logf(graph->job, LOG_WARNING, "%lu of %lu processors in %s failed; continuing\n", (unsigned long) failed, (unsigned long) stage->nmembers, stage->name);
+		return 0;
+	}
+	cluster_job_logf(graph->job, LOG_ERR, "%lu of %lu processors in %s failed\n", (unsigned long) failed, (unsigned long) stage->nmembers, stage->name);
+	return -1;
+}
+
+/* Private: return the flags a processor was registered with, or zero if
+ * it isn't a processor which can have flags
+ */
+static unsigned int
+twine_workflow_flags_(TWINE *context, const char *name)
+{
+	size_t c;
+
+	for(c = 0; c < context->cbcount; c++)
+	{
+		if(context->callbacks[c].type == TCB_PROCESSOR &&
+		   !strcmp(context->callbacks[c].m.processor.name, name))
+		{
+			return context->callbacks[c].m.processor.flags;
+		}
+	}
+	return 0;
+}
+
+/* Private: return the flags which apply to a workflow stage; a tee(...)
+ * is read-only only if all of its members are, and is treated as needing
+ * the original graph or modifying the graph if any of its members do;
+ * tees are never thread-safe or idempotent as a whole
+ */
+static unsigned int
+twine_workflow_stage_flags_(TWINE *context, struct twine_workflow_stage_struct *stage)
+{
+	unsigned int flags, f;
+	size_t c;
+
+	if(!stage->members)
+	{
+		return twine_workflow_flags_(context, stage->name);
+	}
+	flags = TWINE_PROC_READONLY;
+	for(c = 0; c < stage->nmembers; c++)
+	{
+		f = twine_workflow_flags_(context, stage->members[c].name);
+		if(!(f & (TWINE_PROC_READONLY | TWINE_PROC_MUTATES)))
+		{
+			/* A member which hasn't described itself could do anything */
+			return 0;
+		}
+		if(!(f & TWINE_PROC_READONLY))
+		{
+			flags &= ~TWINE_PROC_READONLY;
+		}
+		flags |= f & (TWINE_PROC_MUTATES | TWINE_PROC_NEEDS_ORIG);
+	}
+	return flags;
+}
+
+/* Private: determine whether a processor can be skipped, either because
+ * it only provides the original model and nothing later needs it, or
+ * because it's idempotent and has already run without the graph being
+ * modified since
+ */
+static int
+twine_workflow_skip_(TWINE *context, TWINEWORKFLOW *wf, size_t stage)
+{
+	unsigned int flags, f;
+	size_t c;
+
+	flags = twine_workflow_stage_flags_(context, &(wf->stages[stage]));
+	if(flags & TWINE_PROC_PROVIDES_ORIG)
+	{
+		for(c = stage + 1; c < wf->nstages; c++)
+		{
+			f = twine_workflow_stage_flags_(context, &(wf->stages[c]));
+			if(!(f & (TWINE_PROC_READONLY | TWINE_PROC_MUTATES)) || (f & TWINE_PROC_NEEDS_ORIG))
+			{
+				return 0;
+			}
+		}
+		twine_logf(LOG_DEBUG, "workflow: skipping graph processor '%s' because no later processor needs the original graph\n", wf->stages[stage].name);
+		return 1;
+	}
+	if(flags & TWINE_PROC_IDEMPOTENT)
+	{
+		for(c = stage; c > 0; c--)
+		{
+			if(!strcmp(wf->stages[c - 1].name, wf->stages[stage].name))
+			{
+				twine_logf(LOG_DEBUG, "workflow: skipping graph processor '%s' because the graph hasn't changed since it was last invoked\n", wf->stages[stage].name);
+				return 1;
+			}
+			if(!(twine_workflow_stage_flags_(context, &(wf->stages[c - 1])) & TWINE_PROC_READONLY))
+			{
+				break;
+			}
+		}
+	}
+	return 0;
+}
+
+/* Private: determine whether processors can be run concurrently on a
+ * graph; this is only possible if the graph uses compact storage and the
+ * worker pool is available. Once its indices are built, compact storage
+ * can be read by several threads at once, because it serialises the
+ * storage reference counting done by the streams and iterators each of
+ * them opens.
+ */
+static int
+twine_workflow_shareable_(TWINE *context, TWINEGRAPH *graph)
+{
+	librdf_storage *storage;
+
+	if(context->processor_threads < 2)
+	{
+		return 0;
+	}
+	storage = librdf_model_get_storage(graph->store);
+	if(!storage || !twine_storage_is_compact_(storage) || twine_storage_prepare_(storage))
+	{
+		return 0;
+	}
+	if(graph->old)
+	{
+		storage = librdf_model_get_storage(graph->old);
+		if(!storage || !twine_storage_is_compact_(storage) || twine_storage_prepare_(storage))
+		{
+			return 0;
+		}
+	}
+	if(twine_workflow_pool_(context))
+	{
+		return 0;
+	}
+	return 1;
+}
+
+/* Private: start the worker pool if it isn't already running */
+static int
+twine_workflow_pool_(TWINE *context)
+{
+	if(context->workers)
+	{
+		return 0;
+	}
+	context->workers = twine_workers_create_(context->processor_threads - 1);
+	if(!context->workers)
+	{
+		/* Fall back to running processors one at a time */
+		context->processor_threads = 1;
+		return -1;
+	}
+	return 0;
+}
+
+/* Private: return the number of consecutive processors, starting with
+ * first, which can be run concurrently because they're all thread-safe
+ * and read-only
+ */
+static size_t
+twine_workflow_concurrent_(TWINE *context, TWINEGRAPH *graph, TWINEWORKFLOW *wf, size_t first)
+{
+	unsigned int flags;
+	size_t n;
+
+	if(context->processor_threads < 2)
+	{
+		return 1;
+	}
+	for(n = 0; first + n < wf->nstages; n++)
+	{
+		flags = twine_workflow_stage_flags_(context, &(wf->stages[first + n]));
+		if((flags & (TWINE_PROC_READONLY | TWINE_PROC_THREADSAFE)) != (TWINE_PROC_READONLY | TWINE_PROC_THREADSAFE))
+		{
+			break;
+		}
+	}
+	if(n < 2 || !twine_workflow_shareable_(context, graph))
+	{
+		return 1;
+	}
+	return n;
+}
+
+/* Private: run a set of processors concurrently using the worker pool,
+ * returning the number which failed
+ */
+static int
+twine_workflow_concurrent_run_(TWINE *context, TWINEGRAPH *graph, struct twine_workflow_stage_struct *stages, size_t count)
+{
+	struct twine_workflow_task_struct *data;
+	TWINEWORKERTASK *tasks;
+	CLUSTERJOB *job;
+	uint64_t started;
+	size_t c, l;
+	int r;
+
+	/* Each processor's time is measured individually, but the deadline
+	 * seen by twine_cancelled() is shared by all of them
+	 */
+	if(twine_workflow_timer_start_(context, graph->job, stages[0].name, &started))
+	{
+		return (int) count;
+	}
+	tasks = (TWINEWORKERTASK *) twine_job_alloc(context, count * sizeof(TWINEWORKERTASK));
+	data = (struct twine_workflow_task_struct *) twine_job_alloc(context, count * sizeof(struct twine_workflow_task_struct));
+	if(!tasks || !data)
+	{
+		context->stage_deadline = 0;
+		return -1;
+	}
+	job = twine_job(context);
+	for(c = 0; c < count; c++)
+	{
+		for(l = 0; l < context->cbcount; l++)
+		{
+			if(context->callbacks[l].type == TCB_PROCESSOR &&
+			   !strcmp(context->callbacks[l].m.processor.name, stages[c].name))
+			{
+				data[c].cb = &(context->callbacks[l]);
+				break;
+			}
+		}
+		data[c].context = context;
+		data[c].view = *graph;
+		data[c].view.job = cluster_job_create_job_name(job, stages[c].name);
+		cluster_job_begin(data[c].view.job);
+		tasks[c].fn = twine_workflow_task_;
+		tasks[c].data = &(data[c]);
+		twine_logf(LOG_DEBUG, "workflow: invoking graph processor '%s' concurrently\n", stages[c].name);
+	}
+	twine_workers_run_(context->workers, tasks, count);
+	context->stage_deadline = 0;
+	r = 0;
+	for(c = 0; c < count; c++)
+	{
+		if(!tasks[c].result && twine_workflow_overrun_(context, data[c].started, data[c].finished))
+		{
+			twine_workflow_timeout_(context, data[c].view.job, stages[c].name, data[c].finished - data[c].started);
+			tasks[c].result = -1;
+		}
+		if(tasks[c].result)
+		{
+			cluster_job_fail(data[c].view.job);
+			r++;
+		}
+		else
+		{
+			cluster_job_complete(data[c].view.job);
+		}
+		cluster_job_destroy(data[c].view.job);
+	}
+	return r;
+}
+
+/* Private: invoke a processor on a worker thread; the current plug-in
+ * isn't tracked, as it's shared by all threads
+ */
+static int
+twine_workflow_task_(void *data)
+{
+	struct twine_workflow_task_struct *task;
+	int r;
+
+	task = (struct twine_workflow_task_struct *) data;
+	twine_logf(LOG_DEBUG, "invoking graph processor '%s' for <%s>\n", task->cb->m.processor.name, task->view.uri);
+	task->started = twine_workflow_clock_();
+	r = task->cb->m.processor.fn(task->context, &(task->view), task->cb->data);
+	task->finished = twine_workflow_clock_();
+	if(r)
+	{
+		cluster_job_logf(task->view.job, LOG_ERR, "graph processor '%s' failed\n", task->cb->m.processor.name);
+		return -1;
+	}
+	return 0;
+}
+
+/* Private: return the number of consecutive processors, starting with
+ * first, which can be invoked on partitions of a graph, or zero if the
+ * graph shouldn't be partitioned; it must be large enough to be worth
+ * dividing, and its original model (which the partitions share) must be
+ * safe to read from several threads
+ */
+static size_t
+twine_workflow_partitioned_(TWINE *context, TWINEGRAPH *graph, TWINEWORKFLOW *wf, size_t first)
+{
+	librdf_storage *storage;
+	unsigned int flags;
+	size_t n;
+	int size;
+
+	if(context->processor_threads < 2 || !context->partition_threshold)
+	{
+		return 0;
+	}
+	for(n = 0; first + n < wf->nstages; n++)
+	{
+		if(wf->stages[first + n].members)
+		{
+			break;
+		}
+		flags = twine_workflow_flags_(context, wf->stages[first + n].name);
+		if((flags & (TWINE_PROC_PARTITIONED | TWINE_PROC_THREADSAFE)) != (TWINE_PROC_PARTITIONED | TWINE_PROC_THREADSAFE))
+		{
+			break;
+		}
+		/* Processors which might need to be skipped are left to start a
+		 * run of their own
+		 */
+		if(n && (flags & (TWINE_PROC_IDEMPOTENT | TWINE_PROC_PROVIDES_ORIG)))
+		{
+			break;
+		}
+	}
+	if(!n)
+	{
+		return 0;
+	}
+	size = librdf_model_size(graph->store);
+	if(size < 0 || (size_t) size < context->partition_threshold)
+	{
+		return 0;
+	}
+	if(graph->old)
+	{
+		storage = librdf_model_get_storage(graph->old);
+		if(!storage || !twine_storage_is_compact_(storage) || twine_storage_prepare_(storage))
+		{
+			return 0;
+		}
+	}
+	if(twine_workflow_pool_(context))
+	{
+		return 0;
+	}
+	return n;
+}
+
+/* Private: divide a graph's statements by subject between one partition
+ * per thread, pass each partition along a run of partitionable processors
+ * using the worker pool, and then replace the graph's model with the
+ * union of the results; the run is timed as a whole, like a run of
+ * streaming processors
+ */
+static int
+twine_workflow_partition_run_(TWINE *context, TWINEGRAPH *graph, TWINEWORKFLOW *wf, size_t first, size_t count)
+{
+	struct twine_workflow_partition_struct *parts;
+	struct twine_callback_struct **cbs;
+	TWINEWORKERTASK *tasks;
+	librdf_model **models;
+	CLUSTERJOB **jobs, *job;
+	unsigned int flags;
+	uint64_t started;
+	size_t c, l, nparts, failed;
+	int r;
+
+	if(twine_workflow_timer_start_(context, graph->job, wf->stages[first].name, &started))
+	{
+		return -1;
+	}
+	nparts = context->processor_threads;
+	tasks = (TWINEWORKERTASK *) twine_job_alloc(context, nparts * sizeof(TWINEWORKERTASK));
+	parts = (struct twine_workflow_partition_struct *) twine_job_alloc(context, nparts * sizeof(struct twine_workflow_partition_struct));
+	models = (librdf_model **) twine_job_alloc(context, nparts * sizeof(librdf_model *));
+	cbs = (struct twine_callback_struct **) twine_job_alloc(context, count * sizeof(struct twine_callback_struct *));
+	jobs = (CLUSTERJOB **) twine_job_alloc(context, count * sizeof(CLUSTERJOB *));
+	if(!tasks || !parts || !models || !cbs || !jobs)
+	{
+		context->stage_deadline = 0;
+		return -1;
+	}
+	job = twine_job(context);
+	flags = TWINE_PROC_READONLY;
+	for(c = 0; c < count; c++)
+	{
+		for(l = 0; l < context->cbcount; l++)
+		{
+			if(context->callbacks[l].type == TCB_PROCESSOR &&
+			   !strcmp(context->callbacks[l].m.processor.name, wf->stages[first + c].name))
+			{
+				cbs[c] = &(context->callbacks[l]);
+				break;
+			}
+		}
+		flags &= cbs[c]->m.processor.flags;
+		jobs[c] = cluster_job_create_job_name(job, wf->stages[first + c].name);
+		cluster_job_begin(jobs[c]);
+		twine_logf(LOG_DEBUG, "workflow: invoking graph processor '%s' on %lu partitions of <%s>\n", wf->stages[first + c].name, (unsigned long) nparts, graph->uri);
+	}
+	r = 0;
+	/* The partitions use the same storage as the graph, so that they can
+	 * be merged back into it without constructing any nodes
+	 */
+	for(c = 0; c < nparts && !r; c++)
+	{
+		models[c] = twine_rdf_model_create_like_(graph->store);
+		if(!models[c])
+		{
+			r = -1;
+		}
+	}
+	if(!r)
+	{
+		r = twine_workflow_partition_split_(graph, models, nparts);
+	}
+	failed = count;
+	if(!r)
+	{
+		for(c = 0; c < nparts; c++)
+		{
+			parts[c].context = context;
+			parts[c].view = *graph;
+			parts[c].view.store = models[c];
+			parts[c].cbs = cbs;
+			parts[c].jobs = jobs;
+			parts[c].count = count;
+			parts[c].failed = count;
+			tasks[c].fn = twine_workflow_partition_task_;
+			tasks[c].data = &(parts[c]);
+		}
+		twine_workers_run_(context->workers, tasks, nparts);
+		for(c = 0; c < nparts; c++)
+		{
+			/* A processor may have replaced its partition's model */
+			models[c] = parts[c].view.store;
+			if(tasks[c].result)
+			{
+				r = -1;
+				if(parts[c].failed < failed)
+				{
+					failed = parts[c].failed;
+				}
+			}
+		}
+	}
+	/* A time limit being exceeded is attributed to the earliest processor
+	 * which failed, if any
+	 */
+	c = (failed < count ? failed : 0);
+	if(twine_workflow_timer_stop_(context, jobs[c], wf->stages[first + c].name, started))
+	{
+		r = -1;
+	}
+	/* If every processor was read-only, the graph is already up to date */
+	if(!r && !(flags & TWINE_PROC_READONLY))
+	{
+		r = twine_workflow_partition_merge_(graph, models, nparts);
+	}
+	for(c = 0; c < nparts; c++)
+	{
+		if(models[c])
+		{
+			twine_rdf_model_destroy(models[c]);
+		}
+	}
+	for(c = 0; c < count; c++)
+	{
+		if(r)
+		{
+			cluster_job_fail(jobs[c]);
+		}
+		else
+		{
+			cluster_job_complete(jobs[c]);
+		}
+		cluster_job_destroy(jobs[c]);
+	}
+	return r;
+}
+
+/* Private: add each of the statements of a graph to one of several models
+ * according to a hash of its subject
+ */
+static int
+twine_workflow_partition_split_(TWINEGRAPH *graph, librdf_model **models, size_t nparts)
+{
+	TWINEQUADS *quads;
+	const TWINETERM *s, *p, *o, *g;
+	librdf_node *subject, *predicate, *object, *ctx;
+	librdf_statement *st;
+	size_t c, count, part;
+	int r;
+
+	quads = twine_quads_create(graph->store);
+	if(!quads)
+	{
+		return -1;
+	}
+	count = twine_quads_count(quads);
+	s = twine_quads_subjects(quads);
+	p = twine_quads_predicates(quads);
+	o = twine_quads_objects(quads);
+	g = twine_quads_contexts(quads);
+	r = 0;
+	for(c = 0; c < count && !r; c++)
+	{
+		subject = twine_quads_node(quads, s[c]);
+		predicate = twine_quads_node(quads, p[c]);
+		object = twine_quads_node(quads, o[c]);
+		ctx = (g ? twine_quads_node(quads, g[c]) : NULL);
+		if(!subject || !predicate || !object)
+		{
+			r = -1;
+			break;
+		}
+		/* Term identifiers are dense, so they're scrambled before being
+		 * reduced to a partition number
+		 */
+		part = (size_t) (((uint32_t) (s[c] * 2654435761U)) >> 16) % nparts;
+		st = librdf_new_statement_from_nodes(twine_rdf_world(), librdf_new_node_from_node(subject), librdf_new_node_from_node(predicate), librdf_new_node_from_node(object));
+		if(!st)
+		{
+			r = -1;
+			break;
+		}
+		if(ctx)
+		{
+			r = librdf_model_context_add_statement(models[part], ctx, st);
+		}
+		else
+		{
+			r = librdf_model_add_statement(models[part], st);
+		}
+		librdf_free_statement(st);
+	}
+	twine_quads_destroy(quads);
+	if(r)
+	{
+		cluster_job_logf(graph->job, LOG_ERR, "failed to divide the statements of <%s> into partitions\n", graph->uri);
+		return -1;
+	}
+	return 0;
+}
+
+/* Private: replace the model of a graph with the union of the models of
+ * its partitions; compact storage is cleared and the partitions copied
+ * into it directly, while anything else is replaced with a new model
+ */
+static int
+twine_workflow_partition_merge_(TWINEGRAPH *graph, librdf_model **models, size_t nparts)
+{
+	librdf_storage *storage, *src;
+	librdf_model *model;
+	librdf_stream *stream;
+	size_t c;
+	int r;
+
+	storage = librdf_model_get_storage(graph->store);
+	if(storage && twine_storage_is_compact_(storage))
+	{
+		for(c = 0; c < nparts; c++)
+		{
+			src = librdf_model_get_storage(models[c]);
+			if(!src || !twine_storage_is_compact_(src))
+			{
+				break;
+			}
+		}
+		if(c == nparts && !twine_storage_reset_(storage))
+		{
+			for(c = 0; c < nparts; c++)
+			{
+				if(twine_storage_copy_(storage, librdf_model_get_storage(models[c])))
+				{
+					cluster_job_logf(graph->job, LOG_ERR, "failed to merge the partitions of <%s>\n", graph->uri);
+					return -1;
+				}
+			}
+			return 0;
+		}
+	}
+	model = twine_rdf_model_create();
+	if(!model)
+	{
+		return -1;
+	}
+	r = 0;
+	for(c = 0; c < nparts && !r; c++)
+	{
+		stream = librdf_model_as_stream(models[c]);
+		if(!stream)
+		{
+			r = -1;
+			break;
+		}
+		for(; !librdf_stream_end(stream); librdf_stream_next(stream))
+		{
+			if(librdf_model_context_add_statement(model, librdf_stream_get_context2(stream), librdf_stream_get_object(stream)))
+			{
+				r = -1;
+				break;
+			}
+		}
+		librdf_free_stream(stream);
+	}
+	if(r)
+	{
+		cluster_job_logf(graph->job, LOG_ERR, "failed to merge the partitions of <%s>\n", graph->uri);
+		twine_rdf_model_destroy(model);
+		return -1;
+	}
+	twine_rdf_model_destroy(graph->store);
+	graph->store = model;
+	return 0;
+}
+
+/* Private: pass one partition of a graph along a run of processors on a
+ * worker thread, stopping at the first which fails
+ */
+static int
+twine_workflow_partition_task_(void *data)
+{
+	struct twine_workflow_partition_struct *part;
+	size_t c;
+
+	part = (struct twine_workflow_partition_struct *) data;
+	for(c = 0; c < part->count; c++)
+	{
+		if(twine_cancelled(part->context))
+		{
+			part->failed = c;
+			return -1;
+		}
+		part->view.job = part->jobs[c];
+		if(part->cbs[c]->m.processor.fn(part->context, &(part->view), part->cbs[c]->data))
+		{
+			cluster_job_logf(part->jobs[c], LOG_ERR, "graph processor '%s' failed\n", part->cbs[c]->m.processor.name);
+			part->failed = c;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Public: determine whether the current workflow stage, or the message
+ * being processed, has exceeded its time limit
+ */
+int
+twine_cancelled(TWINE *context)
+{
+	uint64_t now;
+
+	if(!context->stage_deadline && !context->message_deadline)
+	{
+		return 0;
+	}
+	now = twine_workflow_clock_();
+	if(context->stage_deadline && now >= context->stage_deadline)
+	{
+		return 1;
+	}
+	if(context->message_deadline && now >= context->message_deadline)
+	{
+		return 1;
+	}
+	return 0;
+}
+
+/* Private: return the time in milliseconds from an arbitrary starting
+ * point which isn't affected by changes to the system clock
+ */
+static uint64_t
+twine_workflow_clock_(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+/* Private: start timing a stage, setting its deadline; fails (setting
+ * started to zero) if the message has already run out of time
+ */
+static int
+twine_workflow_timer_start_(TWINE *context, CLUSTERJOB *job, const char *name, uint64_t *started)
+{
+	uint64_t now;
+
+	now = twine_workflow_clock_();
+	if(context->message_deadline && now >= context->message_deadline)
+	{
+		*started = 0;
+		twine_workflow_timeout_(context, job, name, 0);
+		return -1;
+	}
+	*started = now;
+	context->stage_deadline = (context->stage_timeout ? now + context->stage_timeout : 0);
+	return 0;
+}
+
+/* Private: stop timing a stage, failing if it or the message ran out of
+ * time
+ */
+static int
+twine_workflow_timer_stop_(TWINE *context, CLUSTERJOB *job, const char *name, uint64_t started)
+{
+	uint64_t now;
+
+	context->stage_deadline = 0;
+	if(!started)
+	{
+		return 0;
+	}
+	now = twine_workflow_clock_();
+	if(twine_workflow_overrun_(context, started, now))
+	{
+		twine_workflow_timeout_(context, job, name, now - started);
+		return -1;
+	}
+	return 0;
+}
+
+/* Private: determine whether a stage which ran between two times exceeded
+ * the stage or message time limits
+ */
+static int
+twine_workflow_overrun_(TWINE *context, uint64_t started, uint64_t now)
+{
+	if(context->stage_timeout && now - started > context->stage_timeout)
+	{
+		return 1;
+	}
+	if(context->message_deadline && now >= context->message_deadline)
+	{
+		return 1;
+	}
+	return 0;
+}
+
+/* Private: log that a stage ran out of time, and record it in the current
+ * job's metadata; an elapsed time of zero means that the message ran out
+ * of time before the stage began
+ */
+static void
+twine_workflow_timeout_(TWINE *context, CLUSTERJOB *job, const char *name, uint64_t elapsed)
+{
+	char buf[32];
+
+	context->timed_out = 1;
+	if(elapsed)
+	{
+		cluster_job_logf(job, LOG_ERR, "graph processor '%s' exceeded its time limit after %lu ms\n", name, (unsigned long) elapsed);
+	}
+	else
+	{
+		cluster_job_logf(job, LOG_ERR, "message exceeded its time limit before graph processor '%s' could be invoked\n", name);
+	}
+	if(!context->job)
+	{
+		return;
+	}
+	cluster_job_set(context->job, "Timeout-Stage", name);
+	snprintf(buf, sizeof(buf), "%lu", (unsigned long) elapsed);
+	cluster_job_set(context->job, "Timeout-Elapsed", buf);
+}
+
+/* Private: fail if a graph exceeds the configured size limits */
+static int
+twine_workflow_limits_(TWINE *context, TWINEGRAPH *graph)
+{
+	size_t triples, bytes;
+
+	if(!context->max_graph_triples && !context->max_graph_bytes)
+	{
+		return 0;
+	}
+	if(twine_rdf_model_usage(graph->store, &triples, context->max_graph_bytes ? &bytes : NULL))
+	{
+		return -1;
+	}
+	if(context->max_graph_triples && triples > context->max_graph_triples)
+	{
+		cluster_job_logf(graph->job, LOG_ERR, "graph <%s> has %lu triples, exceeding the limit of %lu\n", graph->uri, (unsigned long) triples, (unsigned long) context->max_graph_triples);
+		return -1;
+	}
+	if(context->max_graph_bytes && bytes > context->max_graph_bytes)
+	{
+		cluster_job_logf(graph->job, LOG_ERR, "graph <%s> is using approximately %lu bytes, exceeding the limit of %lu\n", graph->uri, (unsigned long) bytes, (unsigned long) context->max_graph_bytes);
+		return -1;
+	}
+	return 0;
+}
+
+/* Private: add the size of a processed graph to the totals for the current
+ * job, and record them in the job's metadata
+ */
+static void
+twine_workflow_usage_(TWINE *context, size_t triples, size_t bytes)
+{
+	char buf[32];
+
+	if(!context->job)
+	{
+		return;
+	}
+	context->job_graphs++;
+	context->job_triples += triples;
+	context->job_bytes += bytes;
+	snprintf(buf, sizeof(buf), "%lu", (unsigned long) context->job_graphs);
+	cluster_job_set(context->job, "Graphs", buf);
+	snprintf(buf, sizeof(buf), "%lu", (unsigned long) context->job_triples);
+	cluster_job_set(context->job, "Graph-Triples", buf);
+	snprintf(buf, sizeof(buf), "%lu", (unsigned long) context->job_bytes);
+	cluster_job_set(context->job, "Graph-Bytes", buf);
+}
+
+/* Private: return the streaming processor callback with the given name, if
+ * there is one
+ */
+static struct twine_callback_struct *
+twine_workflow_stream_stage_(TWINE *context, const char *name)
+{
+	size_t c;
+
+	for(c = 0; c < context->cbcount; c++)
+	{
+		if(context->callbacks[c].type == TCB_STREAM &&
+		   !strcmp(context->callbacks[c].m.stream.name, name))
+		{
+			return &(context->callbacks[c]);
+		}
+	}
+	return NULL;
+}
+
+/* Private: stream the statements of a graph through a run of consecutive
+ * streaming processors, materialising the graph if there are further
+ * stages in the workflow; because the processors are invoked in turn for
+ * each batch, the stage time limit applies to them as a whole
+ */
+static int
+twine_workflow_stream_run_(TWINE *context, TWINEGRAPH *graph, TWINEWORKFLOW *wf, size_t first, size_t count, struct twine_workflow_source_struct *source)
+{
+	struct twine_callback_struct **stages;
+	CLUSTERJOB **jobs, *job;
+	TWINESTREAM *stream;
+	size_t c, triples, bytes, mark;
+	ssize_t failed;
+	uint64_t started;
+	int r;
+
+	if(twine_workflow_timer_start_(context, graph->job, wf->stages[first].name, &started))
+	{
+		return -1;
+	}
+	mark = twine_job_mark(context);
+	stages = (struct twine_callback_struct **) twine_job_alloc(context, count * sizeof(struct twine_callback_struct *));
+	jobs = (CLUSTERJOB **) twine_job_alloc(context, count * sizeof(CLUSTERJOB *));
+	if(!stages || !jobs)
+	{
+		twine_logf(LOG_CRIT, "failed to allocate memory for streaming processors\n");
+		twine_job_release(context, mark);
+		context->stage_deadline = 0;
+		return -1;
+	}
+	job = twine_job(context);
+	for(c = 0; c < count; c++)
+	{
+		stages[c] = twine_workflow_stream_stage_(context, wf->stages[first + c].name);
+		jobs[c] = cluster_job_create_job_name(job, wf->stages[first + c].name);
+		cluster_job_begin(jobs[c]);
+		twine_logf(LOG_DEBUG, "workflow: invoking streaming processor '%s'\n", wf->stages[first + c].name);
+	}
+	r = -1;
+	stream = twine_stream_create_(context, graph, stages, jobs, count);
+	if(stream)
+	{
+		if(source && first + count < wf->nstages)
+		{
+			twine_stream_materialise_(stream, graph->store, source->node);
+		}
+		r = twine_stream_begin_(stream);
+		if(!r)
+		{
+			if(source)
+			{
+				r = twine_workflow_source_stream_(stream, source);
+			}
+			else
+			{
+				r = twine_stream_model_(stream, graph->store);
+			}
+		}
+		if(twine_stream_end_(stream, r))
+		{
+			r = -1;
+		}
+		/* A time limit being exceeded is attributed to the stage which was
+		 * cancelled, if any
+		 */
+		failed = twine_stream_failed_(stream);
+		c = (failed >= 0 ? (size_t) failed : 0);
+		if(twine_workflow_timer_stop_(context, jobs[c], wf->stages[first + c].name, started))
+		{
+			r = -1;
+		}
+		if(!r && source && first + count == wf->nstages)
+		{
+			twine_stream_usage_(stream, &triples, &bytes);
+			twine_workflow_usage_(context, triples, bytes);
+		}
+		twine_stream_destroy_(stream);
+	}
+	else
+	{
+		context->stage_deadline = 0;
+	}
+	for(c = 0; c < count; c++)
+	{
+		if(r)
+		{
+			cluster_job_fail(jobs[c]);
+		}
+		else
+		{
+			cluster_job_complete(jobs[c]);
+		}
+		cluster_job_destroy(jobs[c]);
+	}
+	twine_job_release(context, mark);
+	return r;
+}
+
+/* Private: pass the statements from a graph's source along a stream */
+static int
+twine_workflow_source_stream_(TWINESTREAM *stream, struct twine_workflow_source_struct *source)
+{
+	static librdf_uri *base;
+
+	if(source->stream)
+	{
+		for(; !librdf_stream_end(source->stream); librdf_stream_next(source->stream))
+		{
+			if(twine_stream_add_(stream, librdf_stream_get_object(source->stream), source->node))
+			{
+				return -1;
+			}
+		}
+		return 0;
+	}
+	if(!base)
+	{
+		base = librdf_new_uri(twine_->world, (const unsigned char *) "/");
+		if(!base)
+		{
+			twine_logf(LOG_CRIT, "failed to parse URI </>\n");
+			return -1;
+		}
+	}
+	source->target = stream;
+	return twine_rdf_parse(source->type, source->buf, source->buflen, base, twine_workflow_source_statement_, source);
+}
+
+/* Private: statement callback used by twine_workflow_source_stream_() */
+static int
+twine_workflow_source_statement_(librdf_statement *statement, librdf_node *graph, void *userdata)
+{
+	struct twine_workflow_source_struct *source;
+
+	source = (struct twine_workflow_source_struct *) userdata;
+	return twine_stream_add_(source->target, statement, graph ? graph : source->node);
+}
+
+/* Private: populate a graph's model from its source */
+static int
+twine_workflow_materialise_(TWINEGRAPH *graph, struct twine_workflow_source_struct *source)
+{
+	if(source->stream)
+	{
+		if(librdf_model_context_add_statements(graph->store, source->node, source->stream))
+		{
+			twine_logf(LOG_ERR, "failed to add statements to graph <%s>\n", graph->uri);
+			return -1;
+		}
+		return 0;
+	}
+	return twine_rdf_model_parse_graph(graph->store, source->type, source->buf, source->buflen, source->node);
+}
+
+static int
+twine_workflow_parse_(TWINE *context, TWINEWORKFLOW *wf, char *str)
+{
+	char *p, *s;
+
+	/* Parse a workflow=foo,bar,baz configuration option
+	 * Note that processor names can be separated either with whitespace or
+	 * with commas or semicolons (or any combination of them), and empty
+	 * elements in the list are skipped. A tee(foo,bar) element is kept
+	 * together, up to its closing parenthesis.
+	 */
+	for(p = str; *p; p = s)
+	{
+		while(isspace(*p) || *p == ',' || *p == ';')
+		{
+			p++;
+		}
+		if(!*p)
+		{
+			break;
+		}
+		if(!strncmp(p, "tee(", 4))
+		{
+			s = strchr(p, ')');
+			if(!s)
+			{
+				twine_logf(LOG_CRIT, "unterminated tee(...) in workflow configuration\n");
+				return -1;
+			}
+			s++;
+			if(*s && !isspace(*s) && *s != ',' && *s != ';')
+			{
+				twine_logf(LOG_CRIT, "unexpected '%c' following tee(...) in workflow configuration\n", *s);
+				return -1;
+			}
+		}
+		else
+		{
+			for(s = p; *s && !isspace(*s) && *s != ',' && *s != ';'; s++) { }
+		}
+		if(*s)
+		{
+			*s = 0;
+			s++;
+		}
+		if(!*p)
+		{
+			continue;
+		}		
+		if(twine_workflow_add_(context, wf, p) < 0)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int
+twine_workflow_config_cb_(const char *key, const char *value, void *data)
+{
+	(void) key;
+
+	return twine_workflow_add_((TWINE *) data, &workflow, value);
+}
+
+/* Private: append a stage to a workflow */
+static int
+twine_workflow_add_(TWINE *context, TWINEWORKFLOW *wf, const char *value)
+{
+	struct twine_workflow_stage_struct *p;
+
+	p = (struct twine_workflow_stage_struct *) realloc(wf->stages, sizeof(struct twine_workflow_stage_struct) * (wf->nstages + 1));
+	if(!p)
+	{
+		twine_logf(LOG_CRIT, "failed to expand workflow list buffer\n");
+		return -1;
+	}
+	wf->stages = p;
+	memset(&(p[wf->nstages]), 0, sizeof(struct twine_workflow_stage_struct));
+	if(!strncmp(value, "tee(", 4))
+	{
+		if(twine_workflow_tee_init_(context, &(p[wf->nstages]), value))
+		{
+			return -1;
+		}
+	}
+	else if(twine_workflow_stage_init_(context, &(p[wf->nstages]), value))
+	{
+		return -1;
+	}
+	wf->nstages++;
+	return 0;
+}
+
+/* Private: configuration callback which finds the named workflows defined
+ * in sections whose names begin with 'workflow:', in the order in which
+ * they appear:
+ *
+ * [workflow:NAME]
+ * workflow=processor,processor...
+ * mime=type,type...
+ * subject=pattern,pattern...
+ * input=plug-in,plug-in...
+ */
+static int
+twine_workflow_routes_cb_(const char *key, const char *value, void *data)
+{
+	TWINEWORKFLOW *p;
+	TWINE *context;
+	const char *t;
+	char *buf, ***list;
+	size_t len;
+	int r;
+
+	context = (TWINE *) data;
+	if(strncmp(key, "workflow:", 9))
+	{
+		return 0;
+	}
+	key += 9;
+	while(isspace(*key))
+	{
+		key++;
+	}
+	t = strchr(key, ':');
+	if(!value || !t)
+	{
+		/* The start of a [workflow:NAME] section */
+		if(!value)
+		{
+			p = (TWINEWORKFLOW *) realloc(routes, sizeof(TWINEWORKFLOW) * (nroutes + 1));
+			if(!p)
+			{
+				twine_logf(LOG_CRIT, "failed to expand workflow list buffer\n");
+				return -1;
+			}
+			routes = p;
+			p = &(routes[nroutes]);
+			memset(p, 0, sizeof(TWINEWORKFLOW));
+			p->name = strdup(key);
+			if(!p->name)
+			{
+				twine_logf(LOG_CRIT, "failed to allocate memory for workflow '%s'\n", key);
+				return -1;
+			}
+			nroutes++;
+			twine_logf(LOG_DEBUG, "configuring workflow '%s'\n", p->name);
+		}
+		return 0;
+	}
+	len = t - key;
+	p = NULL;
+	if(nroutes && strlen(routes[nroutes - 1].name) == len && !strncmp(routes[nroutes - 1].name, key, len))
+	{
+		p = &(routes[nroutes - 1]);
+	}
+	if(!p)
+	{
+		/* This shouldn't ever happen */
+		return 0;
+	}
+	t++;
+	if(!strcmp(t, "workflow"))
+	{
+		buf = strdup(value);
+		if(!buf)
+		{
+			twine_logf(LOG_CRIT, "failed to allocate memory for workflow '%s'\n", p->name);
+			return -1;
+		}
+		r = twine_workflow_parse_(context, p, buf);
+		free(buf);
+		return r;
+	}
+	if(!strcmp(t, "mime"))
+	{
+		list = &(p->types);
+	}
+	else if(!strcmp(t, "subject"))
+	{
+		list = &(p->subjects);
+	}
+	else if(!strcmp(t, "input"))
+	{
+		list = &(p->plugins);
+	}
+	else
+	{
+		twine_logf(LOG_WARNING, "ignoring unsupported option '%s' for workflow '%s'\n", t, p->name);
+		return 0;
+	}
+	if(*list)
+	{
+		twine_logf(LOG_WARNING, "%s specified more than once for workflow '%s'; only the first will take effect\n", t, p->name);
+		return 0;
+	}
+	*list = twine_workflow_list_(value);
+	return 0;
+}
+
+/* Private: configure the named workflows, and check that each of them is
+ * usable
+ */
+static int
+twine_workflow_routes_(TWINE *context)
+{
+	size_t c;
+
+	if(twine_config_get_all(NULL, NULL, twine_workflow_routes_cb_, context) < 0)
+	{
+		return -1;
+	}
+	for(c = 0; c < nroutes; c++)
+	{
+		if(!routes[c].nstages)
+		{
+			twine_logf(LOG_CRIT, "workflow '%s' has no processors (set workflow=NAME,NAME... in the [workflow:%s] section)\n", routes[c].name, routes[c].name);
+			return -1;
+		}
+		if(!routes[c].types && !routes[c].subjects && !routes[c].plugins)
+		{
+			twine_logf(LOG_WARNING, "workflow '%s' has no routing criteria (mime, subject or input) and will never be used\n", routes[c].name);
+		}
+	}
+	return 0;
+}
+
+/* Private: split a list of names or patterns, separated in the same way as
+ * the processors in a workflow, into a NULL-terminated array; returns NULL
+ * if the list is empty
+ */
+static char **
+twine_workflow_list_(const char *str)
+{
+	char **list, **p, *buf, *s, *t;
+	size_t count;
+
+	buf = strdup(str);
+	if(!buf)
+	{
+		return NULL;
+	}
+	list = NULL;
+	count = 0;
+	for(s = buf; *s; s = t)
+	{
+		while(isspace(*s) || *s == ',' || *s == ';')
+		{
+			s++;
+		}
+		if(!*s)
+		{
+			break;
+		}
+		for(t = s; *t && !isspace(*t) && *t != ',' && *t != ';'; t++) { }
+		if(*t)
+		{
+			*t = 0;
+			t++;
+		}
+		p = (char **) realloc(list, sizeof(char *) * (count + 2));
+		if(!p)
+		{
+			twine_logf(LOG_CRIT, "failed to expand workflow routing list buffer\n");
+			break;
+		}
+		list = p;
+		list[count] = strdup(s);
+		if(!list[count])
+		{
+			twine_logf(LOG_CRIT, "failed to duplicate workflow routing pattern\n");
+			break;
+		}
+		count++;
+		list[count] = NULL;
+	}
+	free(buf);
+	return list;
+}
+
+/* Private: select the first named workflow which a message matches, if
+ * any; subject patterns are shell-style wildcards
+ */
+static TWINEWORKFLOW *
+twine_workflow_route_(const char *mimetype, size_t typelen, const char *subject, const char *plugin)
+{
+	size_t c, l;
+
+	for(c = 0; c < nroutes; c++)
+	{
+		if(!routes[c].types && !routes[c].subjects && !routes[c].plugins)
+		{
+			continue;
+		}
+		if(routes[c].types)
+		{
+			for(l = 0; routes[c].types[l]; l++)
+			{
+				if(!strncasecmp(routes[c].types[l], mimetype, typelen) && !routes[c].types[l][typelen])
+				{
+					break;
+				}
+			}
+			if(!routes[c].types[l])
+			{
+				continue;
+			}
+		}
+		if(routes[c].subjects)
+		{
+			if(!subject)
+			{
+				continue;
+			}
+			for(l = 0; routes[c].subjects[l]; l++)
+			{
+				if(!fnmatch(routes[c].subjects[l], subject, 0))
+				{
+					break;
+				}
+			}
+			if(!routes[c].subjects[l])
+			{
+				continue;
+			}
+		}
+		if(routes[c].plugins)
+		{
+			if(!plugin)
+			{
+				continue;
+			}
+			for(l = 0; routes[c].plugins[l]; l++)
+			{
+				if(!strcmp(routes[c].plugins[l], plugin))
+				{
+					break;
+				}
+			}
+			if(!routes[c].plugins[l])
+			{
+				continue;
+			}
+		}
+		twine_logf(LOG_DEBUG, "workflow: message routed to the '%s' workflow\n", routes[c].name);
+		return &(routes[c]);
+	}
+	return NULL;
+}
+
+/* Private: initialise a workflow stage which invokes a single processor */
+static int
+twine_workflow_stage_init_(TWINE *context, struct twine_workflow_stage_struct *stage, const char *name)
+{
+	twine_logf(LOG_DEBUG, "adding processor '%s' to workflow\n", name);
+	if(!twine_plugin_processor_exists(context, name))
+	{
+		twine_logf(LOG_CRIT, "graph processor '%s' named in workflow configuration does not exist (have all the necessary plug-ins been loaded?)\n", name);
+		return -1;
+	}
+	stage->name = strdup(name);
+	if(!stage->name)
+	{
+		twine_logf(LOG_CRIT, "failed to duplicate graph processor name while adding to workflow\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Private: initialise a tee(foo,bar) workflow stage, whose members are
+ * separated in the same way as the processors in the workflow itself
+ */
+static int
+twine_workflow_tee_init_(TWINE *context, struct twine_workflow_stage_struct *stage, const char *str)
+{
+	struct twine_workflow_stage_struct *members;
+	char *buf, *p, *s, *t;
+	size_t len;
+
+	len = strlen(str);
+	if(len < 5 || str[len - 1] != ')')
+	{
+		twine_logf(LOG_CRIT, "malformed tee '%s' in workflow configuration\n", str);
+		return -1;
+	}
+	buf = strdup(str);
+	/* The stage's name is rebuilt from its members, and so can't be longer
+	 * than the original
+	 */
+	stage->name = (char *) calloc(1, len + 1);
+	if(!buf || !stage->name)
+	{
+		twine_logf(LOG_CRIT, "failed to allocate memory for tee while adding to workflow\n");
+		free(buf);
+		return -1;
+	}
+	buf[len - 1] = 0;
+	strcpy(stage->name, "tee(");
+	t = stage->name + 4;
+	for(p = buf + 4; *p; p = s)
+	{
+		while(isspace(*p) || *p == ',' || *p == ';')
+		{
+			p++;
+		}
+		if(!*p)
+		{
+			break;
+		}
+		for(s = p; *s && !isspace(*s) && *s != ',' && *s != ';'; s++) { }
+		if(*s)
+		{
+			*s = 0;
+			s++;
+		}
+		if(strchr(p, '('))
+		{
+			twine_logf(LOG_CRIT, "tees cannot be nested within '%s' in workflow configuration\n", str);
+			free(buf);
+			return -1;
+		}
+		if(twine_workflow_stream_stage_(context, p))
+		{
+			twine_logf(LOG_CRIT, "streaming processor '%s' cannot be a member of a tee\n", p);
+			free(buf);
+			return -1;
+		}
+		members = (struct twine_workflow_stage_struct *) realloc(stage->members, sizeof(struct twine_workflow_stage_struct) * (stage->nmembers + 1));
+		if(!members)
+		{
+			twine_logf(LOG_CRIT, "failed to expand tee member list buffer\n");
+			free(buf);
+			return -1;
+		}
+		stage->members = members;
+		memset(&(members[stage->nmembers]), 0, sizeof(struct twine_workflow_stage_struct));
+		if(twine_workflow_stage_init_(context, &(members[stage->nmembers]), p))
+		{
+			free(buf);
+			return -1;
+		}
+		stage->nmembers++;
+		if(!(twine_workflow_flags_(context, p) & TWINE_PROC_READONLY))
+		{
+			twine_logf(LOG_WARNING, "graph processor '%s' in %s has not declared itself to be read-only; members of a tee must not modify the graph\n", p, str);
+		}
+		if(t > stage->name + 4)
+		{
+			*t = ',';
+			t++;
+		}
+		strcpy(t, p);
+		t += strlen(p);
+	}
+	free(buf);
+	if(!stage->nmembers)
+	{
+		twine_logf(LOG_CRIT, "tee in workflow configuration has no members\n");
 		return -1;
 	}
-	nworkflow++;
-	p[nworkflow] = NULL;
+	strcpy(t, ")");
+	twine_logf(LOG_DEBUG, "added %s to workflow\n", stage->name);
 	return 0;
 }
@@ -81,7 +81,7 @@ bulk_geonames(TWINE *restrict context, const char *restrict mime, const unsigned
 	char *graph;
 	const char *rdfxml, *topic;
 	const unsigned char *t, *p;
-	size_t remaining;
+	size_t remaining, mark;
 
 	(void) mime;
 	(void) data;
@@ -100,7 +100,11 @@ bulk_geonames(TWINE *restrict context, const char *restrict mime, const unsigned
 		{
 			return (const unsigned char *) topic;
 		}
-		graph = (char *) calloc(1, (const char *) p - topic + 16);
+		/* A bulk import is a single job, so release the graph name after
+		 * each record rather than at the end of the job
+		 */
+		mark = twine_job_mark(context);
+		graph = (char *) twine_job_alloc(context, (const char *) p - topic + 16);
 		if(!graph)
 		{
 			twine_logf(LOG_CRIT, "failed to allocate buffer for graph name\n");
@@ -113,17 +117,17 @@ bulk_geonames(TWINE *restrict context, const char *restrict mime, const unsigned
 		t = (const unsigned char *) strnchr(rdfxml, '\n', remaining);
 		if(!t)
 		{
-			free(graph);
+			twine_job_release(context, mark);
 			return (const unsigned char *) topic;
 		}
 		if(twine_workflow_process_rdf(context, graph, (const unsigned char *) rdfxml, (const char *) t - rdfxml, "application/rdf+xml"))
 		{
 			twine_logf(LOG_ERR, TWINE_PLUGIN_NAME ": failed to process graph <%s>\n", graph);
-			free(graph);
+			twine_job_release(context, mark);
 			return NULL;
 		}
 		t++;
-		free(graph);
+		twine_job_release(context, mark);
 	}
 	return t;
 }
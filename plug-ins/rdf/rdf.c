@@ -23,13 +23,50 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "libtwine.h"
 
 #define TWINE_PLUGIN_NAME               "rdf"
 
+/* How often, in statements, to check whether parsing should be abandoned
+ * because the message has run out of time
+ */
+#define RDF_CANCEL_INTERVAL             4096
+
+/* A named graph encountered while parsing */
+struct rdf_graph_struct
+{
+	librdf_node *node;
+	librdf_model *model;
+	const char *uri;
+	size_t urilen;
+	unsigned long hash;
+};
+
+struct rdf_parse_struct
+{
+	TWINE *context;
+	CLUSTERJOB *job;
+	size_t count;
+	struct rdf_graph_struct *graphs;
+	size_t ngraphs;
+	size_t size;
+	/* Open-addressed table of graph indices (plus one), keyed by URI */
+	size_t *index;
+	size_t indexsize;
+	/* The graph which the previous statement was added to */
+	size_t last;
+};
+
 static int process_rdf(TWINE *restrict context, const char *restrict mime, const unsigned char *restrict buf, size_t buflen, const char *restrict subject, void *data);
 static int dump_nquads(TWINE *restrict context, TWINEGRAPH *restrict graph, void *data);
+static int dump_binary(TWINE *restrict context, TWINEGRAPH *restrict graph, void *data);
+static int rdf_statement(librdf_statement *statement, librdf_node *graph, void *userdata);
+static struct rdf_graph_struct *rdf_graph_locate(struct rdf_parse_struct *parse, librdf_node *graph);
+static void rdf_graph_index(struct rdf_parse_struct *parse, size_t idx);
+static void rdf_parse_cleanup(struct rdf_parse_struct *parse);
+static unsigned long rdf_hash(const char *str, size_t len);
 
 /* Twine plug-in entry-point */
 int
@@ -44,7 +81,9 @@ twine_entry(TWINE *context, TWINEENTRYTYPE type, void *handle)
 		twine_plugin_add_input(context, "application/trig", "RDF TriG", process_rdf, NULL);
 		twine_plugin_add_input(context, "application/n-quads", "RDF N-Quads", process_rdf, NULL);
 		twine_plugin_add_input(context, "text/x-nquads", "RDF N-Quads", process_rdf, NULL);
-		twine_plugin_add_processor(context, "dump-nquads", dump_nquads, NULL);
+		twine_plugin_add_input(context, TWINE_MIME_BINARY, "Twine binary quads", process_rdf, NULL);
+		twine_plugin_add_processor_flags(context, "dump-nquads", dump_nquads, NULL, TWINE_PROC_READONLY | TWINE_PROC_THREADSAFE);
+		twine_plugin_add_processor_flags(context, "dump-binary", dump_binary, NULL, TWINE_PROC_READONLY | TWINE_PROC_THREADSAFE);
 		break;
 	case TWINE_DETACHED:
 		break;
@@ -58,96 +97,228 @@ twine_entry(TWINE *context, TWINEENTRYTYPE type, void *handle)
  * Although in principle this processor can handle anything that librdf can
  * parse, it will do nothing unless there are named graphs present, and so
  * only N-Quads and TriG MIME types are registered.
+ *
+ * Statements are routed into a separate model for each named graph as they
+ * are parsed, and each model is then handed to the workflow as-is.
  */
 
 static int
 process_rdf(TWINE *restrict context, const char *restrict mime, const unsigned char *restrict buf, size_t buflen, const char *restrict subject, void *data)
 {
-	librdf_model *model;
-	librdf_iterator *iter;
-	librdf_node *node;
-	librdf_uri *uri;
-	librdf_stream *stream;
-	size_t graphtotal, graphcount;
+	struct rdf_parse_struct parse;
+	librdf_uri *base;
+	size_t c;
 	int r;
-	CLUSTERJOB *job;
 
 	(void) subject;
 	(void) data;
 
-	r = 0;
-	job = twine_job(context);
-	model = twine_rdf_model_create();
-	if(!model)
+	memset(&parse, 0, sizeof(parse));
+	parse.context = context;
+	parse.job = twine_job(context);
+	base = twine_rdf_uri_create("/");
+	if(!base)
 	{
-		cluster_job_logf(job, LOG_CRIT, TWINE_PLUGIN_NAME ": failed to create new RDF model\n");
 		return -1;
 	}
-	twine_logf(LOG_DEBUG, TWINE_PLUGIN_NAME ": parsing buffer into model as '%s'\n", mime);
-	if(twine_rdf_model_parse(model, mime, (const char *) buf, buflen))
+	twine_logf(LOG_DEBUG, TWINE_PLUGIN_NAME ": parsing buffer into graphs as '%s'\n", mime);
+	r = twine_rdf_parse(mime, (const char *) buf, buflen, base, rdf_statement, &parse);
+	librdf_free_uri(base);
+	if(r)
 	{
-		cluster_job_logf(job, LOG_ERR, TWINE_PLUGIN_NAME ": failed to parse %s buffer of %lu bytes into model\n", mime, (unsigned long) buflen);
-		twine_rdf_model_destroy(model);
+		cluster_job_logf(parse.job, LOG_ERR, TWINE_PLUGIN_NAME ": failed to parse %s buffer of %lu bytes into graphs\n", mime, (unsigned long) buflen);
+		rdf_parse_cleanup(&parse);
 		return -1;
 	}
-	iter = librdf_model_get_contexts(model);
-	if(!iter)
+	cluster_job_set_total(parse.job, parse.ngraphs);
+	if(!parse.ngraphs)
 	{
-		cluster_job_logf(job, LOG_ERR, TWINE_PLUGIN_NAME ": failed to obtain named graphs iterator\n");
-		twine_rdf_model_destroy(model);
+		cluster_job_logf(parse.job, LOG_ERR, TWINE_PLUGIN_NAME ": parsed model contains no named graphs to process\n");
+		rdf_parse_cleanup(&parse);
 		return -1;
 	}
-	if(librdf_iterator_end(iter))
+	for(c = 0; c < parse.ngraphs; c++)
+	{
+		cluster_job_set_progress(parse.job, c);
+		twine_logf(LOG_DEBUG, TWINE_PLUGIN_NAME ": processing graph %d of %d: <%s>\n", (int) c + 1, (int) parse.ngraphs, parse.graphs[c].uri);
+		/* The workflow takes ownership of the model */
+		r = twine_workflow_process_model(context, parse.graphs[c].uri, parse.graphs[c].model);
+		parse.graphs[c].model = NULL;
+		if(r)
+		{
+			cluster_job_logf(parse.job, LOG_ERR, TWINE_PLUGIN_NAME ": failed to process graph <%s>\n", parse.graphs[c].uri);
+			r = 1;
+			break;
+		}
+	}
+	cluster_job_set_progress(parse.job, c);
+	rdf_parse_cleanup(&parse);
+	return r;
+}
+
+/* Statement callback used by process_rdf(), which adds each statement to
+ * the model for its graph; statements which aren't in a named graph are
+ * ignored
+ */
+static int
+rdf_statement(librdf_statement *statement, librdf_node *graph, void *userdata)
+{
+	struct rdf_parse_struct *parse;
+	struct rdf_graph_struct *g;
+
+	parse = (struct rdf_parse_struct *) userdata;
+	parse->count++;
+	if(!(parse->count % RDF_CANCEL_INTERVAL) && twine_cancelled(parse->context))
 	{
-		cluster_job_logf(job, LOG_ERR, TWINE_PLUGIN_NAME ": parsed model contains no named graphs to process\n");
-		librdf_free_iterator(iter);
-		twine_rdf_model_destroy(model);
-		cluster_job_set_total(job, 0);
+		cluster_job_logf(parse->job, LOG_ERR, TWINE_PLUGIN_NAME ": parsing abandoned after %lu statements because the message ran out of time\n", (unsigned long) parse->count);
 		return -1;
 	}
-	for(graphtotal = 0; !librdf_iterator_end(iter); graphtotal++)
+	if(!graph || !librdf_node_is_resource(graph))
 	{
-		librdf_iterator_next(iter);
+		return 0;
 	}
-	cluster_job_set_total(job, graphtotal);
-	librdf_free_iterator(iter);
-	graphcount = 0;
-	iter = librdf_model_get_contexts(model);
-	if(!iter)
+	/* Statements are usually grouped by graph */
+	if(parse->ngraphs && librdf_node_equals(parse->graphs[parse->last].node, graph))
 	{
-		cluster_job_logf(job, LOG_ERR, TWINE_PLUGIN_NAME ": failed to obtain named graphs iterator\n");
-		twine_rdf_model_destroy(model);
-		return -1;
+		g = &(parse->graphs[parse->last]);
 	}
-	while(!librdf_iterator_end(iter))
+	else
 	{
-		cluster_job_set_progress(job, graphcount);
-		node = (librdf_node *) librdf_iterator_get_object(iter);
-		if(!node)
+		g = rdf_graph_locate(parse, graph);
+		if(!g)
 		{
-			graphcount++;
-			continue;
+			return -1;
 		}
-		else if(librdf_node_is_resource(node))
+	}
+	if(librdf_model_context_add_statement(g->model, g->node, statement))
+	{
+		cluster_job_logf(parse->job, LOG_ERR, TWINE_PLUGIN_NAME ": failed to add statement to graph <%s>\n", g->uri);
+		return -1;
+	}
+	return 0;
+}
+
+/* Find the entry for a graph, adding it if it hasn't been seen before */
+static struct rdf_graph_struct *
+rdf_graph_locate(struct rdf_parse_struct *parse, librdf_node *graph)
+{
+	struct rdf_graph_struct *g;
+	const char *uri;
+	size_t len, c, n;
+	unsigned long hash;
+	size_t *index;
+
+	uri = (const char *) librdf_uri_as_counted_string(librdf_node_get_uri(graph), &len);
+	hash = rdf_hash(uri, len);
+	if(parse->indexsize)
+	{
+		for(c = hash & (parse->indexsize - 1); parse->index[c]; c = (c + 1) & (parse->indexsize - 1))
 		{
-			uri = librdf_node_get_uri(node);
-			twine_logf(LOG_DEBUG, TWINE_PLUGIN_NAME ": processing graph %d of %d: <%s>\n", graphcount + 1, graphtotal, (const char *) librdf_uri_as_string(uri));
-			stream = librdf_model_context_as_stream(model, node);
-			if(twine_workflow_process_stream(context, (const char *) librdf_uri_as_string(uri), stream))
+			g = &(parse->graphs[parse->index[c] - 1]);
+			if(g->hash == hash && g->urilen == len && !memcmp(g->uri, uri, len))
 			{
-				cluster_job_logf(job, LOG_ERR, TWINE_PLUGIN_NAME ": failed to process graph <%s>\n", (const char *) librdf_uri_as_string(uri));
-				r = 1;
-				break;
+				parse->last = parse->index[c] - 1;
+				return g;
 			}
-			librdf_free_stream(stream);
 		}
-		librdf_iterator_next(iter);
-		graphcount++;
 	}
-	cluster_job_set_progress(job, graphcount);
-	librdf_free_iterator(iter);
-	twine_rdf_model_destroy(model);
-	return r;
+	if(parse->ngraphs >= parse->size)
+	{
+		n = (parse->size ? parse->size * 2 : 8);
+		g = (struct rdf_graph_struct *) realloc(parse->graphs, n * sizeof(struct rdf_graph_struct));
+		if(!g)
+		{
+			cluster_job_logf(parse->job, LOG_CRIT, TWINE_PLUGIN_NAME ": failed to allocate memory for graph list\n");
+			return NULL;
+		}
+		parse->graphs = g;
+		parse->size = n;
+	}
+	if((parse->ngraphs + 1) * 2 > parse->indexsize)
+	{
+		/* Rebuild the index at twice the size */
+		n = (parse->indexsize ? parse->indexsize * 2 : 16);
+		index = (size_t *) calloc(n, sizeof(size_t));
+		if(!index)
+		{
+			cluster_job_logf(parse->job, LOG_CRIT, TWINE_PLUGIN_NAME ": failed to allocate memory for graph index\n");
+			return NULL;
+		}
+		free(parse->index);
+		parse->index = index;
+		parse->indexsize = n;
+		for(c = 0; c < parse->ngraphs; c++)
+		{
+			rdf_graph_index(parse, c);
+		}
+	}
+	g = &(parse->graphs[parse->ngraphs]);
+	memset(g, 0, sizeof(struct rdf_graph_struct));
+	g->node = twine_rdf_node_clone(graph);
+	g->model = twine_rdf_model_create();
+	if(!g->node || !g->model)
+	{
+		cluster_job_logf(parse->job, LOG_CRIT, TWINE_PLUGIN_NAME ": failed to create new RDF model\n");
+		if(g->node)
+		{
+			twine_rdf_node_destroy(g->node);
+		}
+		if(g->model)
+		{
+			twine_rdf_model_destroy(g->model);
+		}
+		return NULL;
+	}
+	g->uri = (const char *) librdf_uri_as_counted_string(librdf_node_get_uri(g->node), &(g->urilen));
+	g->hash = hash;
+	rdf_graph_index(parse, parse->ngraphs);
+	parse->last = parse->ngraphs;
+	parse->ngraphs++;
+	return g;
+}
+
+/* Add a graph to the open-addressed index of graph entries */
+static void
+rdf_graph_index(struct rdf_parse_struct *parse, size_t idx)
+{
+	size_t c;
+
+	for(c = parse->graphs[idx].hash & (parse->indexsize - 1); parse->index[c]; c = (c + 1) & (parse->indexsize - 1)) { }
+	parse->index[c] = idx + 1;
+}
+
+/* Release the graphs which haven't been passed to the workflow */
+static void
+rdf_parse_cleanup(struct rdf_parse_struct *parse)
+{
+	size_t c;
+
+	for(c = 0; c < parse->ngraphs; c++)
+	{
+		if(parse->graphs[c].model)
+		{
+			twine_rdf_model_destroy(parse->graphs[c].model);
+		}
+		twine_rdf_node_destroy(parse->graphs[c].node);
+	}
+	free(parse->graphs);
+	free(parse->index);
+}
+
+/* FNV-1a hash of a graph URI */
+static unsigned long
+rdf_hash(const char *str, size_t len)
+{
+	unsigned long hash;
+	size_t c;
+
+	hash = 2166136261UL;
+	for(c = 0; c < len; c++)
+	{
+		hash ^= (unsigned char) str[c];
+		hash *= 16777619UL;
+	}
+	return hash;
 }
 
 /* Graph processor which simply outputs the contents of the graph as N-Quads,
@@ -173,3 +344,27 @@ dump_nquads(TWINE *restrict context, TWINEGRAPH *restrict graph, void *data)
 	librdf_free_memory(quads);
 	return 0;
 }
+
+/* Graph processor which outputs the contents of the graph in Twine's binary
+ * quad format, for passing to another Twine instance. The serialised quads
+ * are written to standard output.
+ */
+static int
+dump_binary(TWINE *restrict context, TWINEGRAPH *restrict graph, void *data)
+{
+	unsigned char *buf;
+	size_t buflen;
+
+	(void) context;
+	(void) data;
+
+	buf = twine_rdf_model_binary(twine_graph_model(graph), &buflen);
+	if(!buf)
+	{
+		twine_logf(LOG_ERR, TWINE_PLUGIN_NAME ": failed to generate binary quads for <%s>\n", twine_graph_uri(graph));
+		return -1;
+	}
+	fwrite(buf, buflen, 1, stdout);
+	free(buf);
+	return 0;
+}
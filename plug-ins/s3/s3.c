@@ -92,7 +92,8 @@ process_s3(TWINE *restrict context, const char *restrict mime, const unsigned ch
 	{
 		buflen = 1024;
 	}
-	str = (char *) calloc(1, buflen + 1);
+	/* The URL string is released along with the job */
+	str = (char *) twine_job_alloc(context, buflen + 1);
 	if(!str)
 	{
 		return -1;
@@ -109,7 +110,6 @@ process_s3(TWINE *restrict context, const char *restrict mime, const unsigned ch
 	if(!uri)
 	{
 		twine_logf(LOG_ERR, TWINE_PLUGIN_NAME ": failed to parse <%s>\n", str);
-		free(str);
 		return -1;
 	}
 	info = uri_info(uri);
@@ -118,7 +118,6 @@ process_s3(TWINE *restrict context, const char *restrict mime, const unsigned ch
 		twine_logf(LOG_ERR, TWINE_PLUGIN_NAME ": <%s> is not a valid S3 URL\n", str);
 		uri_info_destroy(info);
 		uri_destroy(uri);
-		free(str);
 		return -1;
 	}
 	bucket = get_bucket(info->host);
@@ -127,13 +126,11 @@ process_s3(TWINE *restrict context, const char *restrict mime, const unsigned ch
 		twine_logf(LOG_ERR, TWINE_PLUGIN_NAME ": failed to obtain bucket for <%s>\n", str);
 		uri_info_destroy(info);
 		uri_destroy(uri);
-		free(str);
 		return -1;
 	}
 	r = ingest_resource(context, bucket, info->path);
 	uri_info_destroy(info);
 	uri_destroy(uri);
-	free(str);
 	return r;
 }
 
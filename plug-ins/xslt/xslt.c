@@ -288,7 +288,7 @@ xslt_process_buf(TWINE *context, const char *restrict buf, size_t buflen, xsltSt
 	xmlXPathObjectPtr xpobj;
 	int xmlbuflen;
 	librdf_model *model;
-	librdf_stream *stream;
+	librdf_node *node;
 	char *p;
 
 	/* Parse the incoming buffer as an XML document */
@@ -317,31 +317,12 @@ xslt_process_buf(TWINE *context, const char *restrict buf, size_t buflen, xsltSt
 		return -1;
 	}
 	xmlFreeDoc(res);
-	/* Create an RDF model to store the graph in */
-	model = twine_rdf_model_create();
-	if(!model)
-	{
-		twine_logf(LOG_ERR, "failed to create a new RDF model\n");
-		free(xmlbuf);
-		xmlFreeDoc(xmldoc);
-		return -1;
-	}
-	/* Parse the RDF/XML result of the stylesheet */
-	if(twine_rdf_model_parse(model, "application/rdf+xml", (const char *) xmlbuf, (size_t) xmlbuflen))
-	{
-		twine_logf(LOG_ERR, "failed to parse transformed RDF/XML into RDF model\n");
-		free(xmlbuf);
-		librdf_free_model(model);
-		xmlFreeDoc(xmldoc);
-		return -1;
-	}	
-	free(xmlbuf);
 	/* Find the subject in the form <http://example.com/things/ID#id> */
 	xpctx = xmlXPathNewContext(xmldoc);
 	if(!xpctx)
 	{
 		twine_logf(LOG_CRIT, "failed to create new XPath context from XML document\n");
-		librdf_free_model(model);
+		free(xmlbuf);
 		xmlFreeDoc(xmldoc);
 		return -1;
 	}
@@ -349,7 +330,7 @@ xslt_process_buf(TWINE *context, const char *restrict buf, size_t buflen, xsltSt
 	if(!xpobj)
 	{
 		twine_logf(LOG_ERR, "failed to evaluate Graph URI XPath expression: %s\n", xpath);
-		librdf_free_model(model);
+		free(xmlbuf);
 		xmlXPathFreeContext(xpctx);
 		xmlFreeDoc(xmldoc);
 		return -1;
@@ -357,29 +338,47 @@ xslt_process_buf(TWINE *context, const char *restrict buf, size_t buflen, xsltSt
 	if(xpobj->type != XPATH_STRING)
 	{
 		twine_logf(LOG_ERR, "Graph URI XPath expression did not result in a string node\n");
-		librdf_free_model(model);
+		free(xmlbuf);
+		xmlXPathFreeObject(xpobj);
 		xmlXPathFreeContext(xpctx);
 		xmlFreeDoc(xmldoc);
 		return -1;
 	}
 	twine_logf(LOG_DEBUG, "Graph URI XPath result: <%s>\n", xpobj->stringval);
-	p = strdup((const char *) xpobj->stringval);
+	p = twine_job_strdup(context, (const char *) xpobj->stringval);
+	xmlXPathFreeObject(xpobj);
+	xmlXPathFreeContext(xpctx);
+	xmlFreeDoc(xmldoc);
 	if(!p)
 	{
 		twine_logf(LOG_CRIT, "failed to duplicate graph URI XPath result string\n");
-		librdf_free_model(model);
-		xmlXPathFreeContext(xpctx);
-		xmlFreeDoc(xmldoc);
+		free(xmlbuf);
 		return -1;
-	}		
-	xmlXPathFreeContext(xpctx);
-	xmlFreeDoc(xmldoc);
-	/* Replace the graph */
-	stream = librdf_model_as_stream(model);	
-	twine_workflow_process_stream(context, p, stream);
-	/* Clean up */
-	free(p);
-	librdf_free_stream(stream);
-	librdf_free_model(model);
+	}
+	/* Parse the RDF/XML result of the stylesheet directly into the model
+	 * which will become the graph
+	 */
+	node = twine_rdf_node_createuri(p);
+	model = twine_rdf_model_create();
+	if(!node || !model)
+	{
+		twine_logf(LOG_ERR, "failed to create a new RDF model\n");
+		twine_rdf_node_destroy(node);
+		twine_rdf_model_destroy(model);
+		free(xmlbuf);
+		return -1;
+	}
+	if(twine_rdf_model_parse_graph(model, "application/rdf+xml", (const char *) xmlbuf, (size_t) xmlbuflen, node))
+	{
+		twine_logf(LOG_ERR, "failed to parse transformed RDF/XML into RDF model\n");
+		twine_rdf_node_destroy(node);
+		twine_rdf_model_destroy(model);
+		free(xmlbuf);
+		return -1;
+	}
+	twine_rdf_node_destroy(node);
+	free(xmlbuf);
+	/* Replace the graph; the model is consumed by the workflow */
+	twine_workflow_process_model(context, p, model);
 	return 0;
 }